@@ -0,0 +1,430 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * Compares the lookup cost and the keys remapped on a change of the peers
+ * for the ketama ring and the maglev table of "hash ... consistent",
+ * built the same way as in ngx_http_upstream_hash_module.c.
+ *
+ *     cc -O2 -o chash_bench chash_bench.c
+ *     ./chash_bench [peers] [keys]
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+
+typedef struct {
+    uint32_t   hash;
+    unsigned   peer;
+} point_t;
+
+
+typedef struct {
+    point_t   *point;
+    unsigned   number;
+} ring_t;
+
+
+typedef struct {
+    uint32_t  *table;
+    unsigned   size;
+} maglev_t;
+
+
+static uint32_t  crc32_table[256];
+
+#define MAGLEV_SIZE  65521
+
+
+static void
+crc32_init(void)
+{
+    uint32_t  c;
+    unsigned  i, k;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+
+        crc32_table[i] = c;
+    }
+}
+
+
+static uint32_t
+crc32_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len--) {
+        crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+
+static uint32_t
+crc32(const void *p, size_t len)
+{
+    return crc32_update(0xffffffff, p, len) ^ 0xffffffff;
+}
+
+
+static uint32_t
+murmur_hash2(const unsigned char *data, size_t len)
+{
+    uint32_t  h, k;
+
+    h = 0 ^ len;
+
+    while (len >= 4) {
+        k  = data[0];
+        k |= data[1] << 8;
+        k |= data[2] << 16;
+        k |= (uint32_t) data[3] << 24;
+
+        k *= 0x5bd1e995;
+        k ^= k >> 24;
+        k *= 0x5bd1e995;
+
+        h *= 0x5bd1e995;
+        h ^= k;
+
+        data += 4;
+        len -= 4;
+    }
+
+    switch (len) {
+    case 3:
+        h ^= data[2] << 16;
+        /* fall through */
+    case 2:
+        h ^= data[1] << 8;
+        /* fall through */
+    case 1:
+        h ^= data[0];
+        h *= 0x5bd1e995;
+    }
+
+    h ^= h >> 13;
+    h *= 0x5bd1e995;
+    h ^= h >> 15;
+
+    return h;
+}
+
+
+static int
+point_cmp(const void *one, const void *two)
+{
+    const point_t  *first = one, *second = two;
+
+    return (first->hash > second->hash) - (first->hash < second->hash);
+}
+
+
+static void
+ring_build(ring_t *ring, char **names, unsigned *weights, unsigned n)
+{
+    unsigned       i, j, w, len;
+    uint32_t       hash, base_hash;
+    union {
+        uint32_t       value;
+        unsigned char  byte[4];
+    } prev_hash;
+
+    w = 0;
+
+    for (i = 0; i < n; i++) {
+        w += weights[i];
+    }
+
+    ring->point = malloc(sizeof(point_t) * 160 * w);
+    ring->number = 0;
+
+    for (i = 0; i < n; i++) {
+        len = strlen(names[i]);
+
+        /* the same as ngx_http_upstream_update_chash() for "host:port" */
+
+        base_hash = crc32_update(0xffffffff, (unsigned char *) names[i], len);
+        base_hash = crc32_update(base_hash, (unsigned char *) "", 1);
+
+        prev_hash.value = 0;
+
+        for (j = 0; j < 160 * weights[i]; j++) {
+            hash = crc32_update(base_hash, prev_hash.byte, 4) ^ 0xffffffff;
+
+            ring->point[ring->number].hash = hash;
+            ring->point[ring->number].peer = i;
+            ring->number++;
+
+            prev_hash.value = hash;
+        }
+    }
+
+    qsort(ring->point, ring->number, sizeof(point_t), point_cmp);
+
+    for (i = 0, j = 1; j < ring->number; j++) {
+        if (ring->point[i].hash != ring->point[j].hash) {
+            ring->point[++i] = ring->point[j];
+        }
+    }
+
+    ring->number = i + 1;
+}
+
+
+static unsigned
+ring_lookup(ring_t *ring, uint32_t hash)
+{
+    unsigned  i, j, k;
+
+    /* find best match */
+
+    i = 0;
+    j = ring->number;
+
+    while (i < j) {
+        k = (i + j) / 2;
+
+        if (hash > ring->point[k].hash) {
+            i = k + 1;
+
+        } else if (hash < ring->point[k].hash) {
+            j = k;
+
+        } else {
+            return ring->point[k].peer;
+        }
+    }
+
+    return ring->point[i % ring->number].peer;
+}
+
+
+static void
+maglev_build(maglev_t *mg, char **names, unsigned *weights, unsigned n)
+{
+    unsigned   i, c, size, filled, max_weight;
+    unsigned  *offset, *skip, *next, *credit;
+
+    size = MAGLEV_SIZE;
+
+    mg->table = malloc(size * sizeof(uint32_t));
+    mg->size = size;
+
+    offset = malloc(4 * n * sizeof(unsigned));
+    skip = offset + n;
+    next = skip + n;
+    credit = next + n;
+
+    max_weight = 0;
+
+    for (i = 0; i < n; i++) {
+        offset[i] = crc32(names[i], strlen(names[i])) % size;
+        skip[i] = murmur_hash2((unsigned char *) names[i], strlen(names[i]))
+                  % (size - 1) + 1;
+        next[i] = 0;
+        credit[i] = 0;
+
+        if (weights[i] > max_weight) {
+            max_weight = weights[i];
+        }
+    }
+
+    for (c = 0; c < size; c++) {
+        mg->table[c] = (uint32_t) -1;
+    }
+
+    filled = 0;
+
+    for ( ;; ) {
+        for (i = 0; i < n; i++) {
+            credit[i] += weights[i];
+
+            if (credit[i] < max_weight) {
+                continue;
+            }
+
+            credit[i] -= max_weight;
+
+            do {
+                c = (offset[i] + next[i] * skip[i]) % size;
+                next[i]++;
+            } while (mg->table[c] != (uint32_t) -1);
+
+            mg->table[c] = i;
+
+            if (++filled == size) {
+                goto done;
+            }
+        }
+    }
+
+done:
+
+    free(offset);
+}
+
+
+static unsigned
+maglev_lookup(maglev_t *mg, uint32_t hash)
+{
+    return mg->table[hash % mg->size];
+}
+
+
+static double
+now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    char       **names, **shifted, buf[32];
+    double       start, ketama_ns, maglev_ns;
+    unsigned     i, n, nkeys, *weights, a, b, c, d, sink;
+    unsigned     ketama_del, ketama_add, maglev_del, maglev_add;
+    unsigned     ketama_max, maglev_max, *count;
+    uint32_t    *hashes;
+    ring_t       ring, ring_del, ring_add;
+    maglev_t     mg, mg_del, mg_add;
+
+    n = argc > 1 ? (unsigned) atoi(argv[1]) : 10;
+    nkeys = argc > 2 ? (unsigned) atoi(argv[2]) : 1000000;
+
+    if (n < 2 || nkeys == 0) {
+        fprintf(stderr, "usage: %s [peers >= 2] [keys]\n", argv[0]);
+        return 1;
+    }
+
+    crc32_init();
+
+    names = malloc((n + 1) * sizeof(char *));
+    weights = malloc((n + 1) * sizeof(unsigned));
+
+    for (i = 0; i < n + 1; i++) {
+        snprintf(buf, sizeof(buf), "10.0.%u.%u:80", i / 250, i % 250 + 1);
+        names[i] = strdup(buf);
+        weights[i] = 1;
+    }
+
+    /* the configured peers, without the second one, with one more peer */
+
+    shifted = malloc(n * sizeof(char *));
+
+    for (i = 0; i < n; i++) {
+        shifted[i] = names[i < 1 ? i : i + 1];
+    }
+
+    ring_build(&ring, names, weights, n);
+    ring_build(&ring_del, shifted, weights, n - 1);
+    ring_build(&ring_add, names, weights, n + 1);
+
+    maglev_build(&mg, names, weights, n);
+    maglev_build(&mg_del, shifted, weights, n - 1);
+    maglev_build(&mg_add, names, weights, n + 1);
+
+    hashes = malloc(nkeys * sizeof(uint32_t));
+
+    for (i = 0; i < nkeys; i++) {
+        snprintf(buf, sizeof(buf), "/object/%u", i);
+        hashes[i] = crc32(buf, strlen(buf));
+    }
+
+    sink = 0;
+
+    start = now();
+
+    for (i = 0; i < nkeys; i++) {
+        sink += ring_lookup(&ring, hashes[i]);
+    }
+
+    ketama_ns = (now() - start) / nkeys;
+
+    start = now();
+
+    for (i = 0; i < nkeys; i++) {
+        sink += maglev_lookup(&mg, hashes[i]);
+    }
+
+    maglev_ns = (now() - start) / nkeys;
+
+    /* peer indices of the shifted set are mapped back to the names */
+
+    ketama_del = ketama_add = maglev_del = maglev_add = 0;
+
+    count = calloc(2 * n, sizeof(unsigned));
+
+    for (i = 0; i < nkeys; i++) {
+        a = ring_lookup(&ring, hashes[i]);
+        b = ring_lookup(&ring_del, hashes[i]);
+        c = maglev_lookup(&mg, hashes[i]);
+        d = maglev_lookup(&mg_del, hashes[i]);
+
+        count[a]++;
+        count[n + c]++;
+
+        if (names[a] != shifted[b]) {
+            ketama_del++;
+        }
+
+        if (names[c] != shifted[d]) {
+            maglev_del++;
+        }
+
+        if (ring_lookup(&ring_add, hashes[i]) != a) {
+            ketama_add++;
+        }
+
+        if (maglev_lookup(&mg_add, hashes[i]) != c) {
+            maglev_add++;
+        }
+    }
+
+    ketama_max = maglev_max = 0;
+
+    for (i = 0; i < n; i++) {
+        if (count[i] > ketama_max) {
+            ketama_max = count[i];
+        }
+
+        if (count[n + i] > maglev_max) {
+            maglev_max = count[n + i];
+        }
+    }
+
+    printf("peers: %u, keys: %u, ideal share: %.2f%%\n\n",
+           n, nkeys, 100.0 / n);
+
+    printf("%-8s %10s %10s %12s %12s %12s\n", "method", "entries",
+           "ns/lookup", "max share", "remap -1", "remap +1");
+
+    printf("%-8s %10u %10.1f %11.2f%% %11.2f%% %11.2f%%\n", "ketama",
+           ring.number, ketama_ns, 100.0 * ketama_max / nkeys,
+           100.0 * ketama_del / nkeys, 100.0 * ketama_add / nkeys);
+
+    printf("%-8s %10u %10.1f %11.2f%% %11.2f%% %11.2f%%\n", "maglev",
+           mg.size, maglev_ns, 100.0 * maglev_max / nkeys,
+           100.0 * maglev_del / nkeys, 100.0 * maglev_add / nkeys);
+
+    return sink == 0xffffffff;
+}
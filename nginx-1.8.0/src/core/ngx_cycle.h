@@ -34,6 +34,7 @@ struct ngx_shm_zone_s {
     ngx_shm_t                 shm;          //共享内存结构体
     ngx_shm_zone_init_pt      init;         //初始化函数
     void                     *tag;
+    ngx_uint_t                noreuse;      //重新加载配置时不复用旧的共享内存
 };
 
 /*
@@ -29,14 +29,25 @@ struct ngx_file_s {
     ngx_int_t                (*thread_handler)(ngx_thread_task_t *task,
                                                ngx_file_t *file);
     void                      *thread_ctx;
+
+    off_t                      resident_start;      //上次探测确认驻留在页缓存中的数据范围的起始位置
+    off_t                      resident_end;        //上次探测确认驻留在页缓存中的数据范围的结束位置
+    off_t                      readahead;           //已经发起预读的数据的结束位置
+    ngx_msec_t                 resident_time;       //上次探测的时间，探测结果只在短时间内有效
 #endif
 
 #if (NGX_HAVE_FILE_AIO)
     ngx_event_aio_t           *aio;
+    ngx_event_aio_t           *write_aio;           //异步写入使用的aio对象
 #endif
 
     unsigned                   valid_info:1;
     unsigned                   directio:1;
+#if (NGX_THREADS)
+    unsigned                   noprobe:1;           //无法探测文件在页缓存中的驻留情况，总是交给线程池发送
+    unsigned                   probed:1;            //已经检查过是否可以使用mincore()探测
+    unsigned                   mincore:1;           //文件属于worker进程的用户，mincore()的结果可信
+#endif
 };
 
 
@@ -85,6 +96,7 @@ typedef struct {
     unsigned                   log_level:8;             //日志等级
     unsigned                   persistent:1;            //是否已经存在
     unsigned                   clean:1;
+    unsigned                   aio_write:1;             //是否使用文件异步I/O写入
 } ngx_temp_file_t;
 
 /*
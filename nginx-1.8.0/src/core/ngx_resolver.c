@@ -8,10 +8,14 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_event.h>
+#include <ngx_event_connect.h>
 
 
 #define NGX_RESOLVER_UDP_SIZE   4096
 
+#define NGX_RESOLVER_TCP_RSIZE  (2 + 65535)
+#define NGX_RESOLVER_TCP_WSIZE  8192
+
 
 typedef struct {
     u_char  ident_hi;
@@ -48,12 +52,34 @@ typedef struct {
 } ngx_resolver_an_t;
 
 
+/*
+ * a name in the shared cache, the data are the IPv4 addresses,
+ * the IPv6 addresses, the canonical name and the name
+ */
+
+typedef struct {
+    ngx_str_node_t            sn;
+    ngx_queue_t               queue;
+
+    time_t                    valid;
+    time_t                    updating;
+    uint32_t                  ttl;
+
+    u_short                   cnlen;
+    u_short                   naddrs;
+    u_short                   naddrs6;
+
+    u_char                    data[1];
+} ngx_resolver_shared_node_t;
+
+
 #define ngx_resolver_node(n)                                                 \
     (ngx_resolver_node_t *)                                                  \
         ((u_char *) (n) - offsetof(ngx_resolver_node_t, node))
 
 
 ngx_int_t ngx_udp_connect(ngx_udp_connection_t *uc);
+static ngx_int_t ngx_tcp_connect(ngx_udp_connection_t *uc);
 
 
 static void ngx_resolver_cleanup(void *data);
@@ -64,6 +90,15 @@ static void ngx_resolver_expire(ngx_resolver_t *r, ngx_rbtree_t *tree,
     ngx_queue_t *queue);
 static ngx_int_t ngx_resolver_send_query(ngx_resolver_t *r,
     ngx_resolver_node_t *rn);
+static ngx_int_t ngx_resolver_send_udp_query(ngx_resolver_t *r,
+    ngx_udp_connection_t *uc, u_char *query, u_short qlen);
+static ngx_int_t ngx_resolver_send_tcp_query(ngx_resolver_t *r,
+    ngx_udp_connection_t *uc, u_char *query, u_short qlen);
+static void ngx_resolver_prefetch(ngx_resolver_t *r, ngx_resolver_node_t *rn);
+static void ngx_resolver_prefetch_reset(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn);
+static void ngx_resolver_prefetch_done(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn);
 static ngx_int_t ngx_resolver_create_name_query(ngx_resolver_node_t *rn,
     ngx_resolver_ctx_t *ctx);
 static ngx_int_t ngx_resolver_create_addr_query(ngx_resolver_node_t *rn,
@@ -72,11 +107,14 @@ static void ngx_resolver_resend_handler(ngx_event_t *ev);
 static time_t ngx_resolver_resend(ngx_resolver_t *r, ngx_rbtree_t *tree,
     ngx_queue_t *queue);
 static void ngx_resolver_read_response(ngx_event_t *rev);
+static void ngx_resolver_tcp_write(ngx_event_t *wev);
+static void ngx_resolver_tcp_read(ngx_event_t *rev);
+static void ngx_resolver_tcp_close(ngx_udp_connection_t *uc);
 static void ngx_resolver_process_response(ngx_resolver_t *r, u_char *buf,
-    size_t n);
+    size_t n, ngx_uint_t tcp);
 static void ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t n,
     ngx_uint_t ident, ngx_uint_t code, ngx_uint_t qtype,
-    ngx_uint_t nan, ngx_uint_t ans);
+    ngx_uint_t nan, ngx_uint_t trunc, ngx_uint_t ans);
 static void ngx_resolver_process_ptr(ngx_resolver_t *r, u_char *buf, size_t n,
     ngx_uint_t ident, ngx_uint_t code, ngx_uint_t nan);
 static ngx_resolver_node_t *ngx_resolver_lookup_name(ngx_resolver_t *r,
@@ -98,6 +136,18 @@ static ngx_addr_t *ngx_resolver_export(ngx_resolver_t *r,
     ngx_resolver_node_t *rn, ngx_uint_t rotate);
 static u_char *ngx_resolver_log_error(ngx_log_t *log, u_char *buf, size_t len);
 
+static ngx_int_t ngx_resolver_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_resolver_node_t *ngx_resolver_shared_lookup(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn, ngx_str_t *name, uint32_t hash);
+static ngx_int_t ngx_resolver_shared_copy(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn, ngx_resolver_shared_node_t *sn);
+static void ngx_resolver_shared_update(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn);
+static ngx_resolver_shared_node_t *ngx_resolver_shared_find(
+    ngx_resolver_shared_t *shared, u_char *name, size_t len, uint32_t hash);
+static void ngx_resolver_shared_free(ngx_resolver_shared_t *shared,
+    ngx_resolver_shared_node_t *sn);
+
 #if (NGX_HAVE_INET6)
 static void ngx_resolver_rbtree_insert_addr6_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
@@ -106,13 +156,19 @@ static ngx_resolver_node_t *ngx_resolver_lookup_addr6(ngx_resolver_t *r,
 #endif
 
 
+static ngx_uint_t  ngx_resolver_shm_tag;
+
+
 ngx_resolver_t *
 ngx_resolver_create(ngx_conf_t *cf, ngx_str_t *names, ngx_uint_t n)
 {
-    ngx_str_t              s;
+    u_char                *p;
+    ssize_t                size;
+    ngx_str_t              s, name;
     ngx_url_t              u;
     ngx_uint_t             i, j;
     ngx_resolver_t        *r;
+    ngx_shm_zone_t        *shm_zone;
     ngx_pool_cleanup_t    *cln;
     ngx_udp_connection_t  *uc;
 
@@ -164,6 +220,7 @@ ngx_resolver_create(ngx_conf_t *cf, ngx_str_t *names, ngx_uint_t n)
     r->ident = -1;
 
     r->resend_timeout = 5;
+    r->tcp_timeout = 5;
     r->expire = 30;
     r->valid = 0;
 
@@ -195,6 +252,58 @@ ngx_resolver_create(ngx_conf_t *cf, ngx_str_t *names, ngx_uint_t n)
             continue;
         }
 
+        if (ngx_strncmp(names[i].data, "zone=", 5) == 0) {
+
+            name.data = names[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &names[i]);
+                return NULL;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = names[i].data + names[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR || name.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &names[i]);
+                return NULL;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &names[i]);
+                return NULL;
+            }
+
+            shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                             &ngx_resolver_shm_tag);
+            if (shm_zone == NULL) {
+                return NULL;
+            }
+
+            if (shm_zone->data == NULL) {
+                shm_zone->data = ngx_pcalloc(cf->pool,
+                                             sizeof(ngx_resolver_shared_t));
+                if (shm_zone->data == NULL) {
+                    return NULL;
+                }
+
+                shm_zone->init = ngx_resolver_init_zone;
+            }
+
+            r->shared = shm_zone->data;
+
+            continue;
+        }
+
 #if (NGX_HAVE_INET6)
         if (ngx_strncmp(names[i].data, "ipv6=", 5) == 0) {
 
@@ -240,6 +349,7 @@ ngx_resolver_create(ngx_conf_t *cf, ngx_str_t *names, ngx_uint_t n)
             uc[j].sockaddr = u.addrs[j].sockaddr;
             uc[j].socklen = u.addrs[j].socklen;
             uc[j].server = u.addrs[j].name;
+            uc[j].resolver = r;
         }
     }
 
@@ -278,6 +388,20 @@ ngx_resolver_cleanup(void *data)
             if (uc[i].connection) {
                 ngx_close_connection(uc[i].connection);
             }
+
+            if (uc[i].tcp) {
+                ngx_close_connection(uc[i].tcp);
+            }
+
+            if (uc[i].read_buf) {
+                ngx_resolver_free(r, uc[i].read_buf->start);
+                ngx_resolver_free(r, uc[i].read_buf);
+            }
+
+            if (uc[i].write_buf) {
+                ngx_resolver_free(r, uc[i].write_buf->start);
+                ngx_resolver_free(r, uc[i].write_buf);
+            }
         }
 
         ngx_free(r);
@@ -482,17 +606,42 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
 
     rn = ngx_resolver_lookup_name(r, &ctx->name, hash);
 
+    if (r->shared
+        && (rn == NULL || (rn->valid < ngx_time() && rn->waiting == NULL)))
+    {
+        rn = ngx_resolver_shared_lookup(r, rn, &ctx->name, hash);
+    }
+
     if (rn) {
 
-        if (rn->valid >= ngx_time()) {
+        if (rn->valid >= ngx_time()
+            && rn->naddrs != (u_short) -1
+#if (NGX_HAVE_INET6)
+            && rn->naddrs6 != (u_short) -1
+#endif
+           )
+        {
 
             ngx_log_debug0(NGX_LOG_DEBUG_CORE, r->log, 0, "resolve cached");
 
-            ngx_queue_remove(&rn->queue);
+            /* the node being prefetched stays in the resend queue */
 
-            rn->expire = ngx_time() + r->expire;
+            if (!rn->prefetch) {
+                ngx_queue_remove(&rn->queue);
+
+                rn->expire = ngx_time() + r->expire;
+
+                ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
+            }
+
+            /* refresh the name in use before it expires */
 
-            ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
+            if (rn->query == NULL
+                && rn->valid - ngx_time()
+                   <= (r->valid ? r->valid : (time_t) rn->ttl) / 10)
+            {
+                ngx_resolver_prefetch(r, rn);
+            }
 
             naddrs = (rn->naddrs == (u_short) -1) ? 0 : rn->naddrs;
 #if (NGX_HAVE_INET6)
@@ -519,6 +668,7 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
                 do {
                     ctx->state = NGX_OK;
                     ctx->naddrs = naddrs;
+                    ctx->valid = rn->valid;
 
                     if (addrs == NULL) {
                         ctx->addrs = &ctx->addr;
@@ -574,7 +724,25 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
             return NGX_OK;
         }
 
-        if (rn->waiting) {
+        /*
+         * the response to a prefetch query has been partially received,
+         * the old addresses are already replaced
+         */
+
+        if (rn->waiting || (rn->query && rn->valid >= ngx_time())) {
+
+            if (rn->waiting == NULL && ctx->event == NULL) {
+                ctx->event = ngx_resolver_calloc(r, sizeof(ngx_event_t));
+                if (ctx->event == NULL) {
+                    return NGX_ERROR;
+                }
+
+                ctx->event->handler = ngx_resolver_timeout_handler;
+                ctx->event->data = rn;
+                ctx->event->log = r->log;
+
+                ngx_add_timer(ctx->event, ctx->timeout);
+            }
 
             ctx->next = rn->waiting;
             rn->waiting = ctx;
@@ -595,6 +763,10 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
 #endif
         }
 
+        if (rn->prefetch_buf) {
+            ngx_resolver_free_locked(r, rn->prefetch_buf);
+        }
+
         if (rn->cnlen) {
             ngx_resolver_free_locked(r, rn->u.cname);
         }
@@ -630,6 +802,7 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
 #if (NGX_HAVE_INET6)
         rn->query6 = NULL;
 #endif
+        rn->prefetch_buf = NULL;
 
         ngx_rbtree_insert(&r->name_rbtree, &rn->node);
     }
@@ -654,9 +827,13 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
     }
 
     rn->naddrs = (u_short) -1;
+    rn->tcp = 0;
 #if (NGX_HAVE_INET6)
     rn->naddrs6 = r->ipv6 ? (u_short) -1 : 0;
+    rn->tcp6 = 0;
 #endif
+    rn->prefetch = 0;
+    rn->prefetch_buf = NULL;
 
     if (ngx_resolver_send_query(r, rn) != NGX_OK) {
         goto failed;
@@ -848,9 +1025,13 @@ ngx_resolve_addr(ngx_resolver_ctx_t *ctx)
     }
 
     rn->naddrs = (u_short) -1;
+    rn->tcp = 0;
 #if (NGX_HAVE_INET6)
     rn->naddrs6 = (u_short) -1;
+    rn->tcp6 = 0;
 #endif
+    rn->prefetch = 0;
+    rn->prefetch_buf = NULL;
 
     if (ngx_resolver_send_query(r, rn) != NGX_OK) {
         goto failed;
@@ -1059,16 +1240,51 @@ ngx_resolver_expire(ngx_resolver_t *r, ngx_rbtree_t *tree, ngx_queue_t *queue)
 static ngx_int_t
 ngx_resolver_send_query(ngx_resolver_t *r, ngx_resolver_node_t *rn)
 {
-    ssize_t                n;
+    ngx_int_t              rc;
     ngx_udp_connection_t  *uc;
 
     uc = r->udp_connections.elts;
 
-    uc = &uc[r->last_connection++];
+    rn->last_connection = r->last_connection++;
     if (r->last_connection == r->udp_connections.nelts) {
         r->last_connection = 0;
     }
 
+    uc = &uc[rn->last_connection];
+
+    if (rn->naddrs == (u_short) -1 || rn->prefetch) {
+        rc = rn->tcp ? ngx_resolver_send_tcp_query(r, uc, rn->query, rn->qlen)
+                     : ngx_resolver_send_udp_query(r, uc, rn->query, rn->qlen);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+#if (NGX_HAVE_INET6)
+
+    if (rn->query6 && (rn->naddrs6 == (u_short) -1 || rn->prefetch)) {
+        rc = rn->tcp6
+                    ? ngx_resolver_send_tcp_query(r, uc, rn->query6, rn->qlen)
+                    : ngx_resolver_send_udp_query(r, uc, rn->query6, rn->qlen);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_resolver_send_udp_query(ngx_resolver_t *r, ngx_udp_connection_t *uc,
+    u_char *query, u_short qlen)
+{
+    ssize_t  n;
+
     if (uc->connection == NULL) {
 
         uc->log = *r->log;
@@ -1080,40 +1296,260 @@ ngx_resolver_send_query(ngx_resolver_t *r, ngx_resolver_node_t *rn)
             return NGX_ERROR;
         }
 
-        uc->connection->data = r;
+        uc->connection->data = uc;
         uc->connection->read->handler = ngx_resolver_read_response;
         uc->connection->read->resolver = 1;
     }
 
-    if (rn->naddrs == (u_short) -1) {
-        n = ngx_send(uc->connection, rn->query, rn->qlen);
+    n = ngx_send(uc->connection, query, qlen);
+
+    if (n == -1) {
+        return NGX_ERROR;
+    }
+
+    if ((size_t) n != (size_t) qlen) {
+        ngx_log_error(NGX_LOG_CRIT, &uc->log, 0, "send() incomplete");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
 
-        if (n == -1) {
+
+static ngx_int_t
+ngx_resolver_send_tcp_query(ngx_resolver_t *r, ngx_udp_connection_t *uc,
+    u_char *query, u_short qlen)
+{
+    ngx_int_t   rc;
+    ngx_buf_t  *b;
+
+    rc = NGX_OK;
+
+    if (uc->tcp == NULL) {
+
+        uc->log = *r->log;
+        uc->log.handler = ngx_resolver_log_error;
+        uc->log.data = uc;
+        uc->log.action = "resolving";
+
+        rc = ngx_tcp_connect(uc);
+
+        if (rc == NGX_ERROR) {
             return NGX_ERROR;
         }
 
-        if ((size_t) n != (size_t) rn->qlen) {
-            ngx_log_error(NGX_LOG_CRIT, &uc->log, 0, "send() incomplete");
-            return NGX_ERROR;
+        uc->tcp->data = uc;
+        uc->tcp->write->handler = ngx_resolver_tcp_write;
+        uc->tcp->read->handler = ngx_resolver_tcp_read;
+        uc->tcp->read->resolver = 1;
+
+        ngx_add_timer(uc->tcp->write, (ngx_msec_t) (r->tcp_timeout * 1000));
+    }
+
+    b = uc->write_buf;
+
+    if (b == NULL) {
+        b = ngx_resolver_calloc(r, sizeof(ngx_buf_t));
+        if (b == NULL) {
+            goto failed;
         }
+
+        b->start = ngx_resolver_alloc(r, NGX_RESOLVER_TCP_WSIZE);
+        if (b->start == NULL) {
+            ngx_resolver_free(r, b);
+            goto failed;
+        }
+
+        b->end = b->start + NGX_RESOLVER_TCP_WSIZE;
+
+        b->pos = b->start;
+        b->last = b->start;
+
+        uc->write_buf = b;
     }
 
-#if (NGX_HAVE_INET6)
-    if (rn->query6 && rn->naddrs6 == (u_short) -1) {
-        n = ngx_send(uc->connection, rn->query6, rn->qlen);
+    if (b->end - b->last < 2 + qlen) {
+        ngx_log_error(NGX_LOG_CRIT, &uc->log, 0, "buffer overflow");
+        return NGX_ERROR;
+    }
 
-        if (n == -1) {
-            return NGX_ERROR;
+    *b->last++ = (u_char) (qlen >> 8);
+    *b->last++ = (u_char) qlen;
+    b->last = ngx_cpymem(b->last, query, qlen);
+
+    if (rc == NGX_OK) {
+        ngx_resolver_tcp_write(uc->tcp->write);
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_resolver_tcp_close(uc);
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * the query is sent again to refresh the cached addresses,
+ * the addresses are served from the cache till the response
+ */
+
+static void
+ngx_resolver_prefetch(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    time_t                       now;
+    ngx_int_t                    rc;
+    ngx_resolver_ctx_t           ctx;
+    ngx_resolver_shared_t       *shared;
+    ngx_resolver_shared_node_t  *sn;
+
+    now = ngx_time();
+    shared = r->shared;
+
+    if (shared) {
+        ngx_shmtx_lock(&shared->shpool->mutex);
+
+        sn = ngx_resolver_shared_find(shared, rn->name, rn->nlen,
+                                      rn->node.key);
+
+        if (sn && sn->valid > rn->valid) {
+
+            /* the name has been already refreshed by another worker */
+
+            (void) ngx_resolver_shared_copy(r, rn, sn);
+
+            ngx_shmtx_unlock(&shared->shpool->mutex);
+
+            return;
         }
 
-        if ((size_t) n != (size_t) rn->qlen) {
-            ngx_log_error(NGX_LOG_CRIT, &uc->log, 0, "send() incomplete");
-            return NGX_ERROR;
+        if (sn) {
+            if (sn->updating >= now) {
+                ngx_shmtx_unlock(&shared->shpool->mutex);
+                return;
+            }
+
+            sn->updating = now + r->resend_timeout;
         }
+
+        ngx_shmtx_unlock(&shared->shpool->mutex);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, r->log, 0,
+                   "resolver prefetch \"%*s\"", (size_t) rn->nlen, rn->name);
+
+    ngx_memzero(&ctx, sizeof(ngx_resolver_ctx_t));
+
+    ctx.resolver = r;
+    ctx.name.len = rn->nlen;
+    ctx.name.data = rn->name;
+
+    rn->query = NULL;
+#if (NGX_HAVE_INET6)
+    rn->query6 = NULL;
+#endif
+
+    rc = ngx_resolver_create_name_query(rn, &ctx);
+
+    if (rc != NGX_OK) {
+        goto failed;
     }
+
+    rn->tcp = 0;
+#if (NGX_HAVE_INET6)
+    rn->tcp6 = 0;
 #endif
+    rn->prefetch = 1;
 
-    return NGX_OK;
+    if (ngx_resolver_send_query(r, rn) != NGX_OK) {
+        goto failed;
+    }
+
+    ngx_queue_remove(&rn->queue);
+
+    if (ngx_queue_empty(&r->name_resend_queue)) {
+        ngx_add_timer(r->event, (ngx_msec_t) (r->resend_timeout * 1000));
+    }
+
+    rn->expire = now + r->resend_timeout;
+
+    ngx_queue_insert_head(&r->name_resend_queue, &rn->queue);
+
+    return;
+
+failed:
+
+    if (rn->query) {
+        ngx_resolver_free(r, rn->query);
+        rn->query = NULL;
+#if (NGX_HAVE_INET6)
+        rn->query6 = NULL;
+#endif
+    }
+
+    rn->prefetch = 0;
+}
+
+
+/*
+ * the successful responses to a prefetch query replace the cached
+ * addresses, the node is then resolved as a new one
+ */
+
+static void
+ngx_resolver_prefetch_reset(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    if (rn->cnlen) {
+        ngx_resolver_free(r, rn->u.cname);
+    }
+
+    if (rn->naddrs > 1 && rn->naddrs != (u_short) -1) {
+        ngx_resolver_free(r, rn->u.addrs);
+    }
+
+    rn->naddrs = (u_short) -1;
+
+#if (NGX_HAVE_INET6)
+    if (rn->naddrs6 > 1 && rn->naddrs6 != (u_short) -1) {
+        ngx_resolver_free(r, rn->u6.addrs6);
+    }
+
+    rn->naddrs6 = rn->query6 ? (u_short) -1 : 0;
+#endif
+
+    rn->code = 0;
+    rn->cnlen = 0;
+    rn->ttl = NGX_MAX_UINT32_VALUE;
+    rn->prefetch = 0;
+}
+
+
+/*
+ * the prefetch query is abandoned, the cached addresses are kept
+ * till they expire
+ */
+
+static void
+ngx_resolver_prefetch_done(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    rn->expire = ngx_time() + r->expire;
+
+    ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
+
+    ngx_resolver_free(r, rn->query);
+    rn->query = NULL;
+#if (NGX_HAVE_INET6)
+    rn->query6 = NULL;
+#endif
+
+    if (rn->prefetch_buf) {
+        ngx_resolver_free(r, rn->prefetch_buf);
+        rn->prefetch_buf = NULL;
+    }
+
+    rn->prefetch = 0;
 }
 
 
@@ -1207,7 +1643,7 @@ ngx_resolver_resend(ngx_resolver_t *r, ngx_rbtree_t *tree, ngx_queue_t *queue)
 
         ngx_queue_remove(q);
 
-        if (rn->waiting) {
+        if (rn->waiting || (rn->prefetch && rn->valid >= now)) {
 
             (void) ngx_resolver_send_query(r, rn);
 
@@ -1218,6 +1654,15 @@ ngx_resolver_resend(ngx_resolver_t *r, ngx_rbtree_t *tree, ngx_queue_t *queue)
             continue;
         }
 
+        if (rn->prefetch) {
+
+            /* only name nodes are prefetched */
+
+            ngx_resolver_prefetch_done(r, rn);
+
+            continue;
+        }
+
         ngx_rbtree_delete(tree, &rn->node);
 
         ngx_resolver_free_node(r, rn);
@@ -1228,11 +1673,13 @@ ngx_resolver_resend(ngx_resolver_t *r, ngx_rbtree_t *tree, ngx_queue_t *queue)
 static void
 ngx_resolver_read_response(ngx_event_t *rev)
 {
-    ssize_t            n;
-    ngx_connection_t  *c;
-    u_char             buf[NGX_RESOLVER_UDP_SIZE];
+    ssize_t                n;
+    ngx_connection_t      *c;
+    ngx_udp_connection_t  *uc;
+    u_char                 buf[NGX_RESOLVER_UDP_SIZE];
 
     c = rev->data;
+    uc = c->data;
 
     do {
         n = ngx_udp_recv(c, buf, NGX_RESOLVER_UDP_SIZE);
@@ -1241,18 +1688,197 @@ ngx_resolver_read_response(ngx_event_t *rev)
             return;
         }
 
-        ngx_resolver_process_response(c->data, buf, n);
+        ngx_resolver_process_response(uc->resolver, buf, n, 0);
 
     } while (rev->ready);
 }
 
 
 static void
-ngx_resolver_process_response(ngx_resolver_t *r, u_char *buf, size_t n)
+ngx_resolver_tcp_write(ngx_event_t *wev)
+{
+    off_t                  sent;
+    ssize_t                n;
+    ngx_buf_t             *b;
+    ngx_resolver_t        *r;
+    ngx_connection_t      *c;
+    ngx_udp_connection_t  *uc;
+
+    c = wev->data;
+    uc = c->data;
+    b = uc->write_buf;
+    r = uc->resolver;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, &uc->log, NGX_ETIMEDOUT,
+                      "resolver TCP connection timed out");
+        goto failed;
+    }
+
+    sent = 0;
+
+    while (wev->ready && b->pos < b->last) {
+        n = ngx_send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            goto failed;
+        }
+
+        b->pos += n;
+        sent += n;
+    }
+
+    if (b->pos != b->start) {
+        b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+        b->pos = b->start;
+    }
+
+    if (b->pos == b->last) {
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+
+    } else if (sent) {
+        ngx_add_timer(wev, (ngx_msec_t) (r->tcp_timeout * 1000));
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        goto failed;
+    }
+
+    return;
+
+failed:
+
+    ngx_resolver_tcp_close(uc);
+}
+
+
+static void
+ngx_resolver_tcp_read(ngx_event_t *rev)
+{
+    u_char                *p;
+    size_t                 size;
+    ssize_t                n;
+    u_short                qlen;
+    ngx_buf_t             *b;
+    ngx_resolver_t        *r;
+    ngx_connection_t      *c;
+    ngx_udp_connection_t  *uc;
+
+    c = rev->data;
+    uc = c->data;
+    r = uc->resolver;
+
+    b = uc->read_buf;
+
+    if (b == NULL) {
+        b = ngx_resolver_calloc(r, sizeof(ngx_buf_t));
+        if (b == NULL) {
+            goto failed;
+        }
+
+        b->start = ngx_resolver_alloc(r, NGX_RESOLVER_TCP_RSIZE);
+        if (b->start == NULL) {
+            ngx_resolver_free(r, b);
+            goto failed;
+        }
+
+        b->end = b->start + NGX_RESOLVER_TCP_RSIZE;
+
+        b->pos = b->start;
+        b->last = b->start;
+
+        uc->read_buf = b;
+    }
+
+    while (rev->ready) {
+        n = ngx_recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            goto failed;
+        }
+
+        b->last += n;
+
+        for ( ;; ) {
+            p = b->pos;
+            size = b->last - p;
+
+            if (size < 2) {
+                break;
+            }
+
+            qlen = (u_short) *p++ << 8;
+            qlen += *p++;
+
+            if (size < (size_t) (2 + qlen)) {
+                break;
+            }
+
+            ngx_resolver_process_response(r, p, qlen, 1);
+
+            b->pos += 2 + qlen;
+        }
+
+        if (b->pos != b->start) {
+            b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+            b->pos = b->start;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        goto failed;
+    }
+
+    return;
+
+failed:
+
+    ngx_resolver_tcp_close(uc);
+}
+
+
+/*
+ * the queries not sent yet are lost,
+ * they are sent again by ngx_resolver_resend()
+ */
+
+static void
+ngx_resolver_tcp_close(ngx_udp_connection_t *uc)
+{
+    if (uc->tcp) {
+        ngx_close_connection(uc->tcp);
+        uc->tcp = NULL;
+    }
+
+    if (uc->read_buf) {
+        uc->read_buf->pos = uc->read_buf->start;
+        uc->read_buf->last = uc->read_buf->start;
+    }
+
+    if (uc->write_buf) {
+        uc->write_buf->pos = uc->write_buf->start;
+        uc->write_buf->last = uc->write_buf->start;
+    }
+}
+
+
+static void
+ngx_resolver_process_response(ngx_resolver_t *r, u_char *buf, size_t n,
+    ngx_uint_t tcp)
 {
     char                 *err;
     ngx_uint_t            i, times, ident, qident, flags, code, nqs, nan,
-                          qtype, qclass;
+                          trunc, qtype, qclass;
 #if (NGX_HAVE_INET6)
     ngx_uint_t            qident6;
 #endif
@@ -1287,6 +1913,10 @@ ngx_resolver_process_response(ngx_resolver_t *r, u_char *buf, size_t n)
 
     code = flags & 0xf;
 
+    /* a truncated UDP response is queried again over TCP */
+
+    trunc = (flags & 0x0200) && !tcp;
+
     if (code == NGX_RESOLVE_FORMERR) {
 
         times = 0;
@@ -1371,7 +2001,7 @@ found:
     case NGX_RESOLVE_AAAA:
 #endif
 
-        ngx_resolver_process_a(r, buf, n, ident, code, qtype, nan,
+        ngx_resolver_process_a(r, buf, n, ident, code, qtype, nan, trunc,
                                i + sizeof(ngx_resolver_qs_t));
 
         break;
@@ -1420,7 +2050,7 @@ dns_error:
 static void
 ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
     ngx_uint_t ident, ngx_uint_t code, ngx_uint_t qtype,
-    ngx_uint_t nan, ngx_uint_t ans)
+    ngx_uint_t nan, ngx_uint_t trunc, ngx_uint_t ans)
 {
     char                 *err;
     u_char               *cname;
@@ -1432,11 +2062,13 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
     ngx_addr_t           *addrs;
     ngx_uint_t            type, class, qident, naddrs, a, i, n, start;
 #if (NGX_HAVE_INET6)
+    u_char               *stash;
     struct in6_addr      *addr6;
 #endif
     ngx_resolver_an_t    *an;
     ngx_resolver_ctx_t   *ctx, *next;
     ngx_resolver_node_t  *rn;
+    ngx_udp_connection_t *uc;
 
     if (ngx_resolver_copy(r, &name, buf,
                           buf + sizeof(ngx_resolver_hdr_t), buf + last)
@@ -1465,7 +2097,9 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
 #if (NGX_HAVE_INET6)
     case NGX_RESOLVE_AAAA:
 
-        if (rn->query6 == NULL || rn->naddrs6 != (u_short) -1) {
+        if (rn->query6 == NULL
+            || (rn->naddrs6 != (u_short) -1 && !rn->prefetch))
+        {
             ngx_log_error(r->log_level, r->log, 0,
                           "unexpected response for %V", &name);
             ngx_resolver_free(r, name.data);
@@ -1479,7 +2113,9 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
 
     default: /* NGX_RESOLVE_A */
 
-        if (rn->query == NULL || rn->naddrs != (u_short) -1) {
+        if (rn->query == NULL
+            || (rn->naddrs != (u_short) -1 && !rn->prefetch))
+        {
             ngx_log_error(r->log_level, r->log, 0,
                           "unexpected response for %V", &name);
             ngx_resolver_free(r, name.data);
@@ -1489,15 +2125,104 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
         qident = (rn->query[0] << 8) + rn->query[1];
     }
 
-    if (ident != qident) {
-        ngx_log_error(r->log_level, r->log, 0,
-                      "wrong ident %ui response for %V, expect %ui",
-                      ident, &name, qident);
-        ngx_resolver_free(r, name.data);
-        goto failed;
-    }
+    if (ident != qident) {
+        ngx_log_error(r->log_level, r->log, 0,
+                      "wrong ident %ui response for %V, expect %ui",
+                      ident, &name, qident);
+        ngx_resolver_free(r, name.data);
+        goto failed;
+    }
+
+    ngx_resolver_free(r, name.data);
+
+    if (trunc) {
+
+        uc = r->udp_connections.elts;
+        uc = &uc[rn->last_connection];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, r->log, 0,
+                       "resolver truncated response, retry \"%*s\" over TCP",
+                       (size_t) rn->nlen, rn->name);
+
+#if (NGX_HAVE_INET6)
+        if (qtype == NGX_RESOLVE_AAAA) {
+            rn->tcp6 = 1;
+
+            (void) ngx_resolver_send_tcp_query(r, uc, rn->query6, rn->qlen);
+
+            goto next;
+        }
+#endif
+
+        rn->tcp = 1;
+
+        (void) ngx_resolver_send_tcp_query(r, uc, rn->query, rn->qlen);
+
+        goto next;
+    }
+
+    if (rn->prefetch) {
+
+        if (code) {
+
+            /* keep the cached addresses till they expire */
+
+            ngx_log_error(r->log_level, r->log, 0,
+                          "DNS error (%ui: %s) while refreshing \"%*s\"",
+                          code, ngx_resolver_strerror(code),
+                          (size_t) rn->nlen, rn->name);
+
+            ngx_queue_remove(&rn->queue);
+
+            ngx_resolver_prefetch_done(r, rn);
+
+            goto next;
+        }
+
+#if (NGX_HAVE_INET6)
+
+        if (rn->query6) {
+
+            /*
+             * the cached addresses are replaced only when both responses
+             * have succeeded, the first one is kept till then
+             */
+
+            if (rn->prefetch_buf == NULL) {
+                rn->prefetch_buf = ngx_resolver_dup(r, buf, last);
+                if (rn->prefetch_buf == NULL) {
+                    goto failed;
+                }
+
+                rn->prefetch_len = (u_short) last;
+                rn->prefetch_qtype = (u_short) qtype;
+
+                goto next;
+            }
+
+            if (rn->prefetch_qtype == qtype) {
+                goto next;
+            }
+
+            stash = rn->prefetch_buf;
+            rn->prefetch_buf = NULL;
+
+            ngx_resolver_prefetch_reset(r, rn);
+
+            ngx_resolver_process_response(r, stash, rn->prefetch_len, 1);
+
+            ngx_resolver_free(r, stash);
+
+        } else {
+            ngx_resolver_prefetch_reset(r, rn);
+        }
+
+#else
+
+        ngx_resolver_prefetch_reset(r, rn);
 
-    ngx_resolver_free(r, name.data);
+#endif
+    }
 
     if (code == 0 && rn->code) {
         code = rn->code;
@@ -1884,6 +2609,8 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
 
         ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
 
+        ngx_resolver_shared_update(r, rn);
+
         next = rn->waiting;
         rn->waiting = NULL;
 
@@ -1893,6 +2620,7 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
             ctx = next;
             ctx->state = NGX_OK;
             ctx->naddrs = naddrs;
+            ctx->valid = rn->valid;
 
             if (addrs == NULL) {
                 ctx->addrs = &ctx->addr;
@@ -1955,6 +2683,8 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
 
         ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
 
+        ngx_resolver_shared_update(r, rn);
+
         ctx = rn->waiting;
         rn->waiting = NULL;
 
@@ -2826,6 +3556,10 @@ ngx_resolver_free_node(ngx_resolver_t *r, ngx_resolver_node_t *rn)
         ngx_resolver_free_locked(r, rn->name);
     }
 
+    if (rn->prefetch_buf) {
+        ngx_resolver_free_locked(r, rn->prefetch_buf);
+    }
+
     if (rn->cnlen) {
         ngx_resolver_free_locked(r, rn->u.cname);
     }
@@ -2994,6 +3728,414 @@ ngx_resolver_export(ngx_resolver_t *r, ngx_resolver_node_t *rn,
 }
 
 
+static ngx_int_t
+ngx_resolver_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_resolver_shared_t  *oshared = data;
+
+    size_t                  len;
+    ngx_resolver_shared_t  *shared;
+
+    shared = shm_zone->data;
+
+    if (oshared) {
+        shared->sh = oshared->sh;
+        shared->shpool = oshared->shpool;
+
+        return NGX_OK;
+    }
+
+    shared->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shared->sh = shared->shpool->data;
+
+        return NGX_OK;
+    }
+
+    shared->sh = ngx_slab_alloc(shared->shpool,
+                                sizeof(ngx_resolver_shared_sh_t));
+    if (shared->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    shared->shpool->data = shared->sh;
+
+    ngx_rbtree_init(&shared->sh->rbtree, &shared->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&shared->sh->queue);
+
+    len = sizeof(" in resolver zone \"\"") + shm_zone->shm.name.len;
+
+    shared->shpool->log_ctx = ngx_slab_alloc(shared->shpool, len);
+    if (shared->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shared->shpool->log_ctx, " in resolver zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+/*
+ * fills the node from the shared cache if the name was resolved
+ * by another worker, a new node is created if there is no one
+ */
+
+static ngx_resolver_node_t *
+ngx_resolver_shared_lookup(ngx_resolver_t *r, ngx_resolver_node_t *rn,
+    ngx_str_t *name, uint32_t hash)
+{
+    ngx_resolver_node_t         *new;
+    ngx_resolver_shared_t       *shared;
+    ngx_resolver_shared_node_t  *sn;
+
+    shared = r->shared;
+
+    ngx_shmtx_lock(&shared->shpool->mutex);
+
+    sn = ngx_resolver_shared_find(shared, name->data, name->len, hash);
+
+    if (sn == NULL || sn->valid < ngx_time()) {
+        ngx_shmtx_unlock(&shared->shpool->mutex);
+        return rn;
+    }
+
+    ngx_queue_remove(&sn->queue);
+    ngx_queue_insert_head(&shared->sh->queue, &sn->queue);
+
+    new = NULL;
+
+    if (rn == NULL) {
+        new = ngx_resolver_calloc(r, sizeof(ngx_resolver_node_t));
+        if (new == NULL) {
+            goto failed;
+        }
+
+        new->name = ngx_resolver_dup(r, name->data, name->len);
+        if (new->name == NULL) {
+            ngx_resolver_free(r, new);
+            goto failed;
+        }
+
+        new->node.key = hash;
+        new->nlen = (u_short) name->len;
+    }
+
+    if (ngx_resolver_shared_copy(r, new ? new : rn, sn) != NGX_OK) {
+
+        if (new) {
+            ngx_resolver_free(r, new->name);
+            ngx_resolver_free(r, new);
+        }
+
+        goto failed;
+    }
+
+    ngx_shmtx_unlock(&shared->shpool->mutex);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, r->log, 0, "resolve shared cached");
+
+    if (new) {
+        rn = new;
+        ngx_rbtree_insert(&r->name_rbtree, &rn->node);
+
+    } else {
+        ngx_queue_remove(&rn->queue);
+    }
+
+    rn->expire = ngx_time() + r->expire;
+
+    ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
+
+    return rn;
+
+failed:
+
+    ngx_shmtx_unlock(&shared->shpool->mutex);
+
+    return rn;
+}
+
+
+/* the shared pool mutex must be held */
+
+static ngx_int_t
+ngx_resolver_shared_copy(ngx_resolver_t *r, ngx_resolver_node_t *rn,
+    ngx_resolver_shared_node_t *sn)
+{
+    u_char           *p, *cname;
+    in_addr_t        *addrs;
+#if (NGX_HAVE_INET6)
+    struct in6_addr  *addrs6;
+#endif
+
+    addrs = NULL;
+    cname = NULL;
+#if (NGX_HAVE_INET6)
+    addrs6 = NULL;
+#endif
+
+    if (sn->naddrs > 1) {
+        addrs = ngx_resolver_alloc(r, sn->naddrs * sizeof(in_addr_t));
+        if (addrs == NULL) {
+            goto failed;
+        }
+    }
+
+#if (NGX_HAVE_INET6)
+    if (sn->naddrs6 > 1) {
+        addrs6 = ngx_resolver_alloc(r,
+                                    sn->naddrs6 * sizeof(struct in6_addr));
+        if (addrs6 == NULL) {
+            goto failed;
+        }
+    }
+#endif
+
+    if (sn->cnlen) {
+        cname = ngx_resolver_alloc(r, sn->cnlen);
+        if (cname == NULL) {
+            goto failed;
+        }
+    }
+
+    if (rn->query) {
+        ngx_resolver_free(r, rn->query);
+        rn->query = NULL;
+#if (NGX_HAVE_INET6)
+        rn->query6 = NULL;
+#endif
+    }
+
+    if (rn->cnlen) {
+        ngx_resolver_free(r, rn->u.cname);
+    }
+
+    if (rn->naddrs > 1 && rn->naddrs != (u_short) -1) {
+        ngx_resolver_free(r, rn->u.addrs);
+    }
+
+#if (NGX_HAVE_INET6)
+    if (rn->naddrs6 > 1 && rn->naddrs6 != (u_short) -1) {
+        ngx_resolver_free(r, rn->u6.addrs6);
+    }
+#endif
+
+    p = sn->data;
+
+    rn->naddrs = sn->naddrs;
+
+    if (sn->naddrs == 1) {
+        ngx_memcpy(&rn->u.addr, p, sizeof(in_addr_t));
+
+    } else if (sn->naddrs > 1) {
+        ngx_memcpy(addrs, p, sn->naddrs * sizeof(in_addr_t));
+        rn->u.addrs = addrs;
+    }
+
+    p += sn->naddrs * sizeof(in_addr_t);
+
+#if (NGX_HAVE_INET6)
+
+    rn->naddrs6 = sn->naddrs6;
+
+    if (sn->naddrs6 == 1) {
+        ngx_memcpy(&rn->u6.addr6, p, sizeof(struct in6_addr));
+
+    } else if (sn->naddrs6 > 1) {
+        ngx_memcpy(addrs6, p, sn->naddrs6 * sizeof(struct in6_addr));
+        rn->u6.addrs6 = addrs6;
+    }
+
+    p += sn->naddrs6 * sizeof(struct in6_addr);
+
+#endif
+
+    rn->cnlen = sn->cnlen;
+
+    if (sn->cnlen) {
+        ngx_memcpy(cname, p, sn->cnlen);
+        rn->u.cname = cname;
+    }
+
+    rn->code = 0;
+    rn->valid = sn->valid;
+    rn->ttl = sn->ttl;
+    rn->tcp = 0;
+#if (NGX_HAVE_INET6)
+    rn->tcp6 = 0;
+#endif
+    rn->prefetch = 0;
+
+    if (rn->prefetch_buf) {
+        ngx_resolver_free(r, rn->prefetch_buf);
+        rn->prefetch_buf = NULL;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    if (addrs) {
+        ngx_resolver_free(r, addrs);
+    }
+
+#if (NGX_HAVE_INET6)
+    if (addrs6) {
+        ngx_resolver_free(r, addrs6);
+    }
+#endif
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_resolver_shared_update(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    u_char                      *p;
+    size_t                       size;
+    time_t                       now;
+    ngx_uint_t                   i, naddrs, naddrs6;
+    ngx_queue_t                 *q;
+    ngx_resolver_shared_t       *shared;
+    ngx_resolver_shared_node_t  *sn;
+
+    shared = r->shared;
+
+    if (shared == NULL) {
+        return;
+    }
+
+    naddrs = rn->naddrs;
+#if (NGX_HAVE_INET6)
+    naddrs6 = rn->naddrs6;
+#else
+    naddrs6 = 0;
+#endif
+
+    size = offsetof(ngx_resolver_shared_node_t, data)
+           + naddrs * sizeof(in_addr_t)
+#if (NGX_HAVE_INET6)
+           + naddrs6 * sizeof(struct in6_addr)
+#endif
+           + rn->cnlen + rn->nlen;
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&shared->shpool->mutex);
+
+    sn = ngx_resolver_shared_find(shared, rn->name, rn->nlen, rn->node.key);
+
+    if (sn) {
+        ngx_resolver_shared_free(shared, sn);
+    }
+
+    /* free at most two expired names */
+
+    for (i = 0; i < 2 && !ngx_queue_empty(&shared->sh->queue); i++) {
+        q = ngx_queue_last(&shared->sh->queue);
+        sn = ngx_queue_data(q, ngx_resolver_shared_node_t, queue);
+
+        if (sn->valid >= now) {
+            break;
+        }
+
+        ngx_resolver_shared_free(shared, sn);
+    }
+
+    sn = ngx_slab_alloc_locked(shared->shpool, size);
+
+    /* evict the least recently used names if the zone is full */
+
+    for (i = 0; sn == NULL && i < 16; i++) {
+
+        if (ngx_queue_empty(&shared->sh->queue)) {
+            break;
+        }
+
+        q = ngx_queue_last(&shared->sh->queue);
+
+        ngx_resolver_shared_free(shared,
+                        ngx_queue_data(q, ngx_resolver_shared_node_t, queue));
+
+        sn = ngx_slab_alloc_locked(shared->shpool, size);
+    }
+
+    if (sn == NULL) {
+        ngx_shmtx_unlock(&shared->shpool->mutex);
+        return;
+    }
+
+    p = sn->data;
+
+    if (naddrs) {
+        p = ngx_cpymem(p, (naddrs == 1) ? &rn->u.addr : rn->u.addrs,
+                       naddrs * sizeof(in_addr_t));
+    }
+
+#if (NGX_HAVE_INET6)
+    if (naddrs6) {
+        p = ngx_cpymem(p, (naddrs6 == 1) ? &rn->u6.addr6 : rn->u6.addrs6,
+                       naddrs6 * sizeof(struct in6_addr));
+    }
+#endif
+
+    if (rn->cnlen) {
+        p = ngx_cpymem(p, rn->u.cname, rn->cnlen);
+    }
+
+    ngx_memcpy(p, rn->name, rn->nlen);
+
+    sn->sn.node.key = rn->node.key;
+    sn->sn.str.len = rn->nlen;
+    sn->sn.str.data = p;
+
+    sn->valid = rn->valid;
+    sn->updating = 0;
+    sn->ttl = rn->ttl;
+    sn->cnlen = rn->cnlen;
+    sn->naddrs = (u_short) naddrs;
+    sn->naddrs6 = (u_short) naddrs6;
+
+    ngx_rbtree_insert(&shared->sh->rbtree, &sn->sn.node);
+
+    ngx_queue_insert_head(&shared->sh->queue, &sn->queue);
+
+    ngx_shmtx_unlock(&shared->shpool->mutex);
+}
+
+
+static ngx_resolver_shared_node_t *
+ngx_resolver_shared_find(ngx_resolver_shared_t *shared, u_char *name,
+    size_t len, uint32_t hash)
+{
+    ngx_str_t  s;
+
+    s.len = len;
+    s.data = name;
+
+    return (ngx_resolver_shared_node_t *)
+               ngx_str_rbtree_lookup(&shared->sh->rbtree, &s, hash);
+}
+
+
+static void
+ngx_resolver_shared_free(ngx_resolver_shared_t *shared,
+    ngx_resolver_shared_node_t *sn)
+{
+    ngx_queue_remove(&sn->queue);
+
+    ngx_rbtree_delete(&shared->sh->rbtree, &sn->sn.node);
+
+    ngx_slab_free_locked(shared->shpool, sn);
+}
+
+
 char *
 ngx_resolver_strerror(ngx_int_t err)
 {
@@ -3132,3 +4274,34 @@ failed:
 
     return NGX_ERROR;
 }
+
+
+static ngx_int_t
+ngx_tcp_connect(ngx_udp_connection_t *uc)
+{
+    ngx_int_t              rc;
+    ngx_peer_connection_t  pc;
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = uc->sockaddr;
+    pc.socklen = uc->socklen;
+    pc.name = &uc->server;
+    pc.get = ngx_event_get_peer;
+    pc.log = &uc->log;
+    pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    if (rc != NGX_OK && rc != NGX_AGAIN) {
+        return NGX_ERROR;
+    }
+
+    uc->tcp = pc.connection;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, &uc->log, 0,
+                   "resolver TCP connect to %V, fd:%d",
+                   &uc->server, uc->tcp->fd);
+
+    return rc;
+}
@@ -36,12 +36,21 @@
 #define NGX_RESOLVER_MAX_RECURSION    50
 
 
+typedef struct ngx_resolver_s  ngx_resolver_t;
+
+
 typedef struct {
     ngx_connection_t         *connection;
     struct sockaddr          *sockaddr;
     socklen_t                 socklen;
     ngx_str_t                 server;
     ngx_log_t                 log;
+
+    /* TCP connection to retry truncated responses */
+    ngx_connection_t         *tcp;
+    ngx_buf_t                *read_buf;
+    ngx_buf_t                *write_buf;
+    ngx_resolver_t           *resolver;
 } ngx_udp_connection_t;
 
 
@@ -97,11 +106,40 @@ typedef struct {
     time_t                    valid;
     uint32_t                  ttl;
 
+    /* the server the last query was sent to */
+    ngx_uint_t                last_connection;
+
+    unsigned                  tcp:1;
+#if (NGX_HAVE_INET6)
+    unsigned                  tcp6:1;
+#endif
+
+    /* the query refreshes cached addresses which are still in use */
+    unsigned                  prefetch:1;
+
+    /* the first response to the prefetch query, kept till the second one */
+    u_char                   *prefetch_buf;
+    u_short                   prefetch_len;
+    u_short                   prefetch_qtype;
+
     ngx_resolver_ctx_t       *waiting;
 } ngx_resolver_node_t;
 
 
 typedef struct {
+    ngx_rbtree_t              rbtree;
+    ngx_rbtree_node_t         sentinel;
+    ngx_queue_t               queue;
+} ngx_resolver_shared_sh_t;
+
+
+typedef struct {
+    ngx_resolver_shared_sh_t *sh;
+    ngx_slab_pool_t          *shpool;
+} ngx_resolver_shared_t;
+
+
+struct ngx_resolver_s {
     /* has to be pointer because of "incomplete type" */
     ngx_event_t              *event;
     void                     *dummy;
@@ -134,12 +172,16 @@ typedef struct {
     ngx_queue_t               addr6_expire_queue;
 #endif
 
+    /* names cache shared by all worker processes */
+    ngx_resolver_shared_t    *shared;
+
     time_t                    resend_timeout;
+    time_t                    tcp_timeout;
     time_t                    expire;
     time_t                    valid;
 
     ngx_uint_t                log_level;
-} ngx_resolver_t;
+};
 
 
 struct ngx_resolver_ctx_s {
@@ -155,6 +197,9 @@ struct ngx_resolver_ctx_s {
     ngx_addr_t                addr;
     struct sockaddr_in        sin;
 
+    /* the time the resolved addresses stay valid until */
+    time_t                    valid;
+
     ngx_resolver_handler_pt   handler;
     void                     *data;
     ngx_msec_t                timeout;
@@ -142,6 +142,8 @@ static ngx_connection_t     notify_conn;
 int                         ngx_eventfd = -1;
 /*异步I/O的上下文，全局唯一，必须经过io_setup的初始化才能使用*/
 aio_context_t               ngx_aio_ctx = 0;
+/*异步I/O上下文的容量，也就是每个worker同时在途的异步I/O请求上限*/
+ngx_uint_t                  ngx_aio_requests = 0;
 
 /*异步I/O事件完成后进行通知的描述符，也就是ngx_eventfd所对应的ngx_event_t事件*/
 static ngx_event_t          ngx_eventfd_event;
@@ -284,6 +286,8 @@ ngx_epoll_aio_init(ngx_cycle_t *cycle, ngx_epoll_conf_t *epcf)
         goto failed;
     }
 
+    ngx_aio_requests = epcf->aio_requests;
+
     /*设置用于异步I/O完成通知的 ngx_eventfd_event 事件，它与 ngx_eventfd_conn 连接对应*/
     ngx_eventfd_event.data = &ngx_eventfd_conn;
     ngx_eventfd_event.handler = ngx_epoll_eventfd_handler;
@@ -318,6 +322,7 @@ failed:
 
     ngx_eventfd = -1;
     ngx_aio_ctx = 0;
+    ngx_aio_requests = 0;
     ngx_file_aio = 0;
 }
 
@@ -508,6 +513,7 @@ ngx_epoll_done(ngx_cycle_t *cycle)
     }
 
     ngx_aio_ctx = 0;
+    ngx_aio_requests = 0;
 
 #endif
 
@@ -738,6 +744,18 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
 
     /* NGX_TIMER_INFINITE == INFTIM */
 
+#if (NGX_HAVE_FILE_AIO)
+
+    /*
+     * 把本轮事件循环中积累的异步I/O请求用一次io_submit批量提交，
+     * 如果有请求被同步完成并投递到了 ngx_posted_events，不能阻塞在 epoll_wait 中
+     */
+    if (ngx_file_aio_flush(cycle->log)) {
+        timer = 0;
+    }
+
+#endif
+
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
                    "epoll timer: %M", timer);
 
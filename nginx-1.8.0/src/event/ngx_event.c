@@ -75,6 +75,44 @@ ngx_atomic_t  *ngx_stat_writing = &ngx_stat_writing0;
 ngx_atomic_t   ngx_stat_waiting0;
 ngx_atomic_t  *ngx_stat_waiting = &ngx_stat_waiting0;
 
+/*sendfile的统计：页缓存命中而直接发送的块数、未命中而交给线程池的块数*/
+ngx_atomic_t   ngx_stat_sendfile_inline0;
+ngx_atomic_t  *ngx_stat_sendfile_inline = &ngx_stat_sendfile_inline0;
+ngx_atomic_t   ngx_stat_sendfile_offloaded0;
+ngx_atomic_t  *ngx_stat_sendfile_offloaded = &ngx_stat_sendfile_offloaded0;
+
+/*上游连接的本地端口分配失败次数，以及因此改用地址池中其他本地地址重试的次数*/
+ngx_atomic_t   ngx_stat_bind_failed0;
+ngx_atomic_t  *ngx_stat_bind_failed = &ngx_stat_bind_failed0;
+ngx_atomic_t   ngx_stat_bind_retried0;
+ngx_atomic_t  *ngx_stat_bind_retried = &ngx_stat_bind_retried0;
+
+/*代理缓冲区的统计：各请求当前占用的缓冲区内存字节数，以及因缓冲区不足写入临时文件的字节数*/
+ngx_atomic_t   ngx_stat_pipe_memory0;
+ngx_atomic_t  *ngx_stat_pipe_memory = &ngx_stat_pipe_memory0;
+ngx_atomic_t   ngx_stat_pipe_spilled0;
+ngx_atomic_t  *ngx_stat_pipe_spilled = &ngx_stat_pipe_spilled0;
+
+#if (NGX_HAVE_FILE_AIO)
+
+/*文件异步I/O的统计：提交的iocb数、io_submit调用次数、排队数、在途数、完成数及累计延迟(毫秒)*/
+ngx_atomic_t   ngx_stat_aio_submitted0;
+ngx_atomic_t  *ngx_stat_aio_submitted = &ngx_stat_aio_submitted0;
+ngx_atomic_t   ngx_stat_aio_batches0;
+ngx_atomic_t  *ngx_stat_aio_batches = &ngx_stat_aio_batches0;
+ngx_atomic_t   ngx_stat_aio_queued0;
+ngx_atomic_t  *ngx_stat_aio_queued = &ngx_stat_aio_queued0;
+ngx_atomic_t   ngx_stat_aio_active0;
+ngx_atomic_t  *ngx_stat_aio_active = &ngx_stat_aio_active0;
+ngx_atomic_t   ngx_stat_aio_completed0;
+ngx_atomic_t  *ngx_stat_aio_completed = &ngx_stat_aio_completed0;
+ngx_atomic_t   ngx_stat_aio_submit_time0;
+ngx_atomic_t  *ngx_stat_aio_submit_time = &ngx_stat_aio_submit_time0;
+ngx_atomic_t   ngx_stat_aio_complete_time0;
+ngx_atomic_t  *ngx_stat_aio_complete_time = &ngx_stat_aio_complete_time0;
+
+#endif
+
 #endif
 
 
@@ -538,7 +576,25 @@ ngx_event_module_init(ngx_cycle_t *cycle)
            + cl          /* ngx_stat_active */
            + cl          /* ngx_stat_reading */
            + cl          /* ngx_stat_writing */
-           + cl;         /* ngx_stat_waiting */
+           + cl          /* ngx_stat_waiting */
+           + cl          /* ngx_stat_sendfile_inline */
+           + cl          /* ngx_stat_sendfile_offloaded */
+           + cl          /* ngx_stat_bind_failed */
+           + cl          /* ngx_stat_bind_retried */
+           + cl          /* ngx_stat_pipe_memory */
+           + cl;         /* ngx_stat_pipe_spilled */
+
+#if (NGX_HAVE_FILE_AIO)
+
+    size += cl           /* ngx_stat_aio_submitted */
+           + cl          /* ngx_stat_aio_batches */
+           + cl          /* ngx_stat_aio_queued */
+           + cl          /* ngx_stat_aio_active */
+           + cl          /* ngx_stat_aio_completed */
+           + cl          /* ngx_stat_aio_submit_time */
+           + cl;         /* ngx_stat_aio_complete_time */
+
+#endif
 
 #endif
 
@@ -586,6 +642,24 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_stat_reading = (ngx_atomic_t *) (shared + 7 * cl);
     ngx_stat_writing = (ngx_atomic_t *) (shared + 8 * cl);
     ngx_stat_waiting = (ngx_atomic_t *) (shared + 9 * cl);
+    ngx_stat_sendfile_inline = (ngx_atomic_t *) (shared + 10 * cl);
+    ngx_stat_sendfile_offloaded = (ngx_atomic_t *) (shared + 11 * cl);
+    ngx_stat_bind_failed = (ngx_atomic_t *) (shared + 12 * cl);
+    ngx_stat_bind_retried = (ngx_atomic_t *) (shared + 13 * cl);
+    ngx_stat_pipe_memory = (ngx_atomic_t *) (shared + 14 * cl);
+    ngx_stat_pipe_spilled = (ngx_atomic_t *) (shared + 15 * cl);
+
+#if (NGX_HAVE_FILE_AIO)
+
+    ngx_stat_aio_submitted = (ngx_atomic_t *) (shared + 16 * cl);
+    ngx_stat_aio_batches = (ngx_atomic_t *) (shared + 17 * cl);
+    ngx_stat_aio_queued = (ngx_atomic_t *) (shared + 18 * cl);
+    ngx_stat_aio_active = (ngx_atomic_t *) (shared + 19 * cl);
+    ngx_stat_aio_completed = (ngx_atomic_t *) (shared + 20 * cl);
+    ngx_stat_aio_submit_time = (ngx_atomic_t *) (shared + 21 * cl);
+    ngx_stat_aio_complete_time = (ngx_atomic_t *) (shared + 22 * cl);
+
+#endif
 
 #endif
 
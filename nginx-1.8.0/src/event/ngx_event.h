@@ -206,10 +206,20 @@ struct ngx_event_aio_s {
 
 #if (NGX_HAVE_EVENTFD)
     int64_t                    res;
+
+    ngx_queue_t                queue;       //等待io_submit批量提交的队列节点
+    ngx_msec_t                 start;       //入队或提交的时间，用于延迟统计
+    size_t                     nbytes;      //写操作期望写入的字节数
+    struct iovec              *iov;         //写操作使用的iovec数组，需保留到操作完成
+    ngx_uint_t                 niov;        //iov数组的容量
+    unsigned                   submitted:1; //已经通过io_submit交给内核
 #endif
 
 #if !(NGX_HAVE_EVENTFD) || (NGX_TEST_BUILD_EPOLL)
     ngx_err_t                  err;
+#endif
+
+#if !(NGX_HAVE_EVENTFD)
     size_t                     nbytes;
 #endif
 
@@ -546,6 +556,22 @@ extern ngx_atomic_t  *ngx_stat_active;
 extern ngx_atomic_t  *ngx_stat_reading;
 extern ngx_atomic_t  *ngx_stat_writing;
 extern ngx_atomic_t  *ngx_stat_waiting;
+extern ngx_atomic_t  *ngx_stat_sendfile_inline;
+extern ngx_atomic_t  *ngx_stat_sendfile_offloaded;
+extern ngx_atomic_t  *ngx_stat_bind_failed;
+extern ngx_atomic_t  *ngx_stat_bind_retried;
+extern ngx_atomic_t  *ngx_stat_pipe_memory;
+extern ngx_atomic_t  *ngx_stat_pipe_spilled;
+
+#if (NGX_HAVE_FILE_AIO)
+extern ngx_atomic_t  *ngx_stat_aio_submitted;
+extern ngx_atomic_t  *ngx_stat_aio_batches;
+extern ngx_atomic_t  *ngx_stat_aio_queued;
+extern ngx_atomic_t  *ngx_stat_aio_active;
+extern ngx_atomic_t  *ngx_stat_aio_completed;
+extern ngx_atomic_t  *ngx_stat_aio_submit_time;
+extern ngx_atomic_t  *ngx_stat_aio_complete_time;
+#endif
 
 #endif
 
@@ -11,13 +11,22 @@
 #include <ngx_event_connect.h>
 
 
+static ngx_int_t ngx_event_connect_bind(ngx_peer_connection_t *pc,
+    ngx_socket_t s, ngx_addr_t *local);
+
+
+//本地地址池的轮转计数，每个worker各自一份
+static ngx_uint_t  ngx_event_connect_local_next;
+
+
 ngx_int_t
 ngx_event_connect_peer(ngx_peer_connection_t *pc)
 {
     int                rc;
     ngx_int_t          event;
     ngx_err_t          err;
-    ngx_uint_t         level;
+    ngx_uint_t         level, n, tries;
+    ngx_addr_t        *local;
     ngx_socket_t       s;
     ngx_event_t       *rev, *wev;
     ngx_connection_t  *c;
@@ -27,6 +36,27 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
         return rc;
     }
 
+    n = 0;
+    tries = 1;
+
+    if (pc->local && pc->nlocal > 1) {
+
+        /*
+         * 起始地址由目的地址决定，再逐次轮转，同一目的地的连接均匀
+         * 分布到各个本地地址上；某个地址的端口耗尽时依次尝试下一个
+         */
+
+        n = (ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen)
+             + ngx_event_connect_local_next++)
+            % pc->nlocal;
+
+        tries = pc->nlocal;
+    }
+
+again:
+
+    local = pc->local ? &pc->local[n] : NULL;
+
     s = ngx_socket(pc->sockaddr->sa_family, SOCK_STREAM, 0);
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, pc->log, 0, "socket %d", s);
@@ -66,11 +96,23 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
         goto failed;
     }
 
-    if (pc->local) {
-        if (bind(s, pc->local->sockaddr, pc->local->socklen) == -1) {
-            ngx_log_error(NGX_LOG_CRIT, pc->log, ngx_socket_errno,
-                          "bind(%V) failed", &pc->local->name);
+    if (local) {
+        rc = ngx_event_connect_bind(pc, s, local);
 
+        if (rc == NGX_DECLINED && --tries) {
+            ngx_close_connection(c);
+            pc->connection = NULL;
+
+            n = (n + 1) % pc->nlocal;
+
+#if (NGX_STAT_STUB)
+            (void) ngx_atomic_fetch_add(ngx_stat_bind_retried, 1);
+#endif
+
+            goto again;
+        }
+
+        if (rc != NGX_OK) {
             goto failed;
         }
     }
@@ -118,6 +160,32 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
     if (rc == -1) {
         err = ngx_socket_errno;
 
+        if (err == NGX_EADDRNOTAVAIL) {
+
+            /* 延迟分配端口时，本地端口耗尽在connect()时才会报告 */
+
+#if (NGX_STAT_STUB)
+            (void) ngx_atomic_fetch_add(ngx_stat_bind_failed, 1);
+#endif
+
+            if (local && --tries) {
+                ngx_log_error(NGX_LOG_INFO, c->log, err,
+                              "connect() to %V from %V failed, "
+                              "trying next local address",
+                              pc->name, &local->name);
+
+                ngx_close_connection(c);
+                pc->connection = NULL;
+
+                n = (n + 1) % pc->nlocal;
+
+#if (NGX_STAT_STUB)
+                (void) ngx_atomic_fetch_add(ngx_stat_bind_retried, 1);
+#endif
+
+                goto again;
+            }
+        }
 
         if (err != NGX_EINPROGRESS
 #if (NGX_WIN32)
@@ -245,3 +313,84 @@ ngx_event_get_peer(ngx_peer_connection_t *pc, void *data)
 {
     return NGX_OK;
 }
+
+
+static ngx_int_t
+ngx_event_connect_bind(ngx_peer_connection_t *pc, ngx_socket_t s,
+    ngx_addr_t *local)
+{
+    ngx_err_t   err;
+    in_port_t   port;
+
+#if (NGX_HAVE_IP_BIND_ADDRESS_NO_PORT)
+    static int  bind_address_no_port = 1;
+#endif
+
+    switch (local->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        port = ((struct sockaddr_in6 *) local->sockaddr)->sin6_port;
+        break;
+#endif
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    case AF_UNIX:
+        port = 1;
+        break;
+#endif
+
+    default: /* AF_INET */
+        port = ((struct sockaddr_in *) local->sockaddr)->sin_port;
+    }
+
+#if (NGX_HAVE_IP_BIND_ADDRESS_NO_PORT)
+
+    /*
+     * 不指定端口时让内核在connect()时再选择端口，
+     * 端口只需在完整的四元组内唯一，而不必在本地地址上唯一
+     */
+
+    if (port == 0 && bind_address_no_port) {
+        if (setsockopt(s, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+                       (const void *) &bind_address_no_port, sizeof(int))
+            == -1)
+        {
+            err = ngx_socket_errno;
+
+            if (err != NGX_EOPNOTSUPP && err != NGX_ENOPROTOOPT) {
+                ngx_log_error(NGX_LOG_ALERT, pc->log, err,
+                              "setsockopt(IP_BIND_ADDRESS_NO_PORT) "
+                              "failed, ignored");
+
+            } else {
+                bind_address_no_port = 0;
+            }
+        }
+    }
+
+#endif
+
+    if (bind(s, local->sockaddr, local->socklen) == -1) {
+        err = ngx_socket_errno;
+
+        if (port == 0 && (err == NGX_EADDRINUSE || err == NGX_EADDRNOTAVAIL)) {
+
+#if (NGX_STAT_STUB)
+            (void) ngx_atomic_fetch_add(ngx_stat_bind_failed, 1);
+#endif
+
+            ngx_log_error(NGX_LOG_ERR, pc->log, err,
+                          "bind(%V) failed", &local->name);
+
+            return NGX_DECLINED;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, pc->log, err,
+                      "bind(%V) failed", &local->name);
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
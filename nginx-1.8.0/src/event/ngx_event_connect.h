@@ -62,8 +62,9 @@ struct ngx_peer_connection_s {
     ngx_event_save_peer_session_pt   save_session;
 #endif
 
-    //本机地址信息
+    //本机地址信息，nlocal大于1时为本地地址池，按目的地址选择其中一个
     ngx_addr_t                      *local;
+    ngx_uint_t                       nlocal;
 
     //套接字接收缓冲区大小
     int                              rcvbuf;
@@ -17,6 +17,19 @@ static ngx_int_t ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p);
 static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p);
 static ngx_inline void ngx_event_pipe_remove_shadow_links(ngx_buf_t *buf);
 static ngx_int_t ngx_event_pipe_drain_chains(ngx_event_pipe_t *p);
+static ngx_int_t ngx_event_pipe_unshare_bufs(ngx_event_pipe_t *p);
+static ngx_chain_t *ngx_event_pipe_alloc_buf(ngx_event_pipe_t *p);
+static void *ngx_event_pipe_alloc_grown(ngx_event_pipe_t *p);
+static ngx_int_t ngx_event_pipe_grow(ngx_event_pipe_t *p);
+static void ngx_event_pipe_shrink(ngx_event_pipe_t *p);
+static void ngx_event_pipe_cleanup(void *data);
+
+
+/* the memory of the bufs allocated beyond p->bufs.num in the worker */
+static size_t       ngx_event_pipe_grown_size;
+
+/* the pipes with such bufs */
+static ngx_queue_t  ngx_event_pipe_grown_queue;
 
 
 ngx_int_t
@@ -57,6 +70,11 @@ ngx_event_pipe(ngx_event_pipe_t *p, ngx_int_t do_write)
         do_write = 1;
     }
 
+    //下游已追上上游时，释放超出p->bufs.num的空闲缓冲区
+    if (p->grown && p->in == NULL && p->out == NULL) {
+        ngx_event_pipe_shrink(p);
+    }
+
     if (p->upstream->fd != (ngx_socket_t) -1) {
         rev = p->upstream->read;
 
@@ -108,6 +126,30 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
     ngx_msec_t    delay;
     ngx_chain_t  *chain, *cl, *ln;
 
+#if (NGX_HAVE_FILE_AIO)
+
+    if (p->aio) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                       "pipe read upstream: aio");
+        return NGX_AGAIN;
+    }
+
+    if (p->writing) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                       "pipe read upstream: writing");
+
+        rc = ngx_event_pipe_write_chain_to_temp_file(p);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        //已写入临时文件的数据可以发送给下游了，需要再次执行写下游
+        p->read = 1;
+    }
+
+#endif
+
     if (p->upstream_eof || p->upstream_error || p->upstream_done) {
         return NGX_OK;
     }
@@ -208,21 +250,11 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
 
                 /* allocate a new buf if it's still allowed */
 
-                b = ngx_create_temp_buf(p->pool, p->bufs.size);
-                if (b == NULL) {
-                    return NGX_ABORT;
-                }
-
-                p->allocated++;
-
-                chain = ngx_alloc_chain_link(p->pool);
+                chain = ngx_event_pipe_alloc_buf(p);
                 if (chain == NULL) {
                     return NGX_ABORT;
                 }
 
-                chain->buf = b;
-                chain->next = NULL;
-
             } else if (!p->cacheable
                        && p->downstream->data == p->output_ctx
                        && p->downstream->write->ready
@@ -240,6 +272,44 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
 
                 break;
 
+            } else if (ngx_event_pipe_grow(p) == NGX_OK) {
+
+                /*
+                 * the downstream is slower than the upstream, allocate
+                 * one more buf instead of writing to a temporary file
+                 */
+
+                chain = ngx_event_pipe_alloc_buf(p);
+                if (chain == NULL) {
+                    return NGX_ABORT;
+                }
+
+            } else if (p->share_bufs && p->in == NULL) {
+
+                /*
+                 * all bufs are already in the temporary file, so the bufs
+                 * that are not passed to the downstream yet are sent
+                 * from the file to free their raw bufs
+                 */
+
+                if (ngx_event_pipe_unshare_bufs(p) != NGX_OK) {
+                    return NGX_ABORT;
+                }
+
+                if (p->free_raw_bufs == NULL) {
+                    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                                   "no pipe bufs to read in");
+                    break;
+                }
+
+                chain = p->free_raw_bufs;
+                if (p->single_buf) {
+                    p->free_raw_bufs = p->free_raw_bufs->next;
+                    chain->next = NULL;
+                } else {
+                    p->free_raw_bufs = NULL;
+                }
+
             } else if (p->cacheable
                        || p->temp_file->offset < p->max_temp_file_size)
             {
@@ -275,6 +345,13 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
                     return rc;
                 }
 
+                if (p->share_bufs) {
+
+                    /* the written bufs still wait to be sent from memory */
+
+                    continue;
+                }
+
                 chain = p->free_raw_bufs;
                 if (p->single_buf) {
                     p->free_raw_bufs = p->free_raw_bufs->next;
@@ -461,6 +538,10 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
 
         p->free_raw_bufs = p->free_raw_bufs->next;
 
+        if (p->grown) {
+            ngx_event_pipe_shrink(p);
+        }
+
         if (p->free_bufs && p->buf_to_file == NULL) {
             for (cl = p->free_raw_bufs; cl; cl = cl->next) {
                 if (cl->buf->shadow == NULL) {
@@ -532,6 +613,10 @@ ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p)
                 p->out = NULL;
             }
 
+            if (p->writing) {
+                break;
+            }
+
             if (p->in) {
                 ngx_log_debug0(NGX_LOG_DEBUG_EVENT, p->log, 0,
                                "pipe write downstream flush in");
@@ -602,13 +687,34 @@ ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p)
                 cl = p->out;
 
                 if (cl->buf->recycled) {
-                    ngx_log_error(NGX_LOG_ALERT, p->log, 0,
-                                  "recycled buffer in pipe out chain");
+
+                    if (!p->share_bufs) {
+                        ngx_log_error(NGX_LOG_ALERT, p->log, 0,
+                                      "recycled buffer in pipe out chain");
+
+                    } else if (prev_last_shadow) {
+
+                        /* the buf is both in the temp file and in memory */
+
+                        if (bsize + cl->buf->end - cl->buf->start
+                            > p->busy_size)
+                        {
+                            flush = 1;
+                            break;
+                        }
+
+                        bsize += cl->buf->end - cl->buf->start;
+                    }
+
+                    prev_last_shadow = cl->buf->last_shadow;
+
+                } else {
+                    prev_last_shadow = 1;
                 }
 
                 p->out = p->out->next;
 
-            } else if (!p->cacheable && p->in) {
+            } else if (!p->cacheable && !p->writing && p->in) {
                 cl = p->in;
 
                 ngx_log_debug3(NGX_LOG_DEBUG_EVENT, p->log, 0,
@@ -710,12 +816,41 @@ ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
     ssize_t       size, bsize, n;
     ngx_buf_t    *b;
     ngx_uint_t    prev_last_shadow;
-    ngx_chain_t  *cl, *tl, *next, *out, **ll, **last_out, **last_free, fl;
+    ngx_chain_t  *cl, *tl, *next, *out, **ll, **last_out, **last_free;
+
+#if (NGX_HAVE_FILE_AIO)
+
+    if (p->writing) {
+
+        if (p->aio) {
+            return NGX_AGAIN;
+        }
+
+        out = p->writing;
+        p->writing = NULL;
+
+        n = ngx_write_chain_to_temp_file(p->temp_file, NULL);
+
+        if (n == NGX_ERROR) {
+            return NGX_ABORT;
+        }
+
+        goto done;
+    }
+
+#endif
 
     if (p->buf_to_file) {
-        fl.buf = p->buf_to_file;
-        fl.next = p->in;
-        out = &fl;
+
+        /* the link must outlive the call if the write is posted to aio */
+
+        out = ngx_alloc_chain_link(p->pool);
+        if (out == NULL) {
+            return NGX_ABORT;
+        }
+
+        out->buf = p->buf_to_file;
+        out->next = p->in;
 
     } else {
         out = p->in;
@@ -781,6 +916,21 @@ ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
         return NGX_ABORT;
     }
 
+#if (NGX_HAVE_FILE_AIO)
+
+    if (n == NGX_AGAIN) {
+        p->writing = out;
+        p->aio = 1;
+
+        p->aio_handler(p, &p->temp_file->file);
+
+        return NGX_AGAIN;
+    }
+
+done:
+
+#endif
+
     if (p->buf_to_file) {
         p->temp_file->offset = p->buf_to_file->last - p->buf_to_file->pos;
         n -= p->buf_to_file->last - p->buf_to_file->pos;
@@ -788,6 +938,38 @@ ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
         out = out->next;
     }
 
+#if (NGX_STAT_STUB)
+
+    if (!p->cacheable && n > 0) {
+        (void) ngx_atomic_fetch_add(ngx_stat_pipe_spilled, n);
+    }
+
+#endif
+
+    if (p->share_bufs) {
+
+        /*
+         * the written bufs are passed to the downstream as is, their
+         * raw bufs are freed when the downstream has sent them
+         */
+
+        for (cl = out; cl; cl = cl->next) {
+            b = cl->buf;
+
+            b->in_file = 1;
+            b->file = &p->temp_file->file;
+            b->file_pos = p->temp_file->offset;
+            p->temp_file->offset += b->last - b->pos;
+            b->file_last = p->temp_file->offset;
+        }
+
+        for (ll = &p->out; *ll; ll = &(*ll)->next) { /* void */ }
+
+        *ll = out;
+
+        return NGX_OK;
+    }
+
     if (n > 0) {
         /* update previous buffer or add new buffer */
 
@@ -1035,3 +1217,310 @@ ngx_event_pipe_drain_chains(ngx_event_pipe_t *p)
         }
     }
 }
+
+
+static ngx_int_t
+ngx_event_pipe_unshare_bufs(ngx_event_pipe_t *p)
+{
+    ngx_uint_t    last;
+    ngx_buf_t    *b, *raw, *next, *prev;
+    ngx_chain_t  *cl, **ll;
+
+    prev = NULL;
+
+    for (ll = &p->out; *ll; /* void */) {
+        cl = *ll;
+        b = cl->buf;
+
+        if (b->recycled && b->shadow) {
+
+            for (raw = b; !raw->last_shadow; raw = raw->shadow) { /* void */ }
+
+            raw = raw->shadow;
+
+            /*
+             * the raw buf can be freed only if none of its bufs
+             * has been passed to the downstream already
+             */
+
+            if (raw->shadow == b) {
+
+                do {
+                    next = b->shadow;
+                    last = b->last_shadow;
+
+                    b->temporary = 0;
+                    b->recycled = 0;
+                    b->temp_file = 1;
+                    b->last_shadow = 0;
+                    b->shadow = NULL;
+
+                    b = next;
+
+                } while (!last);
+
+                if (ngx_event_pipe_add_free_buf(p, raw) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                b = cl->buf;
+            }
+        }
+
+        if (ngx_buf_in_memory(b) || !b->temp_file) {
+            prev = NULL;
+            ll = &cl->next;
+            continue;
+        }
+
+        /* coalesce the neighbouring parts of the temp file */
+
+        if (prev && prev->file_last == b->file_pos) {
+            prev->file_last = b->file_last;
+
+            *ll = cl->next;
+            cl->next = p->free;
+            p->free = cl;
+
+            continue;
+        }
+
+        prev = b;
+        ll = &cl->next;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                   "pipe unshare: %p", p->free_raw_bufs);
+
+    return NGX_OK;
+}
+
+
+static ngx_chain_t *
+ngx_event_pipe_alloc_buf(ngx_event_pipe_t *p)
+{
+    ngx_buf_t           *b;
+    ngx_chain_t         *cl;
+    ngx_pool_cleanup_t  *cln;
+
+    if (p->allocated == 0) {
+        cln = ngx_pool_cleanup_add(p->pool, 0);
+        if (cln == NULL) {
+            return NULL;
+        }
+
+        cln->handler = ngx_event_pipe_cleanup;
+        cln->data = p;
+    }
+
+    if (p->allocated < p->bufs.num) {
+        b = ngx_create_temp_buf(p->pool, p->bufs.size);
+        if (b == NULL) {
+            return NULL;
+        }
+
+    } else {
+
+        /* the grown bufs are allocated separately to be freed early */
+
+        b = ngx_calloc_buf(p->pool);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        b->start = ngx_event_pipe_alloc_grown(p);
+        if (b->start == NULL) {
+            return NULL;
+        }
+
+        b->pos = b->start;
+        b->last = b->start;
+        b->end = b->start + p->bufs.size;
+        b->temporary = 1;
+        b->tag = (ngx_buf_tag_t) &ngx_event_pipe_grown_queue;
+
+        if (!p->grown) {
+            if (ngx_event_pipe_grown_queue.next == NULL) {
+                ngx_queue_init(&ngx_event_pipe_grown_queue);
+            }
+
+            ngx_queue_insert_tail(&ngx_event_pipe_grown_queue, &p->queue);
+            p->grown = 1;
+        }
+
+        ngx_event_pipe_grown_size += p->bufs.size;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                       "pipe grow: %i bufs, worker %uz",
+                       p->allocated + 1, ngx_event_pipe_grown_size);
+    }
+
+    cl = ngx_alloc_chain_link(p->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    p->allocated++;
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_pipe_memory, p->bufs.size);
+#endif
+
+    return cl;
+}
+
+
+static void *
+ngx_event_pipe_alloc_grown(ngx_event_pipe_t *p)
+{
+    void              *m;
+    ngx_pool_large_t  *large;
+
+    m = ngx_memalign(NGX_ALIGNMENT, p->bufs.size, p->log);
+    if (m == NULL) {
+        return NULL;
+    }
+
+    /*
+     * the entries of the bufs freed by ngx_event_pipe_shrink() are reused,
+     * or each grow and shrink cycle would leave one in the pool
+     */
+
+    for (large = p->pool->large; large; large = large->next) {
+        if (large->alloc == NULL) {
+            large->alloc = m;
+            return m;
+        }
+    }
+
+    large = ngx_palloc(p->pool, sizeof(ngx_pool_large_t));
+    if (large == NULL) {
+        ngx_free(m);
+        return NULL;
+    }
+
+    large->alloc = m;
+    large->next = p->pool->large;
+    p->pool->large = large;
+
+    return m;
+}
+
+
+static ngx_int_t
+ngx_event_pipe_grow(ngx_event_pipe_t *p)
+{
+    ngx_queue_t       *q, *next;
+    ngx_event_pipe_t  *gp;
+
+    if (p->allocated >= p->max_bufs || p->cacheable) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_event_pipe_grown_size + p->bufs.size <= p->budget) {
+        return NGX_OK;
+    }
+
+    if (ngx_event_pipe_grown_queue.next == NULL) {
+        return NGX_DECLINED;
+    }
+
+    /* reclaim the idle grown bufs of other requests */
+
+    for (q = ngx_queue_head(&ngx_event_pipe_grown_queue);
+         q != ngx_queue_sentinel(&ngx_event_pipe_grown_queue);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        gp = ngx_queue_data(q, ngx_event_pipe_t, queue);
+
+        if (gp == p) {
+            continue;
+        }
+
+        ngx_event_pipe_shrink(gp);
+
+        if (ngx_event_pipe_grown_size + p->bufs.size <= p->budget) {
+            return NGX_OK;
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                   "pipe grow: budget exhausted, worker %uz",
+                   ngx_event_pipe_grown_size);
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_event_pipe_shrink(ngx_event_pipe_t *p)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl, **ll;
+
+    /* only the empty grown bufs in p->free_raw_bufs are not in use */
+
+    ll = &p->free_raw_bufs;
+
+    for (cl = p->free_raw_bufs; cl; cl = *ll) {
+        b = cl->buf;
+
+        if (b->tag != (ngx_buf_tag_t) &ngx_event_pipe_grown_queue
+            || b->pos != b->last
+            || b->shadow)
+        {
+            ll = &cl->next;
+            continue;
+        }
+
+        if (ngx_pfree(p->pool, b->start) != NGX_OK) {
+            ll = &cl->next;
+            continue;
+        }
+
+        *ll = cl->next;
+        ngx_free_chain(p->pool, cl);
+
+        p->allocated--;
+        ngx_event_pipe_grown_size -= p->bufs.size;
+
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_pipe_memory,
+                                    -(ngx_atomic_int_t) p->bufs.size);
+#endif
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                   "pipe shrink: %i bufs, worker %uz",
+                   p->allocated, ngx_event_pipe_grown_size);
+
+    if (p->allocated <= p->bufs.num) {
+        ngx_queue_remove(&p->queue);
+        p->grown = 0;
+    }
+}
+
+
+static void
+ngx_event_pipe_cleanup(void *data)
+{
+    ngx_event_pipe_t  *p = data;
+
+    if (p->grown) {
+        ngx_event_pipe_grown_size -= (p->allocated - p->bufs.num)
+                                     * p->bufs.size;
+        ngx_queue_remove(&p->queue);
+        p->grown = 0;
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_pipe_memory,
+                                -(ngx_atomic_int_t) (p->allocated
+                                                     * p->bufs.size));
+#endif
+}
@@ -20,6 +20,7 @@ typedef ngx_int_t (*ngx_event_pipe_input_filter_pt)(ngx_event_pipe_t *p,
                                                     ngx_buf_t *buf);
 typedef ngx_int_t (*ngx_event_pipe_output_filter_pt)(void *data,
                                                      ngx_chain_t *chain);
+typedef void (*ngx_event_pipe_aio_pt)(ngx_event_pipe_t *p, ngx_file_t *file);
 
 
 struct ngx_event_pipe_s {
@@ -34,6 +35,9 @@ struct ngx_event_pipe_s {
     ngx_chain_t       *free;
     ngx_chain_t       *busy;
 
+    /* the chain that is being written to the temp file with aio */
+    ngx_chain_t       *writing;
+
     /*
      * the input filter i.e. that moves HTTP/1.1 chunks
      * from the raw bufs to an incoming chain
@@ -45,6 +49,10 @@ struct ngx_event_pipe_s {
     ngx_event_pipe_output_filter_pt   output_filter;
     void                             *output_ctx;
 
+#if (NGX_HAVE_FILE_AIO)
+    ngx_event_pipe_aio_pt             aio_handler;
+#endif
+
     unsigned           read:1;
     unsigned           cacheable:1;
     unsigned           single_buf:1;
@@ -56,11 +64,29 @@ struct ngx_event_pipe_s {
     unsigned           downstream_done:1;
     unsigned           downstream_error:1;
     unsigned           cyclic_temp_file:1;
+    unsigned           aio:1;
+    unsigned           grown:1;
+
+    /*
+     * the bufs written to the temp file are kept in memory and are sent
+     * to the downstream from memory, the raw buf is reused after that
+     */
+    unsigned           share_bufs:1;
 
     ngx_int_t          allocated;
     ngx_bufs_t         bufs;
     ngx_buf_tag_t      tag;
 
+    /*
+     * bufs may be allocated beyond bufs.num up to max_bufs while the
+     * downstream is slower than the upstream, as long as the memory
+     * of such bufs in the worker stays within the budget
+     */
+
+    ngx_int_t          max_bufs;
+    size_t             budget;
+    ngx_queue_t        queue;
+
     ssize_t            busy_size;
 
     off_t              read_length;
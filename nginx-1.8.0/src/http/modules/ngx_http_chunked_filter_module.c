@@ -111,6 +111,11 @@ ngx_http_chunked_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return ngx_http_next_body_filter(r, in);
     }
 
+    if (r->chunked_passthrough) {
+        /* the body already carries the upstream chunked framing */
+        return ngx_http_next_body_filter(r, in);
+    }
+
     ctx = ngx_http_get_module_ctx(r, ngx_http_chunked_filter_module);
 
     out = NULL;
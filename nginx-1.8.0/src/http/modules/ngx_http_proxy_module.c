@@ -87,6 +87,8 @@ typedef struct {
 
     ngx_uint_t                     http_version;
 
+    ngx_flag_t                     chunked_passthrough;
+
     ngx_uint_t                     headers_hash_max_size;
     ngx_uint_t                     headers_hash_bucket_size;
 
@@ -138,6 +140,13 @@ static ngx_int_t ngx_http_proxy_non_buffered_copy_filter(void *data,
     ssize_t bytes);
 static ngx_int_t ngx_http_proxy_non_buffered_chunked_filter(void *data,
     ssize_t bytes);
+static ngx_int_t ngx_http_proxy_chunked_passthrough_filter(ngx_event_pipe_t *p,
+    ngx_buf_t *buf);
+static ngx_int_t
+    ngx_http_proxy_non_buffered_chunked_passthrough_filter(void *data,
+    ssize_t bytes);
+static ngx_int_t ngx_http_proxy_skip_chunked(ngx_http_request_t *r,
+    ngx_buf_t *buf, ngx_http_proxy_ctx_t *ctx);
 static void ngx_http_proxy_abort_request(ngx_http_request_t *r);
 static void ngx_http_proxy_finalize_request(ngx_http_request_t *r,
     ngx_int_t rc);
@@ -315,12 +324,47 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       NULL },
 
     { ngx_string("proxy_bind"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_http_upstream_bind_set_slot,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_proxy_loc_conf_t, upstream.local),
       NULL },
 
+    { ngx_string("proxy_hedge_after"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_hedge_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.hedge),
+      NULL },
+
+    { ngx_string("proxy_collapse"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.collapse),
+      NULL },
+
+    { ngx_string("proxy_collapse_key"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.collapse_key),
+      NULL },
+
+    { ngx_string("proxy_collapse_max_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.collapse_max_size),
+      NULL },
+
+    { ngx_string("proxy_splice"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.splice),
+      NULL },
+
     { ngx_string("proxy_connect_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -419,6 +463,20 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.bufs),
       NULL },
 
+    { ngx_string("proxy_buffers_max"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.buffers_max),
+      NULL },
+
+    { ngx_string("proxy_buffers_budget"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.buffers_budget),
+      NULL },
+
     { ngx_string("proxy_busy_buffers_size"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
@@ -605,6 +663,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, http_version),
       &ngx_http_proxy_http_version },
 
+    { ngx_string("proxy_chunked_passthrough"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, chunked_passthrough),
+      NULL },
+
 #if (NGX_HTTP_SSL)
 
     { ngx_string("proxy_ssl_session_reuse"),
@@ -1770,19 +1835,49 @@ ngx_http_proxy_process_header(ngx_http_request_t *r)
             h->key.len = r->header_name_end - r->header_name_start;
             h->value.len = r->header_end - r->header_start;
 
-            h->key.data = ngx_pnalloc(r->pool,
+#if (NGX_HTTP_CACHE)
+
+            if (r->cache) {
+
+                /* the header bytes in the buffer are written to a cache file */
+
+                h->key.data = ngx_pnalloc(r->pool,
                                h->key.len + 1 + h->value.len + 1 + h->key.len);
-            if (h->key.data == NULL) {
-                return NGX_ERROR;
-            }
+                if (h->key.data == NULL) {
+                    return NGX_ERROR;
+                }
+
+                h->value.data = h->key.data + h->key.len + 1;
+                h->lowcase_key = h->key.data + h->key.len + 1
+                                 + h->value.len + 1;
 
-            h->value.data = h->key.data + h->key.len + 1;
-            h->lowcase_key = h->key.data + h->key.len + 1 + h->value.len + 1;
+                ngx_memcpy(h->key.data, r->header_name_start, h->key.len);
+                h->key.data[h->key.len] = '\0';
+                ngx_memcpy(h->value.data, r->header_start, h->value.len);
+                h->value.data[h->value.len] = '\0';
 
-            ngx_memcpy(h->key.data, r->header_name_start, h->key.len);
-            h->key.data[h->key.len] = '\0';
-            ngx_memcpy(h->value.data, r->header_start, h->value.len);
-            h->value.data[h->value.len] = '\0';
+            } else
+
+#endif
+            {
+                /*
+                 * the header line is left in the buffer, which is not
+                 * reused for the response body, see ngx_http_upstream_pin_header()
+                 */
+
+                h->key.data = r->header_name_start;
+                h->key.data[h->key.len] = '\0';
+
+                h->value.data = r->header_start;
+                h->value.data[h->value.len] = '\0';
+
+                h->lowcase_key = ngx_pnalloc(r->pool, h->key.len);
+                if (h->lowcase_key == NULL) {
+                    return NGX_ERROR;
+                }
+
+                r->upstream->headers_in.in_buffer = 1;
+            }
 
             if (h->key.len == r->lowcase_index) {
                 ngx_memcpy(h->lowcase_key, r->lowcase_header, h->key.len);
@@ -1896,9 +1991,10 @@ ngx_http_proxy_process_header(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_proxy_input_filter_init(void *data)
 {
-    ngx_http_request_t    *r = data;
-    ngx_http_upstream_t   *u;
-    ngx_http_proxy_ctx_t  *ctx;
+    ngx_http_request_t          *r = data;
+    ngx_http_upstream_t         *u;
+    ngx_http_proxy_ctx_t        *ctx;
+    ngx_http_proxy_loc_conf_t   *plcf;
 
     u = r->upstream;
     ctx = ngx_http_get_module_ctx(r, ngx_http_proxy_module);
@@ -1928,10 +2024,37 @@ ngx_http_proxy_input_filter_init(void *data)
     } else if (u->headers_in.chunked) {
         /* chunked */
 
-        u->pipe->input_filter = ngx_http_proxy_chunked_filter;
-        u->pipe->length = 3; /* "0" LF LF */
+        plcf = ngx_http_get_module_loc_conf(r, ngx_http_proxy_module);
+
+        /*
+         * the chunks are passed to the client as is if the chunked filter
+         * is going to encode the response, and no filter before it has
+         * changed the body, and the body is not stored or shared
+         */
+
+        if (plcf->chunked_passthrough
+            && r->chunked
+            && !r->body_transformed
+            && !r->subrequest_in_memory
+            && !u->cacheable
+            && !u->store
+            && u->collapse == NULL)
+        {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http proxy chunked passthrough");
 
-        u->input_filter = ngx_http_proxy_non_buffered_chunked_filter;
+            r->chunked_passthrough = 1;
+
+            u->pipe->input_filter = ngx_http_proxy_chunked_passthrough_filter;
+            u->input_filter =
+                        ngx_http_proxy_non_buffered_chunked_passthrough_filter;
+
+        } else {
+            u->pipe->input_filter = ngx_http_proxy_chunked_filter;
+            u->input_filter = ngx_http_proxy_non_buffered_chunked_filter;
+        }
+
+        u->pipe->length = 3; /* "0" LF LF */
         u->length = 1;
 
     } else if (u->headers_in.content_length_n == 0) {
@@ -2310,6 +2433,197 @@ ngx_http_proxy_non_buffered_chunked_filter(void *data, ssize_t bytes)
 }
 
 
+static ngx_int_t
+ngx_http_proxy_chunked_passthrough_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
+{
+    u_char                *pos;
+    ngx_int_t              rc;
+    ngx_buf_t             *b;
+    ngx_chain_t           *cl;
+    ngx_http_request_t    *r;
+    ngx_http_proxy_ctx_t  *ctx;
+
+    if (buf->pos == buf->last) {
+        return NGX_OK;
+    }
+
+    r = p->input_ctx;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_proxy_module);
+
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    pos = buf->pos;
+
+    rc = ngx_http_proxy_skip_chunked(r, buf, ctx);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_DONE) {
+        p->upstream_done = 1;
+        r->upstream->keepalive = !r->upstream->headers_in.connection_close;
+
+    } else {
+        p->length = ctx->chunked.length;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http proxy chunked state %d, length %d",
+                   ctx->chunked.state, p->length);
+
+    if (buf->pos == pos) {
+        return ngx_event_pipe_add_free_buf(p, buf);
+    }
+
+    /* the whole parsed part of the buf, framing included, is passed on */
+
+    cl = ngx_chain_get_free_buf(p->pool, &p->free);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = cl->buf;
+
+    ngx_memcpy(b, buf, sizeof(ngx_buf_t));
+    b->pos = pos;
+    b->last = buf->pos;
+    b->shadow = buf;
+    b->tag = p->tag;
+    b->last_shadow = 1;
+    b->recycled = 1;
+    buf->shadow = b;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                   "input buf #%d %z", b->num, b->last - b->pos);
+
+    if (p->in) {
+        *p->last_in = cl;
+    } else {
+        p->in = cl;
+    }
+    p->last_in = &cl->next;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_proxy_non_buffered_chunked_passthrough_filter(void *data,
+    ssize_t bytes)
+{
+    ngx_http_request_t   *r = data;
+
+    u_char                *pos;
+    ngx_int_t              rc;
+    ngx_buf_t             *b, *buf;
+    ngx_chain_t           *cl, **ll;
+    ngx_http_upstream_t   *u;
+    ngx_http_proxy_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_proxy_module);
+
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+    buf = &u->buffer;
+
+    buf->pos = buf->last;
+    buf->last += bytes;
+
+    pos = buf->pos;
+
+    rc = ngx_http_proxy_skip_chunked(r, buf, ctx);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_DONE) {
+        u->keepalive = !u->headers_in.connection_close;
+        u->length = 0;
+    }
+
+    if (buf->pos == pos) {
+        return NGX_OK;
+    }
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    *ll = cl;
+
+    b = cl->buf;
+
+    b->flush = 1;
+    b->memory = 1;
+
+    b->pos = pos;
+    b->last = buf->pos;
+    b->tag = u->output.tag;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http proxy out buf %p %z", b->pos, b->last - b->pos);
+
+    return NGX_OK;
+}
+
+
+/*
+ * validates the chunked framing and skips over the chunk data,
+ * returns NGX_DONE on the last chunk, NGX_AGAIN if more data are needed
+ */
+
+static ngx_int_t
+ngx_http_proxy_skip_chunked(ngx_http_request_t *r, ngx_buf_t *buf,
+    ngx_http_proxy_ctx_t *ctx)
+{
+    ngx_int_t  rc;
+
+    for ( ;; ) {
+
+        rc = ngx_http_parse_chunked(r, buf, &ctx->chunked);
+
+        if (rc == NGX_OK) {
+
+            /* a chunk has been parsed successfully */
+
+            if (buf->last - buf->pos >= ctx->chunked.size) {
+                buf->pos += (size_t) ctx->chunked.size;
+                ctx->chunked.size = 0;
+
+            } else {
+                ctx->chunked.size -= buf->last - buf->pos;
+                buf->pos = buf->last;
+            }
+
+            continue;
+        }
+
+        if (rc == NGX_DONE || rc == NGX_AGAIN) {
+            return rc;
+        }
+
+        /* invalid response */
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstream sent invalid chunked response");
+
+        return NGX_ERROR;
+    }
+}
+
+
 static void
 ngx_http_proxy_abort_request(ngx_http_request_t *r)
 {
@@ -2323,10 +2637,25 @@ ngx_http_proxy_abort_request(ngx_http_request_t *r)
 static void
 ngx_http_proxy_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 {
+    ngx_http_upstream_t  *u;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "finalize http proxy request");
 
-    return;
+    if (!r->chunked_passthrough) {
+        return;
+    }
+
+    /*
+     * the last chunk was not seen, so the response can not be completed
+     * for the client: the connection is closed to signal the truncation
+     */
+
+    u = r->upstream;
+
+    if (u->buffering ? !u->pipe->upstream_done : u->length != 0) {
+        r->keepalive = 0;
+    }
 }
 
 
@@ -2787,6 +3116,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
      *     conf->upstream.store_lengths = NULL;
      *     conf->upstream.store_values = NULL;
      *     conf->upstream.ssl_name = NULL;
+     *     conf->upstream.collapse_key = NULL;
      *
      *     conf->method = { 0, NULL };
      *     conf->headers_source = NULL;
@@ -2818,6 +3148,11 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.force_ranges = NGX_CONF_UNSET;
 
     conf->upstream.local = NGX_CONF_UNSET_PTR;
+    conf->upstream.hedge = NGX_CONF_UNSET_PTR;
+
+    conf->upstream.collapse = NGX_CONF_UNSET;
+    conf->upstream.collapse_max_size = NGX_CONF_UNSET_SIZE;
+    conf->upstream.splice = NGX_CONF_UNSET;
 
     conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
@@ -2829,6 +3164,8 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.limit_rate = NGX_CONF_UNSET_SIZE;
 
     conf->upstream.busy_buffers_size_conf = NGX_CONF_UNSET_SIZE;
+    conf->upstream.buffers_max = NGX_CONF_UNSET_UINT;
+    conf->upstream.buffers_budget = NGX_CONF_UNSET_SIZE;
     conf->upstream.max_temp_file_size_conf = NGX_CONF_UNSET_SIZE;
     conf->upstream.temp_file_write_size_conf = NGX_CONF_UNSET_SIZE;
 
@@ -2870,6 +3207,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->cookie_paths = NGX_CONF_UNSET_PTR;
 
     conf->http_version = NGX_CONF_UNSET_UINT;
+    conf->chunked_passthrough = NGX_CONF_UNSET;
 
     conf->headers_hash_max_size = NGX_CONF_UNSET_UINT;
     conf->headers_hash_bucket_size = NGX_CONF_UNSET_UINT;
@@ -2935,6 +3273,66 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_ptr_value(conf->upstream.local,
                               prev->upstream.local, NULL);
 
+    ngx_conf_merge_ptr_value(conf->upstream.hedge,
+                              prev->upstream.hedge, NULL);
+
+    ngx_conf_merge_value(conf->upstream.collapse,
+                              prev->upstream.collapse, 0);
+
+    ngx_conf_merge_size_value(conf->upstream.collapse_max_size,
+                              prev->upstream.collapse_max_size,
+                              1024 * 1024);
+
+    if (conf->upstream.collapse_key == NULL) {
+        conf->upstream.collapse_key = prev->upstream.collapse_key;
+    }
+
+    if (conf->upstream.collapse && conf->upstream.collapse_key == NULL) {
+        ngx_str_t                          key;
+        ngx_http_compile_complex_value_t   ccv;
+
+        ngx_str_set(&key, "$scheme$proxy_host$request_uri");
+
+        conf->upstream.collapse_key = ngx_palloc(cf->pool,
+                                            sizeof(ngx_http_complex_value_t));
+        if (conf->upstream.collapse_key == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &key;
+        ccv.complex_value = conf->upstream.collapse_key;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /*
+     * requests with credentials are collapsed, and private responses
+     * are shared, only if the key explicitly includes the credentials
+     */
+
+    if (conf->upstream.collapse) {
+        u_char  *start, *last;
+
+        start = conf->upstream.collapse_key->value.data;
+        last = start + conf->upstream.collapse_key->value.len;
+
+        conf->upstream.collapse_authorization =
+            (ngx_strlcasestrn(start, last, (u_char *) "http_authorization",
+                              18 - 1)
+             != NULL);
+
+        conf->upstream.collapse_cookie =
+            (ngx_strlcasestrn(start, last, (u_char *) "http_cookie", 11 - 1)
+             != NULL);
+    }
+
+    ngx_conf_merge_value(conf->upstream.splice, prev->upstream.splice, 0);
+
     ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
                               prev->upstream.connect_timeout, 60000);
 
@@ -2966,6 +3364,23 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+    ngx_conf_merge_uint_value(conf->upstream.buffers_max,
+                              prev->upstream.buffers_max, 0);
+
+    if (conf->upstream.buffers_max
+        && conf->upstream.buffers_max < (ngx_uint_t) conf->upstream.bufs.num)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+             "\"proxy_buffers_max\" must be equal to or greater than "
+             "the number of \"proxy_buffers\"");
+
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_size_value(conf->upstream.buffers_budget,
+                              prev->upstream.buffers_budget,
+                              32 * 1024 * 1024);
+
 
     size = conf->upstream.buffer_size;
     if (size < conf->upstream.bufs.size) {
@@ -3259,6 +3674,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_uint_value(conf->http_version, prev->http_version,
                               NGX_HTTP_VERSION_10);
 
+    ngx_conf_merge_value(conf->chunked_passthrough,
+                              prev->chunked_passthrough, 0);
+
     ngx_conf_merge_uint_value(conf->headers_hash_max_size,
                               prev->headers_hash_max_size, 512);
 
@@ -76,6 +76,49 @@ static ngx_http_variable_t  ngx_http_stub_status_vars[] = {
     { ngx_string("connections_waiting"), NULL, ngx_http_stub_status_variable,
       3, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("sendfile_inline"), NULL, ngx_http_stub_status_variable,
+      11, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("sendfile_offloaded"), NULL, ngx_http_stub_status_variable,
+      12, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("bind_failed"), NULL, ngx_http_stub_status_variable,
+      13, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("bind_retried"), NULL, ngx_http_stub_status_variable,
+      14, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("pipe_memory"), NULL, ngx_http_stub_status_variable,
+      15, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("pipe_spilled"), NULL, ngx_http_stub_status_variable,
+      16, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+#if (NGX_HAVE_FILE_AIO)
+
+    { ngx_string("aio_submitted"), NULL, ngx_http_stub_status_variable,
+      4, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("aio_batches"), NULL, ngx_http_stub_status_variable,
+      5, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("aio_queued"), NULL, ngx_http_stub_status_variable,
+      6, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("aio_active"), NULL, ngx_http_stub_status_variable,
+      7, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("aio_completed"), NULL, ngx_http_stub_status_variable,
+      8, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("aio_submit_time"), NULL, ngx_http_stub_status_variable,
+      9, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("aio_complete_time"), NULL, ngx_http_stub_status_variable,
+      10, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+#endif
+
     { ngx_null_string, NULL, NULL, 0, 0, 0 }
 };
 
@@ -189,6 +232,62 @@ ngx_http_stub_status_variable(ngx_http_request_t *r,
         value = *ngx_stat_waiting;
         break;
 
+    case 11:
+        value = *ngx_stat_sendfile_inline;
+        break;
+
+    case 12:
+        value = *ngx_stat_sendfile_offloaded;
+        break;
+
+    case 13:
+        value = *ngx_stat_bind_failed;
+        break;
+
+    case 14:
+        value = *ngx_stat_bind_retried;
+        break;
+
+    case 15:
+        value = *ngx_stat_pipe_memory;
+        break;
+
+    case 16:
+        value = *ngx_stat_pipe_spilled;
+        break;
+
+#if (NGX_HAVE_FILE_AIO)
+
+    case 4:
+        value = *ngx_stat_aio_submitted;
+        break;
+
+    case 5:
+        value = *ngx_stat_aio_batches;
+        break;
+
+    case 6:
+        value = *ngx_stat_aio_queued;
+        break;
+
+    case 7:
+        value = *ngx_stat_aio_active;
+        break;
+
+    case 8:
+        value = *ngx_stat_aio_completed;
+        break;
+
+    case 9:
+        value = *ngx_stat_aio_submit_time;
+        break;
+
+    case 10:
+        value = *ngx_stat_aio_complete_time;
+        break;
+
+#endif
+
     /* suppress warning */
     default:
         value = 0;
@@ -25,9 +25,22 @@ typedef struct {
 typedef struct {
     ngx_http_complex_value_t            key;
     ngx_http_upstream_chash_points_t   *points;
+
+    /* the maglev lookup table, built per worker for the peers in use */
+    uint32_t                           *table;
+    ngx_uint_t                          size;
+    ngx_http_upstream_rr_peers_t       *peers;
 } ngx_http_upstream_hash_srv_conf_t;
 
 
+/*
+ * the size of the maglev lookup table is a prime, the same for any number
+ * of peers as resizing the table would move almost all keys
+ */
+
+#define NGX_HTTP_UPSTREAM_MAGLEV_SIZE  65521
+
+
 typedef struct {
     /* the round robin data must be first */
     ngx_http_upstream_rr_peer_data_t    rrp;
@@ -46,6 +59,8 @@ static ngx_int_t ngx_http_upstream_init_hash_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us);
 static ngx_int_t ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc,
     void *data);
+static ngx_uint_t ngx_http_upstream_hash_slow_start(
+    ngx_http_upstream_rr_peer_t *peer, uint32_t hash);
 
 static ngx_int_t ngx_http_upstream_init_chash(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us);
@@ -58,6 +73,18 @@ static ngx_int_t ngx_http_upstream_init_chash_peer(ngx_http_request_t *r,
 static ngx_int_t ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_http_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_update_maglev(
+    ngx_http_upstream_srv_conf_t *us, ngx_log_t *log);
+static ngx_int_t ngx_http_upstream_build_maglev(
+    ngx_http_upstream_srv_conf_t *us, ngx_http_upstream_hash_srv_conf_t *hcf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_log_t *log);
+static ngx_int_t ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc,
+    void *data);
+
 static void *ngx_http_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -185,6 +212,8 @@ ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
     pc->cached = 0;
     pc->connection = NULL;
 
+    ngx_http_upstream_rr_peers_lock(hp->rrp.peers);
+
     for ( ;; ) {
 
         /*
@@ -236,7 +265,7 @@ ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
 
         peer = &hp->rrp.peers->peer[p];
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             goto next;
         }
 
@@ -247,11 +276,20 @@ ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
             goto next;
         }
 
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            goto next;
+        }
+
+        if (ngx_http_upstream_hash_slow_start(peer, hp->hash)) {
+            goto next;
+        }
+
         break;
 
     next:
 
         if (++hp->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
             return hp->get_rr_peer(pc, &hp->rrp);
         }
     }
@@ -266,12 +304,37 @@ ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
         peer->checked = now;
     }
 
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
     hp->rrp.tried[n] |= m;
 
     return NGX_OK;
 }
 
 
+static ngx_uint_t
+ngx_http_upstream_hash_slow_start(ngx_http_upstream_rr_peer_t *peer,
+    uint32_t hash)
+{
+    ngx_uint_t  ramp;
+
+    ramp = ngx_http_upstream_rr_peer_ramp(peer);
+
+    if (ramp == 100) {
+        return 0;
+    }
+
+    /*
+     * a peer in slow start gets back its keys gradually,
+     * in the order given by their scrambled hash
+     */
+
+    return ((uint32_t) (hash * 2654435761U) >> 16) % 100 >= ramp;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_init_chash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
 {
@@ -471,6 +534,7 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 
     time_t                              now;
     intptr_t                            m;
+    uint32_t                            hash;
     ngx_str_t                          *server;
     ngx_int_t                           total;
     ngx_uint_t                          i, n;
@@ -491,8 +555,11 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     points = hcf->points;
     point = &points->point[0];
 
+    ngx_http_upstream_rr_peers_lock(hp->rrp.peers);
+
     for ( ;; ) {
         server = point[hp->hash % points->number].server;
+        hash = point[hp->hash % points->number].hash;
 
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                        "consistent hash peer:%uD, server:\"%V\"",
@@ -512,7 +579,7 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 
             peer = &hp->rrp.peers->peer[i];
 
-            if (peer->down) {
+            if (peer->down || peer->unhealthy) {
                 continue;
             }
 
@@ -530,6 +597,14 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
+            if (peer->max_conns && peer->conns >= peer->max_conns) {
+                continue;
+            }
+
+            if (ngx_http_upstream_hash_slow_start(peer, hash)) {
+                continue;
+            }
+
             peer->current_weight += peer->effective_weight;
             total += peer->effective_weight;
 
@@ -562,6 +637,10 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
             pc->socklen = best->socklen;
             pc->name = &best->name;
 
+            best->conns++;
+
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
             return NGX_OK;
         }
 
@@ -569,12 +648,300 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
         hp->tries++;
 
         if (hp->tries >= points->number) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
             return NGX_BUSY;
         }
     }
 }
 
 
+static ngx_int_t
+ngx_http_upstream_init_maglev(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_maglev_peer;
+    us->peer.update = ngx_http_upstream_update_maglev;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_hash_peer_data_t  *hp;
+
+    if (ngx_http_upstream_init_hash_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hp = r->upstream->peer.data;
+
+    if (hp->rrp.peers->number == 0) {
+        r->upstream->peer.get = ngx_http_upstream_get_round_robin_peer;
+        return NGX_OK;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_maglev_peer;
+
+    hp->hash = ngx_crc32_long(hp->key.data, hp->key.len);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_update_maglev(ngx_http_upstream_srv_conf_t *us,
+    ngx_log_t *log)
+{
+    ngx_int_t                           rc;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    /*
+     * the table is built when a worker process starts and once
+     * the servers were re-resolved, not while handling requests
+     */
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+
+    peers = ngx_http_upstream_rr_peers_acquire(us);
+
+    if (peers == hcf->peers || peers->number == 0) {
+        ngx_http_upstream_rr_peers_release(us, peers);
+        return NGX_OK;
+    }
+
+    rc = ngx_http_upstream_build_maglev(us, hcf, peers, log);
+
+    ngx_http_upstream_rr_peers_release(us, peers);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_build_maglev(ngx_http_upstream_srv_conf_t *us,
+    ngx_http_upstream_hash_srv_conf_t *hcf, ngx_http_upstream_rr_peers_t *peers,
+    ngx_log_t *log)
+{
+    uint32_t                     *table;
+    ngx_uint_t                    i, n, c, size, filled, max_weight;
+    ngx_uint_t                   *offset, *skip, *next, *credit;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    n = peers->number;
+    size = NGX_HTTP_UPSTREAM_MAGLEV_SIZE;
+
+    table = ngx_alloc(size * sizeof(uint32_t), log);
+    if (table == NULL) {
+        return NGX_ERROR;
+    }
+
+    offset = ngx_alloc(4 * n * sizeof(ngx_uint_t), log);
+    if (offset == NULL) {
+        ngx_free(table);
+        return NGX_ERROR;
+    }
+
+    skip = offset + n;
+    next = skip + n;
+    credit = next + n;
+
+    /*
+     * each peer prefers the entries in the order of its own permutation,
+     * derived from its address, so that a change of the peers moves only
+     * the entries of the peers changed
+     */
+
+    max_weight = 0;
+
+    for (i = 0; i < n; i++) {
+        peer = &peers->peer[i];
+
+        offset[i] = ngx_crc32_long(peer->name.data, peer->name.len) % size;
+        skip[i] = ngx_murmur_hash2(peer->name.data, peer->name.len)
+                  % (size - 1) + 1;
+        next[i] = 0;
+        credit[i] = 0;
+
+        if ((ngx_uint_t) peer->weight > max_weight) {
+            max_weight = peer->weight;
+        }
+    }
+
+    for (c = 0; c < size; c++) {
+        table[c] = (uint32_t) -1;
+    }
+
+    /* the peers take turns, each one as often as its weight allows */
+
+    filled = 0;
+
+    for ( ;; ) {
+
+        for (i = 0; i < n; i++) {
+
+            credit[i] += peers->peer[i].weight;
+
+            if (credit[i] < max_weight) {
+                continue;
+            }
+
+            credit[i] -= max_weight;
+
+            do {
+                c = (offset[i] + next[i] * skip[i]) % size;
+                next[i]++;
+            } while (table[c] != (uint32_t) -1);
+
+            table[c] = i;
+
+            if (++filled == size) {
+                goto done;
+            }
+        }
+    }
+
+done:
+
+    ngx_free(offset);
+
+    if (hcf->table) {
+        ngx_free(hcf->table);
+    }
+
+    /* the peers are kept while the table refers to them */
+
+    if (hcf->peers) {
+        ngx_http_upstream_rr_peers_release(us, hcf->peers);
+    }
+
+    if (peers != us->peer.data) {
+        (void) ngx_atomic_fetch_add(&peers->refs, 1);
+    }
+
+    hcf->table = table;
+    hcf->size = size;
+    hcf->peers = peers;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "upstream maglev table: %ui entries, %ui peers", size, n);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_hash_peer_data_t  *hp = data;
+
+    time_t                              now;
+    uintptr_t                           m;
+    ngx_uint_t                          n, p;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get maglev peer, try: %ui", pc->tries);
+
+    hcf = hp->conf;
+
+    if (hp->tries > 20 || hp->rrp.peers->single) {
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    /*
+     * the table is rebuilt for the re-resolved servers after the request
+     * started, or not yet in this worker process, and is never built
+     * for the backup ones
+     */
+
+    if (hcf->peers != hp->rrp.peers) {
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    now = ngx_time();
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    ngx_http_upstream_rr_peers_lock(hp->rrp.peers);
+
+    for ( ;; ) {
+
+        p = hcf->table[hp->hash % hcf->size];
+
+        n = p / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get maglev peer, value:%uD, peer:%ui", hp->hash, p);
+
+        if (hp->rrp.tried[n] & m) {
+            goto next;
+        }
+
+        peer = &hp->rrp.peers->peer[p];
+
+        if (peer->down || peer->unhealthy) {
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            goto next;
+        }
+
+        if (ngx_http_upstream_hash_slow_start(peer, hp->hash)) {
+            goto next;
+        }
+
+        break;
+
+    next:
+
+        /* another entry of the table is looked up instead of a walk */
+
+        hp->hash = hp->hash * 1103515245 + 12345;
+
+        if (++hp->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    hp->rrp.current = p;
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -586,6 +953,9 @@ ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->table = NULL;
+    conf->size = 0;
+    conf->peers = NULL;
 
     return conf;
 }
@@ -623,14 +993,21 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                   |NGX_HTTP_UPSTREAM_WEIGHT
                   |NGX_HTTP_UPSTREAM_MAX_FAILS
                   |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
-                  |NGX_HTTP_UPSTREAM_DOWN;
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_SLOW_START
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS;
 
     if (cf->args->nelts == 2) {
         uscf->peer.init_upstream = ngx_http_upstream_init_hash;
 
-    } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
+    } else if (ngx_strcmp(value[2].data, "consistent") == 0
+               || ngx_strcmp(value[2].data, "consistent=ketama") == 0)
+    {
         uscf->peer.init_upstream = ngx_http_upstream_init_chash;
 
+    } else if (ngx_strcmp(value[2].data, "consistent=maglev") == 0) {
+        uscf->peer.init_upstream = ngx_http_upstream_init_maglev;
+
     } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
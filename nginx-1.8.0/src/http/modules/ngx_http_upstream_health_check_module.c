@@ -0,0 +1,964 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_HC_BUFFER  4096
+
+
+typedef struct {
+    ngx_uint_t                         from;
+    ngx_uint_t                         to;
+} ngx_http_upstream_hc_status_t;
+
+
+typedef struct {
+    ngx_msec_t                         interval;
+    ngx_msec_t                         timeout;
+    ngx_uint_t                         fails;
+    ngx_uint_t                         passes;
+    in_port_t                          port;
+
+    ngx_array_t                       *status;
+    ngx_str_t                          body;
+
+    ngx_str_t                          request;
+} ngx_http_upstream_hc_srv_conf_t;
+
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_http_upstream_hc_srv_conf_t   *conf;
+    ngx_event_t                        event;
+} ngx_http_upstream_hc_t;
+
+
+typedef struct {
+    ngx_http_upstream_hc_t            *hc;
+
+    /* the peers acquired, and the primary or backup ones probed */
+    ngx_http_upstream_rr_peers_t      *acquired;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_uint_t                         index;
+
+    ngx_pool_t                        *pool;
+    ngx_log_t                         *log;
+    ngx_peer_connection_t              peer;
+
+    size_t                             sent;
+    ngx_buf_t                         *response;
+    u_char                            *body;
+    ngx_uint_t                         status;
+
+    unsigned                           done:1;
+} ngx_http_upstream_hc_probe_t;
+
+
+static void ngx_http_upstream_hc_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hc_probe(ngx_http_upstream_hc_t *hc,
+    ngx_http_upstream_rr_peers_t *acquired, ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t index);
+static void ngx_http_upstream_hc_write_handler(ngx_event_t *wev);
+static void ngx_http_upstream_hc_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_hc_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_hc_process(
+    ngx_http_upstream_hc_probe_t *probe);
+static void ngx_http_upstream_hc_done(ngx_http_upstream_hc_probe_t *probe,
+    ngx_uint_t passed);
+
+static void *ngx_http_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_health_check(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_upstream_hc_parse_status(ngx_conf_t *cf,
+    ngx_http_upstream_hc_srv_conf_t *hcf, ngx_str_t *value);
+static ngx_int_t ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_health_check_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_health_check,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_health_check_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_hc_postconfiguration, /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_hc_create_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_health_check_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_health_check_module_ctx, /* module context */
+    ngx_http_upstream_health_check_commands,    /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_hc_init_process,     /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_http_upstream_hc_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_hc_t           *hc;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *acquired, *peers;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    hc = ev->data;
+    hcf = hc->conf;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "upstream health check \"%V\"", &hc->upstream->host);
+
+    acquired = ngx_http_upstream_rr_peers_acquire(hc->upstream);
+
+    for (peers = acquired; peers; peers = peers->next) {
+
+        for (i = 0; i < peers->number; i++) {
+            peer = &peers->peer[i];
+
+            /*
+             * the peers are in a shared zone, the worker whose timer
+             * fires first probes the peer for all of them
+             */
+
+            ngx_http_upstream_rr_peers_lock(peers);
+
+            if (peer->down
+                || (peer->hc_checked
+                    && (ngx_msec_int_t) (ngx_current_msec - peer->hc_checked)
+                       < (ngx_msec_int_t) hcf->interval))
+            {
+                ngx_http_upstream_rr_peers_unlock(peers);
+                continue;
+            }
+
+            peer->hc_checked = ngx_current_msec;
+
+            ngx_http_upstream_rr_peers_unlock(peers);
+
+            ngx_http_upstream_hc_probe(hc, acquired, peers, i);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_release(hc->upstream, acquired);
+
+    ngx_add_timer(ev, hcf->interval);
+}
+
+
+static void
+ngx_http_upstream_hc_probe(ngx_http_upstream_hc_t *hc,
+    ngx_http_upstream_rr_peers_t *acquired, ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t index)
+{
+    ngx_int_t                      rc;
+    ngx_pool_t                    *pool;
+    struct sockaddr               *sockaddr;
+    ngx_connection_t              *c;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_hc_probe_t  *probe;
+
+    peer = &peers->peer[index];
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, hc->event.log, 0,
+                   "upstream health check peer %V", &peer->name);
+
+    pool = ngx_create_pool(1024, hc->event.log);
+    if (pool == NULL) {
+        return;
+    }
+
+    probe = ngx_pcalloc(pool, sizeof(ngx_http_upstream_hc_probe_t));
+    if (probe == NULL) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    sockaddr = ngx_palloc(pool, peer->socklen);
+    if (sockaddr == NULL) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    ngx_memcpy(sockaddr, peer->sockaddr, peer->socklen);
+
+    if (hc->conf->port) {
+        switch (sockaddr->sa_family) {
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            ((struct sockaddr_in6 *) sockaddr)->sin6_port =
+                                                      htons(hc->conf->port);
+            break;
+#endif
+        default: /* AF_INET */
+            ((struct sockaddr_in *) sockaddr)->sin_port = htons(hc->conf->port);
+        }
+    }
+
+    /* the peers are kept until the probe is finished */
+
+    if (acquired != hc->upstream->peer.data) {
+        (void) ngx_atomic_fetch_add(&acquired->refs, 1);
+    }
+
+    probe->hc = hc;
+    probe->acquired = acquired;
+    probe->peers = peers;
+    probe->index = index;
+    probe->pool = pool;
+    probe->log = hc->event.log;
+
+    probe->peer.sockaddr = sockaddr;
+    probe->peer.socklen = peer->socklen;
+    probe->peer.name = &peer->name;
+    probe->peer.get = ngx_event_get_peer;
+    probe->peer.log = probe->log;
+    probe->peer.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&probe->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_hc_done(probe, 0);
+        return;
+    }
+
+    c = probe->peer.connection;
+
+    c->data = probe;
+    c->pool = pool;
+
+    c->read->handler = ngx_http_upstream_hc_read_handler;
+    c->write->handler = ngx_http_upstream_hc_write_handler;
+
+    ngx_add_timer(c->read, hc->conf->timeout);
+    ngx_add_timer(c->write, hc->conf->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_hc_write_handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_write_handler(ngx_event_t *wev)
+{
+    ssize_t                        n, size;
+    ngx_str_t                     *request;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_probe_t  *probe;
+
+    c = wev->data;
+    probe = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "upstream health check write handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, wev->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", probe->peer.name);
+        ngx_http_upstream_hc_done(probe, 0);
+        return;
+    }
+
+    request = &probe->hc->conf->request;
+
+    size = request->len - probe->sent;
+
+    n = ngx_send(c, request->data + probe->sent, size);
+
+    if (n == NGX_ERROR) {
+        ngx_http_upstream_hc_done(probe, 0);
+        return;
+    }
+
+    if (n > 0) {
+        probe->sent += n;
+
+        if (n == size) {
+            wev->handler = ngx_http_upstream_hc_dummy_handler;
+
+            if (wev->timer_set) {
+                ngx_del_timer(wev);
+            }
+
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_done(probe, 0);
+            }
+
+            return;
+        }
+    }
+
+    if (!wev->timer_set) {
+        ngx_add_timer(wev, probe->hc->conf->timeout);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_read_handler(ngx_event_t *rev)
+{
+    ssize_t                        n, size;
+    ngx_int_t                      rc;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_probe_t  *probe;
+
+    c = rev->data;
+    probe = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, rev->log, 0,
+                   "upstream health check read handler");
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, rev->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", probe->peer.name);
+        ngx_http_upstream_hc_done(probe, 0);
+        return;
+    }
+
+    if (probe->response == NULL) {
+        probe->response = ngx_create_temp_buf(probe->pool,
+                                              NGX_HTTP_UPSTREAM_HC_BUFFER);
+        if (probe->response == NULL) {
+            ngx_http_upstream_hc_done(probe, 0);
+            return;
+        }
+    }
+
+    for ( ;; ) {
+
+        size = probe->response->end - probe->response->last;
+
+        if (size == 0) {
+            break;
+        }
+
+        n = ngx_recv(c, probe->response->last, size);
+
+        if (n > 0) {
+            probe->response->last += n;
+
+            rc = ngx_http_upstream_hc_process(probe);
+
+            if (rc != NGX_AGAIN) {
+                ngx_http_upstream_hc_done(probe, rc == NGX_OK);
+                return;
+            }
+
+            continue;
+        }
+
+        if (n == NGX_AGAIN) {
+
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_done(probe, 0);
+            }
+
+            return;
+        }
+
+        break;
+    }
+
+    /* the response is over, or does not fit into the buffer */
+
+    probe->done = 1;
+
+    rc = ngx_http_upstream_hc_process(probe);
+
+    ngx_http_upstream_hc_done(probe, rc == NGX_OK);
+}
+
+
+static void
+ngx_http_upstream_hc_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "upstream health check dummy handler");
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_process(ngx_http_upstream_hc_probe_t *probe)
+{
+    u_char                           *p;
+    ngx_buf_t                        *b;
+    ngx_int_t                         status;
+    ngx_uint_t                        i;
+    ngx_http_upstream_hc_status_t    *range;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    b = probe->response;
+    hcf = probe->hc->conf;
+
+    if (probe->status == 0) {
+
+        /* "HTTP/1.x 200 ..." */
+
+        p = ngx_strlchr(b->pos, b->last, LF);
+
+        if (p == NULL) {
+            if (probe->done || b->last == b->end) {
+                goto invalid;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        if (p - b->pos < 12
+            || ngx_strncmp(b->pos, "HTTP/1.", sizeof("HTTP/1.") - 1) != 0
+            || b->pos[8] != ' ')
+        {
+            goto invalid;
+        }
+
+        status = ngx_atoi(&b->pos[9], 3);
+
+        if (status == NGX_ERROR) {
+            goto invalid;
+        }
+
+        probe->status = status;
+        b->pos = p + 1;
+
+        range = hcf->status->elts;
+
+        for (i = 0; i < hcf->status->nelts; i++) {
+            if (probe->status >= range[i].from && probe->status <= range[i].to) {
+                break;
+            }
+        }
+
+        if (i == hcf->status->nelts) {
+            ngx_log_error(NGX_LOG_ERR, probe->log, 0,
+                          "health check of %V returned status %ui",
+                          probe->peer.name, probe->status);
+            return NGX_DECLINED;
+        }
+    }
+
+    if (hcf->body.len == 0) {
+        return NGX_OK;
+    }
+
+    if (probe->body == NULL) {
+        p = ngx_strnstr(b->pos, CRLF CRLF, b->last - b->pos);
+
+        if (p == NULL) {
+            if (probe->done || b->last == b->end) {
+                goto invalid;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        probe->body = p + sizeof(CRLF CRLF) - 1;
+    }
+
+    if (ngx_strnstr(probe->body, (char *) hcf->body.data,
+                    b->last - probe->body))
+    {
+        return NGX_OK;
+    }
+
+    if (probe->done || b->last == b->end) {
+        ngx_log_error(NGX_LOG_ERR, probe->log, 0,
+                      "health check of %V returned body not matching \"%V\"",
+                      probe->peer.name, &hcf->body);
+        return NGX_DECLINED;
+    }
+
+    return NGX_AGAIN;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, probe->log, 0,
+                  "health check of %V returned invalid response",
+                  probe->peer.name);
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_upstream_hc_done(ngx_http_upstream_hc_probe_t *probe,
+    ngx_uint_t passed)
+{
+    ngx_uint_t                        changed;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, probe->log, 0,
+                   "upstream health check of %V done: %ui",
+                   probe->peer.name, passed);
+
+    if (probe->peer.connection) {
+        ngx_close_connection(probe->peer.connection);
+        probe->peer.connection = NULL;
+    }
+
+    hcf = probe->hc->conf;
+    peer = &probe->peers->peer[probe->index];
+    changed = 0;
+
+    ngx_http_upstream_rr_peers_lock(probe->peers);
+
+    if (passed) {
+        peer->hc_fails = 0;
+
+        if (peer->unhealthy && ++peer->hc_passes >= hcf->passes) {
+            peer->unhealthy = 0;
+            peer->hc_passes = 0;
+
+            /*
+             * the passive failures are forgotten, and the weight
+             * is brought back gradually as after a failed request,
+             * or over the slow start time if one is set
+             */
+
+            peer->fails = 0;
+            peer->effective_weight = 1;
+
+            ngx_http_upstream_rr_peer_slow_start(peer);
+
+            changed = 1;
+        }
+
+    } else {
+        peer->hc_passes = 0;
+
+        if (!peer->unhealthy && ++peer->hc_fails >= hcf->fails) {
+            peer->unhealthy = 1;
+            peer->hc_fails = 0;
+
+            changed = 1;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(probe->peers);
+
+    if (changed && passed && peer->slow_start) {
+        ngx_log_error(NGX_LOG_NOTICE, probe->log, 0,
+                      "peer %V in upstream \"%V\" is healthy, "
+                      "slow start %Mms",
+                      probe->peer.name, &probe->hc->upstream->host,
+                      peer->slow_start);
+
+    } else if (changed && passed) {
+        ngx_log_error(NGX_LOG_NOTICE, probe->log, 0,
+                      "peer %V in upstream \"%V\" is healthy",
+                      probe->peer.name, &probe->hc->upstream->host);
+
+    } else if (changed) {
+        ngx_log_error(NGX_LOG_WARN, probe->log, 0,
+                      "peer %V in upstream \"%V\" is unhealthy",
+                      probe->peer.name, &probe->hc->upstream->host);
+    }
+
+    ngx_http_upstream_rr_peers_release(probe->hc->upstream, probe->acquired);
+
+    ngx_destroy_pool(probe->pool);
+}
+
+
+static void *
+ngx_http_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->interval = 0;
+     *     conf->status = NULL;
+     *     conf->body = { 0, NULL };
+     *     conf->request = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_health_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *hcf = conf;
+
+    u_char                         *p;
+    ngx_int_t                       n;
+    ngx_str_t                      *value, s, uri;
+    ngx_uint_t                      i;
+    ngx_http_upstream_hc_status_t  *range;
+    ngx_http_upstream_srv_conf_t   *uscf;
+
+    if (hcf->interval) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    hcf->interval = 5000;
+    hcf->timeout = 1000;
+    hcf->fails = 1;
+    hcf->passes = 1;
+
+    ngx_str_set(&uri, "/");
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR
+                || hcf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "port=", 5) == 0) {
+
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+            if (n == NGX_ERROR || n < 1 || n > 65535) {
+                goto invalid;
+            }
+
+            hcf->port = (in_port_t) n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+
+            uri.len = value[i].len - 4;
+            uri.data = &value[i].data[4];
+
+            if (uri.len == 0 || uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = &value[i].data[7];
+
+            if (ngx_http_upstream_hc_parse_status(cf, hcf, &s)
+                != NGX_CONF_OK)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "body=", 5) == 0) {
+
+            hcf->body.len = value[i].len - 5;
+            hcf->body.data = &value[i].data[5];
+
+            if (hcf->body.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (hcf->status == NULL) {
+
+        /* 2xx and 3xx responses pass by default */
+
+        hcf->status = ngx_array_create(cf->pool, 1,
+                                       sizeof(ngx_http_upstream_hc_status_t));
+        if (hcf->status == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        range = ngx_array_push(hcf->status);
+        if (range == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        range->from = 200;
+        range->to = 399;
+    }
+
+    hcf->request.len = sizeof("GET  HTTP/1.0" CRLF) - 1 + uri.len
+                       + sizeof("Host: " CRLF) - 1 + uscf->host.len
+                       + sizeof("Connection: close" CRLF CRLF) - 1;
+
+    p = ngx_pnalloc(cf->pool, hcf->request.len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    hcf->request.data = p;
+
+    ngx_sprintf(p, "GET %V HTTP/1.0" CRLF
+                   "Host: %V" CRLF
+                   "Connection: close" CRLF CRLF,
+                &uri, &uscf->host);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_hc_parse_status(ngx_conf_t *cf,
+    ngx_http_upstream_hc_srv_conf_t *hcf, ngx_str_t *value)
+{
+    u_char                         *p, *last, *dash, *comma;
+    ngx_int_t                       from, to;
+    ngx_http_upstream_hc_status_t  *range;
+
+    /* "200", "200-399", or a list of them separated by commas */
+
+    if (hcf->status == NULL) {
+        hcf->status = ngx_array_create(cf->pool, 2,
+                                       sizeof(ngx_http_upstream_hc_status_t));
+        if (hcf->status == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    p = value->data;
+    last = value->data + value->len;
+
+    while (p < last) {
+
+        comma = ngx_strlchr(p, last, ',');
+        if (comma == NULL) {
+            comma = last;
+        }
+
+        dash = ngx_strlchr(p, comma, '-');
+
+        if (dash) {
+            from = ngx_atoi(p, dash - p);
+            to = ngx_atoi(dash + 1, comma - dash - 1);
+
+        } else {
+            from = ngx_atoi(p, comma - p);
+            to = from;
+        }
+
+        if (from < 100 || to > 599 || from > to) {
+            return NGX_CONF_ERROR;
+        }
+
+        range = ngx_array_push(hcf->status);
+        if (range == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        range->from = from;
+        range->to = to;
+
+        p = comma + 1;
+    }
+
+    if (hcf->status->nelts == 0) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                        ngx_http_upstream_health_check_module);
+
+        /*
+         * without a shared zone each worker would probe the peers
+         * and keep its own idea of their health
+         */
+
+        if (hcf->interval && uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires a shared memory zone "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_hc_t           *hc;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        /* implicitly defined upstreams have no configuration */
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                        ngx_http_upstream_health_check_module);
+
+        if (hcf->interval == 0) {
+            continue;
+        }
+
+        hc = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_hc_t));
+        if (hc == NULL) {
+            return NGX_ERROR;
+        }
+
+        hc->upstream = uscfp[i];
+        hc->conf = hcf;
+
+        hc->event.handler = ngx_http_upstream_hc_handler;
+        hc->event.data = hc;
+        hc->event.log = cycle->log;
+        hc->event.cancelable = 1;
+
+        /* the workers start probing at different times */
+
+        ngx_add_timer(&hc->event, ngx_random() % hcf->interval + 1);
+    }
+
+    return NGX_OK;
+}
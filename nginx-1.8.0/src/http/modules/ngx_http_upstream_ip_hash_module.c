@@ -206,9 +206,9 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
 
         peer = &iphp->rrp.peers->peer[p];
 
-        /* ngx_lock_mutex(iphp->rrp.peers->mutex); */
+        ngx_http_upstream_rr_peers_lock(iphp->rrp.peers);
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             goto next_try;
         }
 
@@ -219,13 +219,20 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
             goto next_try;
         }
 
+        /* a busy peer is not counted as tried */
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            ngx_http_upstream_rr_peers_unlock(iphp->rrp.peers);
+            goto next;
+        }
+
         break;
 
     next_try:
 
         iphp->rrp.tried[n] |= m;
 
-        /* ngx_unlock_mutex(iphp->rrp.peers->mutex); */
+        ngx_http_upstream_rr_peers_unlock(iphp->rrp.peers);
 
         pc->tries--;
 
@@ -246,7 +253,9 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
         peer->checked = now;
     }
 
-    /* ngx_unlock_mutex(iphp->rrp.peers->mutex); */
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(iphp->rrp.peers);
 
     iphp->rrp.tried[n] |= m;
     iphp->hash = hash;
@@ -273,7 +282,8 @@ ngx_http_upstream_ip_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                   |NGX_HTTP_UPSTREAM_WEIGHT
                   |NGX_HTTP_UPSTREAM_MAX_FAILS
                   |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
-                  |NGX_HTTP_UPSTREAM_DOWN;
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS;
 
     return NGX_CONF_OK;
 }
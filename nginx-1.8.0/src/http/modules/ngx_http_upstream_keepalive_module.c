@@ -12,9 +12,18 @@
 
 typedef struct {
     ngx_uint_t                         max_cached;
+    ngx_uint_t                         max_peer;
+    ngx_uint_t                         prewarm;
+    ngx_uint_t                         requests;
+    ngx_msec_t                         timeout;
 
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
+    ngx_queue_t                        pools;
+    ngx_uint_t                         npools;
+
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_event_t                        warm;
 
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
@@ -40,18 +49,40 @@ typedef struct {
 } ngx_http_upstream_keepalive_peer_data_t;
 
 
+typedef struct {
+    ngx_queue_t                        queue;
+    ngx_queue_t                        cache;
+
+    ngx_uint_t                         cached;
+    ngx_uint_t                         connecting;
+    ngx_msec_t                         backoff;
+    unsigned                           warm:1;
+
+    ngx_str_t                          name;
+    socklen_t                          socklen;
+    u_char                             sockaddr[NGX_SOCKADDRLEN];
+
+} ngx_http_upstream_keepalive_pool_t;
+
+
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
+    ngx_http_upstream_keepalive_pool_t      *pool;
 
     ngx_queue_t                        queue;
+    ngx_queue_t                        pool_queue;
     ngx_connection_t                  *connection;
 
-    socklen_t                          socklen;
-    u_char                             sockaddr[NGX_SOCKADDRLEN];
+    ngx_msec_t                         idle;
 
 } ngx_http_upstream_keepalive_cache_t;
 
 
+/* connect timeout of the pre-warming connections */
+
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_CONNECT  5000
+
+
 static ngx_int_t ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us);
 static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
@@ -62,6 +93,21 @@ static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_drop(
+    ngx_http_upstream_keepalive_cache_t *item);
+
+static ngx_http_upstream_keepalive_pool_t *ngx_http_upstream_keepalive_pool(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, struct sockaddr *sockaddr,
+    socklen_t socklen, ngx_str_t *name, ngx_log_t *log);
+static void ngx_http_upstream_keepalive_free_pool(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_keepalive_pool_t *pool);
+
+static void ngx_http_upstream_keepalive_warm_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_keepalive_connect(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_keepalive_pool_t *pool);
+static void ngx_http_upstream_keepalive_connect_handler(ngx_event_t *wev);
 
 
 #if (NGX_HTTP_SSL)
@@ -71,6 +117,7 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -85,6 +132,34 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       0,
       NULL },
 
+    { ngx_string("keepalive_timeout"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, timeout),
+      NULL },
+
+    { ngx_string("keepalive_requests"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
+      NULL },
+
+    { ngx_string("keepalive_per_peer"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, max_peer),
+      NULL },
+
+    { ngx_string("keepalive_prewarm"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, prewarm),
+      NULL },
+
       ngx_null_command
 };
 
@@ -111,7 +186,7 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -142,6 +217,31 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     us->peer.init = ngx_http_upstream_init_keepalive_peer;
 
+    ngx_conf_init_msec_value(kcf->timeout, 60000);
+    ngx_conf_init_uint_value(kcf->requests, 100);
+    ngx_conf_init_uint_value(kcf->max_peer, 0);
+    ngx_conf_init_uint_value(kcf->prewarm, 0);
+
+    if (kcf->prewarm > kcf->max_cached) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"keepalive_prewarm\" %ui is more than "
+                           "\"keepalive\" %ui, only %ui connections "
+                           "are pre-warmed", kcf->prewarm, kcf->max_cached,
+                           kcf->max_cached);
+    }
+
+    if (kcf->max_peer && kcf->prewarm > kcf->max_peer) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"keepalive_prewarm\" %ui is more than "
+                           "\"keepalive_per_peer\" %ui, only %ui "
+                           "connections per peer are pre-warmed",
+                           kcf->prewarm, kcf->max_peer, kcf->max_peer);
+
+        kcf->prewarm = kcf->max_peer;
+    }
+
+    kcf->upstream = us;
+
     /* allocate cache items and add to free queue */
 
     cached = ngx_pcalloc(cf->pool,
@@ -152,6 +252,7 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     ngx_queue_init(&kcf->cache);
     ngx_queue_init(&kcf->free);
+    ngx_queue_init(&kcf->pools);
 
     for (i = 0; i < kcf->max_cached; i++) {
         ngx_queue_insert_head(&kcf->free, &cached[i].queue);
@@ -211,9 +312,10 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_int_t          rc;
-    ngx_queue_t       *q, *cache;
-    ngx_connection_t  *c;
+    ngx_int_t                            rc;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_keepalive_pool_t  *pool;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer");
@@ -226,42 +328,46 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         return rc;
     }
 
-    /* search cache for suitable connection */
+    /* search the peer pool for suitable connection */
 
-    cache = &kp->conf->cache;
+    pool = ngx_http_upstream_keepalive_pool(kp->conf, pc->sockaddr,
+                                            pc->socklen, NULL, pc->log);
 
-    for (q = ngx_queue_head(cache);
-         q != ngx_queue_sentinel(cache);
-         q = ngx_queue_next(q))
-    {
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
-        c = item->connection;
+    if (pool == NULL || ngx_queue_empty(&pool->cache)) {
+        return NGX_OK;
+    }
 
-        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
-                         item->socklen, pc->socklen)
-            == 0)
-        {
-            ngx_queue_remove(q);
-            ngx_queue_insert_head(&kp->conf->free, q);
+    q = ngx_queue_head(&pool->cache);
+    ngx_queue_remove(q);
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                           "get keepalive peer: using connection %p", c);
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, pool_queue);
+    c = item->connection;
 
-            c->idle = 0;
-            c->sent = 0;
-            c->log = pc->log;
-            c->read->log = pc->log;
-            c->write->log = pc->log;
-            c->pool->log = pc->log;
+    pool->cached--;
 
-            pc->connection = c;
-            pc->cached = 1;
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&kp->conf->free, &item->queue);
 
-            return NGX_DONE;
-        }
+    ngx_http_upstream_keepalive_free_pool(kp->conf, pool);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get keepalive peer: using connection %p", c);
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
     }
 
-    return NGX_OK;
+    c->idle = 0;
+    c->sent = 0;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+    c->pool->log = pc->log;
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    return NGX_DONE;
 }
 
 
@@ -272,13 +378,17 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_queue_t          *q;
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
+    ngx_queue_t                             *q;
+    ngx_connection_t                        *c;
+    ngx_http_upstream_t                     *u;
+    ngx_http_upstream_keepalive_pool_t      *pool;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer");
 
+    kcf = kp->conf;
+
     /* cache valid connections */
 
     u = kp->upstream;
@@ -299,31 +409,57 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+    if (c->requests >= kcf->requests) {
+        goto invalid;
+    }
+
     if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
         goto invalid;
     }
 
+    pool = ngx_http_upstream_keepalive_pool(kcf, pc->sockaddr, pc->socklen,
+                                            pc->name, pc->log);
+    if (pool == NULL) {
+        goto invalid;
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    if (kcf->max_peer && pool->cached >= kcf->max_peer) {
 
-        q = ngx_queue_last(&kp->conf->cache);
-        ngx_queue_remove(q);
+        /* the oldest connection of the peer gives way */
 
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+        q = ngx_queue_last(&pool->cache);
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t,
+                              pool_queue);
 
-        ngx_http_upstream_keepalive_close(item->connection);
+        ngx_http_upstream_keepalive_drop(item);
 
-    } else {
-        q = ngx_queue_head(&kp->conf->free);
-        ngx_queue_remove(q);
+    } else if (ngx_queue_empty(&kcf->free)) {
 
+        q = ngx_queue_last(&kcf->cache);
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        ngx_http_upstream_keepalive_drop(item);
+
+        if (item->pool != pool) {
+            ngx_http_upstream_keepalive_free_pool(kcf, item->pool);
+        }
     }
 
+    q = ngx_queue_head(&kcf->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
     item->connection = c;
-    ngx_queue_insert_head(&kp->conf->cache, q);
+    item->pool = pool;
+    item->idle = ngx_current_msec;
+
+    ngx_queue_insert_head(&kcf->cache, &item->queue);
+    ngx_queue_insert_head(&pool->cache, &item->pool_queue);
+    pool->cached++;
 
     pc->connection = NULL;
 
@@ -344,8 +480,7 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+    ngx_add_timer(c->read, kcf->timeout);
 
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
@@ -368,19 +503,19 @@ ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
 static void
 ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 {
-    ngx_http_upstream_keepalive_srv_conf_t  *conf;
-    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_cache_t  *item;
 
-    int                n;
-    char               buf[1];
-    ngx_connection_t  *c;
+    int                                  n;
+    char                                 buf[1];
+    ngx_connection_t                    *c;
+    ngx_http_upstream_keepalive_pool_t  *pool;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
                    "keepalive close handler");
 
     c = ev->data;
 
-    if (c->close) {
+    if (c->close || ev->timedout) {
         goto close;
     }
 
@@ -399,12 +534,10 @@ ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 close:
 
     item = c->data;
-    conf = item->conf;
+    pool = item->pool;
 
-    ngx_http_upstream_keepalive_close(c);
-
-    ngx_queue_remove(&item->queue);
-    ngx_queue_insert_head(&conf->free, &item->queue);
+    ngx_http_upstream_keepalive_drop(item);
+    ngx_http_upstream_keepalive_free_pool(item->conf, pool);
 }
 
 
@@ -431,6 +564,381 @@ ngx_http_upstream_keepalive_close(ngx_connection_t *c)
 }
 
 
+static void
+ngx_http_upstream_keepalive_drop(ngx_http_upstream_keepalive_cache_t *item)
+{
+    ngx_queue_remove(&item->pool_queue);
+    item->pool->cached--;
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&item->conf->free, &item->queue);
+
+    ngx_http_upstream_keepalive_close(item->connection);
+}
+
+
+static ngx_http_upstream_keepalive_pool_t *
+ngx_http_upstream_keepalive_pool(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_str_t *name,
+    ngx_log_t *log)
+{
+    ngx_queue_t                         *q;
+    ngx_http_upstream_keepalive_pool_t  *pool;
+
+    for (q = ngx_queue_head(&kcf->pools);
+         q != ngx_queue_sentinel(&kcf->pools);
+         q = ngx_queue_next(q))
+    {
+        pool = ngx_queue_data(q, ngx_http_upstream_keepalive_pool_t, queue);
+
+        if (ngx_memn2cmp(pool->sockaddr, (u_char *) sockaddr,
+                         pool->socklen, socklen)
+            == 0)
+        {
+            return pool;
+        }
+    }
+
+    if (name == NULL) {
+        return NULL;
+    }
+
+    pool = ngx_alloc(sizeof(ngx_http_upstream_keepalive_pool_t) + name->len,
+                     log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    ngx_queue_init(&pool->cache);
+
+    pool->cached = 0;
+    pool->connecting = 0;
+    pool->backoff = 0;
+    pool->warm = 0;
+
+    pool->name.len = name->len;
+    pool->name.data = (u_char *) pool
+                      + sizeof(ngx_http_upstream_keepalive_pool_t);
+    ngx_memcpy(pool->name.data, name->data, name->len);
+
+    pool->socklen = socklen;
+    ngx_memcpy(pool->sockaddr, sockaddr, socklen);
+
+    ngx_queue_insert_tail(&kcf->pools, &pool->queue);
+    kcf->npools++;
+
+    return pool;
+}
+
+
+static void
+ngx_http_upstream_keepalive_free_pool(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_keepalive_pool_t *pool)
+{
+    /*
+     * empty pools are kept for reuse, unless there are more of them
+     * than connections they could hold
+     */
+
+    if (pool->cached || pool->connecting || pool->warm
+        || kcf->npools <= kcf->max_cached)
+    {
+        return;
+    }
+
+    ngx_queue_remove(&pool->queue);
+    kcf->npools--;
+
+    ngx_free(pool);
+}
+
+
+static void
+ngx_http_upstream_keepalive_warm_handler(ngx_event_t *ev)
+{
+    time_t                                   now;
+    ngx_uint_t                               i, n, live;
+    ngx_msec_t                               fresh, interval;
+    ngx_queue_t                             *q, *next;
+    ngx_http_upstream_rr_peer_t             *peer;
+    ngx_http_upstream_rr_peers_t            *peers;
+    ngx_http_upstream_keepalive_pool_t      *pool;
+    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    kcf = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive prewarm");
+
+    for (q = ngx_queue_head(&kcf->pools);
+         q != ngx_queue_sentinel(&kcf->pools);
+         q = ngx_queue_next(q))
+    {
+        pool = ngx_queue_data(q, ngx_http_upstream_keepalive_pool_t, queue);
+        pool->warm = 0;
+    }
+
+    /* connections idle for 3/4 of the timeout are replaced in advance */
+
+    fresh = kcf->timeout - kcf->timeout / 4;
+
+    now = ngx_time();
+
+    peers = ngx_http_upstream_rr_peers_acquire(kcf->upstream);
+
+    for (i = 0; i < peers->number; i++) {
+
+        peer = &peers->peer[i];
+
+        ngx_http_upstream_rr_peers_lock(peers);
+
+        live = !(peer->down
+                 || peer->unhealthy
+                 || (peer->max_fails
+                     && peer->fails >= peer->max_fails
+                     && now - peer->checked <= peer->fail_timeout));
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        if (!live) {
+            continue;
+        }
+
+        pool = ngx_http_upstream_keepalive_pool(kcf, peer->sockaddr,
+                                                peer->socklen, &peer->name,
+                                                ev->log);
+        if (pool == NULL) {
+            break;
+        }
+
+        pool->warm = 1;
+
+        if (pool->backoff
+            && (ngx_msec_int_t) (pool->backoff - ngx_current_msec) > 0)
+        {
+            continue;
+        }
+
+        pool->backoff = 0;
+
+        n = pool->connecting;
+
+        for (q = ngx_queue_head(&pool->cache);
+             q != ngx_queue_sentinel(&pool->cache);
+             q = ngx_queue_next(q))
+        {
+            item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t,
+                                  pool_queue);
+
+            if (ngx_current_msec - item->idle < fresh) {
+                n++;
+            }
+        }
+
+        while (n < kcf->prewarm) {
+            if (ngx_http_upstream_keepalive_connect(kcf, pool) != NGX_OK) {
+                break;
+            }
+
+            n++;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_release(kcf->upstream, peers);
+
+    for (q = ngx_queue_head(&kcf->pools);
+         q != ngx_queue_sentinel(&kcf->pools);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        pool = ngx_queue_data(q, ngx_http_upstream_keepalive_pool_t, queue);
+        ngx_http_upstream_keepalive_free_pool(kcf, pool);
+    }
+
+    interval = kcf->timeout / 4;
+
+    if (interval > 1000) {
+        interval = 1000;
+    }
+
+    ngx_add_timer(ev, interval ? interval : 1);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_connect(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_keepalive_pool_t *pool)
+{
+    ngx_int_t                             rc;
+    ngx_queue_t                          *q;
+    ngx_connection_t                     *c;
+    ngx_peer_connection_t                 pc;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    /* pre-warming never evicts connections in use */
+
+    if (ngx_queue_empty(&kcf->free)) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = (struct sockaddr *) pool->sockaddr;
+    pc.socklen = pool->socklen;
+    pc.name = &pool->name;
+    pc.get = ngx_event_get_peer;
+    pc.log = kcf->warm.log;
+    pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        pool->backoff = ngx_current_msec + kcf->timeout;
+        return NGX_ERROR;
+    }
+
+    c = pc.connection;
+
+    c->pool = ngx_create_pool(128, pc.log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    q = ngx_queue_head(&kcf->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    item->connection = c;
+    item->pool = pool;
+
+    pool->connecting++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc.log, 0,
+                   "keepalive prewarm connection %p to %V", c, &pool->name);
+
+    c->data = item;
+
+    c->read->handler = ngx_http_upstream_keepalive_dummy_handler;
+    c->write->handler = ngx_http_upstream_keepalive_connect_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, NGX_HTTP_UPSTREAM_KEEPALIVE_CONNECT);
+        return NGX_OK;
+    }
+
+    ngx_http_upstream_keepalive_connect_handler(c->write);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_connect_handler(ngx_event_t *wev)
+{
+    int                                      err;
+    socklen_t                                len;
+    ngx_queue_t                             *q;
+    ngx_connection_t                        *c;
+    ngx_http_upstream_keepalive_pool_t      *pool;
+    ngx_http_upstream_keepalive_cache_t     *item, *old;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    c = wev->data;
+    item = c->data;
+    pool = item->pool;
+    kcf = item->conf;
+
+    pool->connecting--;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, wev->log, NGX_ETIMEDOUT,
+                      "keepalive prewarm of %V timed out", &pool->name);
+        goto failed;
+    }
+
+    err = 0;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+        err = c->write->kq_errno;
+
+    } else
+#endif
+    {
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+    }
+
+    if (err) {
+        ngx_log_error(NGX_LOG_ERR, wev->log, err,
+                      "keepalive prewarm connect() to %V failed",
+                      &pool->name);
+        goto failed;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "keepalive prewarm connection %p ready", c);
+
+    wev->handler = ngx_http_upstream_keepalive_dummy_handler;
+    c->read->handler = ngx_http_upstream_keepalive_close_handler;
+
+    c->idle = 1;
+    item->idle = ngx_current_msec;
+
+    if (kcf->max_peer && pool->cached >= kcf->max_peer) {
+
+        /* the connection replaces the oldest one of the peer */
+
+        q = ngx_queue_last(&pool->cache);
+        old = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t,
+                             pool_queue);
+
+        ngx_http_upstream_keepalive_drop(old);
+    }
+
+    ngx_queue_insert_head(&kcf->cache, &item->queue);
+    ngx_queue_insert_head(&pool->cache, &item->pool_queue);
+    pool->cached++;
+
+    ngx_add_timer(c->read, kcf->timeout);
+
+    if (c->read->ready) {
+        ngx_http_upstream_keepalive_close_handler(c->read);
+    }
+
+    return;
+
+failed:
+
+    pool->backoff = ngx_current_msec + kcf->timeout;
+
+    ngx_http_upstream_keepalive_close(c);
+
+    ngx_queue_insert_head(&kcf->free, &item->queue);
+
+    ngx_http_upstream_keepalive_free_pool(kcf, pool);
+}
+
+
 #if (NGX_HTTP_SSL)
 
 static ngx_int_t
@@ -454,6 +962,55 @@ ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
 #endif
 
 
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                               i;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        /* implicitly defined upstreams have no configuration */
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->original_init_upstream == NULL || kcf->prewarm == 0) {
+            continue;
+        }
+
+        kcf->warm.handler = ngx_http_upstream_keepalive_warm_handler;
+        kcf->warm.data = kcf;
+        kcf->warm.log = cycle->log;
+        kcf->warm.cancelable = 1;
+
+        ngx_add_timer(&kcf->warm, 1);
+    }
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 {
@@ -470,9 +1027,15 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
+     *     conf->upstream = NULL;
+     *     conf->npools = 0;
      */
 
     conf->max_cached = 1;
+    conf->max_peer = NGX_CONF_UNSET_UINT;
+    conf->prewarm = NGX_CONF_UNSET_UINT;
+    conf->requests = NGX_CONF_UNSET_UINT;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
 
     return conf;
 }
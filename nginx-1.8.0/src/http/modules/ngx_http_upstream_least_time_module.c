@@ -0,0 +1,514 @@
+
+/*
+ * Copyright (C) Maxim Dounin
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_LT_HEADER     0
+#define NGX_HTTP_UPSTREAM_LT_LAST_BYTE  1
+
+/* the average of a peer not used halves every 10 seconds */
+#define NGX_HTTP_UPSTREAM_LT_DECAY      10000
+
+
+typedef struct {
+    ngx_uint_t                         mode;
+} ngx_http_upstream_lt_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t   rrp;
+
+    ngx_http_upstream_lt_srv_conf_t   *conf;
+    ngx_http_upstream_t               *upstream;
+    ngx_msec_t                         start;
+
+    ngx_event_get_peer_pt              get_rr_peer;
+    ngx_event_free_peer_pt             free_rr_peer;
+} ngx_http_upstream_lt_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_least_time_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_least_time_peer(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_free_least_time_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_msec_t ngx_http_upstream_lt_time(ngx_http_upstream_rr_peer_t *peer,
+    ngx_msec_t now);
+static void *ngx_http_upstream_least_time_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_least_time(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_least_time_commands[] = {
+
+    { ngx_string("least_time"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_least_time,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_least_time_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_least_time_create_conf, /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_least_time_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_least_time_module_ctx, /* module context */
+    ngx_http_upstream_least_time_commands, /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_least_time(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "init least time");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_least_time_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_least_time_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_lt_peer_data_t  *ltp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init least time peer");
+
+    ltp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_lt_peer_data_t));
+    if (ltp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &ltp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_least_time_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_least_time_peer;
+
+    ltp->conf = ngx_http_conf_upstream_srv_conf(us,
+                                          ngx_http_upstream_least_time_module);
+    ltp->upstream = r->upstream;
+    ltp->start = 0;
+
+    ltp->get_rr_peer = ngx_http_upstream_get_round_robin_peer;
+    ltp->free_rr_peer = ngx_http_upstream_free_round_robin_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_least_time_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_lt_peer_data_t  *ltp = data;
+
+    time_t                         now;
+    uint64_t                       score, best_score;
+    uintptr_t                      m;
+    ngx_int_t                      rc, total, best_weight;
+    ngx_uint_t                     i, n, p, many;
+    ngx_http_upstream_rr_peer_t   *peer, *best;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get least time peer, try: %ui", pc->tries);
+
+    ltp->start = ngx_current_msec;
+
+    if (ltp->rrp.peers->single) {
+        return ltp->get_rr_peer(pc, &ltp->rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    peers = ltp->rrp.peers;
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    best = NULL;
+    best_score = 0;
+    best_weight = 0;
+    total = 0;
+
+#if (NGX_SUPPRESS_WARN)
+    many = 0;
+    p = 0;
+#endif
+
+    for (i = 0; i < peers->number; i++) {
+
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (ltp->rrp.tried[n] & m) {
+            continue;
+        }
+
+        peer = &peers->peer[i];
+
+        if (peer->down || peer->unhealthy) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        /*
+         * select peer with the least average time multiplied by the number
+         * of requests in progress, relative to its weight; if there are
+         * multiple peers with the same score, select based on round-robin
+         */
+
+        score = (uint64_t) (ngx_http_upstream_lt_time(peer, ngx_current_msec)
+                            + 1)
+                * (peer->conns + 1);
+
+        if (best == NULL
+            || score * best->weight < best_score * peer->weight)
+        {
+            best = peer;
+            best_score = score;
+            best_weight = peer->weight;
+            many = 0;
+            p = i;
+
+        } else if (score * best->weight == best_score * peer->weight) {
+            many = 1;
+        }
+    }
+
+    if (best == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get least time peer, no peer found");
+
+        goto failed;
+    }
+
+    if (many) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get least time peer, many");
+
+        for (i = p; i < peers->number; i++) {
+
+            n = i / (8 * sizeof(uintptr_t));
+            m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+            if (ltp->rrp.tried[n] & m) {
+                continue;
+            }
+
+            peer = &peers->peer[i];
+
+            if (peer->down || peer->unhealthy) {
+                continue;
+            }
+
+            score = (uint64_t) (ngx_http_upstream_lt_time(peer,
+                                                          ngx_current_msec)
+                                + 1)
+                    * (peer->conns + 1);
+
+            if (score * best_weight != best_score * peer->weight) {
+                continue;
+            }
+
+            if (peer->max_fails
+                && peer->fails >= peer->max_fails
+                && now - peer->checked <= peer->fail_timeout)
+            {
+                continue;
+            }
+
+            if (peer->max_conns && peer->conns >= peer->max_conns) {
+                continue;
+            }
+
+            peer->current_weight += peer->effective_weight;
+            total += peer->effective_weight;
+
+            if (peer->effective_weight < peer->weight) {
+                peer->effective_weight++;
+            }
+
+            if (peer->current_weight > best->current_weight) {
+                best = peer;
+                p = i;
+            }
+        }
+    }
+
+    best->current_weight -= total;
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    ltp->rrp.current = p;
+
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    ltp->rrp.tried[n] |= m;
+
+    best->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    if (peers->next) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get least time peer, backup servers");
+
+        ltp->rrp.peers = peers->next;
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        n = (ltp->rrp.peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for (i = 0; i < n; i++) {
+             ltp->rrp.tried[i] = 0;
+        }
+
+        rc = ngx_http_upstream_get_least_time_peer(pc, ltp);
+
+        if (rc != NGX_BUSY) {
+            return rc;
+        }
+
+        ngx_http_upstream_rr_peers_lock(peers);
+    }
+
+    /* all peers failed, mark them as live for quick recovery */
+
+    for (i = 0; i < peers->number; i++) {
+        peers->peer[i].fails = 0;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_upstream_free_least_time_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state)
+{
+    ngx_http_upstream_lt_peer_data_t  *ltp = data;
+
+    ngx_msec_t                    now, avg;
+    ngx_msec_int_t                ms;
+    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_http_upstream_state_t    *us;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free least time peer %ui %ui", pc->tries, state);
+
+    if (ltp->rrp.peers->single) {
+        ltp->free_rr_peer(pc, &ltp->rrp, state);
+        return;
+    }
+
+    /*
+     * the time is taken from the upstream state: the header time,
+     * or the response time once the request is finalized; a failure
+     * counts with the time it took
+     */
+
+    now = ngx_current_msec;
+    us = ltp->upstream->state;
+    ms = -1;
+
+    if (us == NULL) {
+        /* void */
+
+    } else if (ltp->conf->mode == NGX_HTTP_UPSTREAM_LT_HEADER
+               && us->header_sec != (time_t) NGX_ERROR)
+    {
+        ms = (ngx_msec_int_t) (us->header_sec * 1000 + us->header_msec);
+
+    } else if (ltp->conf->mode == NGX_HTTP_UPSTREAM_LT_LAST_BYTE
+               && !(state & (NGX_PEER_FAILED|NGX_PEER_NEXT)))
+    {
+        ms = (ngx_msec_int_t) (us->response_sec * 1000 + us->response_msec);
+
+    } else if (state & NGX_PEER_FAILED) {
+        ms = (ngx_msec_int_t) (now - ltp->start);
+    }
+
+    peer = &ltp->rrp.peers->peer[ltp->rrp.current];
+
+    ngx_http_upstream_rr_peers_lock(ltp->rrp.peers);
+
+    if (ms >= 0) {
+
+        /* the average is kept in 1/16 of a millisecond, with alpha 1/8 */
+
+        if (peer->response_updated == 0) {
+            avg = (ngx_msec_t) ms << 4;
+
+        } else {
+            avg = ngx_http_upstream_lt_time(peer, now);
+            avg = avg - (avg >> 3) + ((ngx_msec_t) ms << 1);
+        }
+
+        peer->response_time = avg;
+        peer->response_updated = now ? now : 1;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "least time peer %V: %M, average %M",
+                       &peer->name, (ngx_msec_t) ms, avg >> 4);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(ltp->rrp.peers);
+
+    ltp->free_rr_peer(pc, &ltp->rrp, state);
+}
+
+
+static ngx_msec_t
+ngx_http_upstream_lt_time(ngx_http_upstream_rr_peer_t *peer, ngx_msec_t now)
+{
+    ngx_msec_t  shift;
+
+    /* the average decays while the peer is not used */
+
+    shift = (now - peer->response_updated) / NGX_HTTP_UPSTREAM_LT_DECAY;
+
+    if (shift >= 8 * sizeof(ngx_msec_t)) {
+        return 0;
+    }
+
+    return peer->response_time >> shift;
+}
+
+
+static void *
+ngx_http_upstream_least_time_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_lt_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_lt_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->mode = NGX_HTTP_UPSTREAM_LT_HEADER;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_least_time(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_lt_srv_conf_t  *ltcf = conf;
+
+    ngx_str_t                     *value;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "header") == 0) {
+        ltcf->mode = NGX_HTTP_UPSTREAM_LT_HEADER;
+
+    } else if (ngx_strcmp(value[1].data, "last_byte") == 0) {
+        ltcf->mode = NGX_HTTP_UPSTREAM_LT_LAST_BYTE;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_least_time;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,510 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    /* the cumulative weights of the peers the ranges are built for */
+    ngx_uint_t                        *ranges;
+    ngx_http_upstream_rr_peers_t      *peers;
+
+    ngx_uint_t                         two;  /* unsigned  two:1; */
+} ngx_http_upstream_random_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t   rrp;
+
+    ngx_http_upstream_random_srv_conf_t  *conf;
+
+    ngx_uint_t                         tries;
+} ngx_http_upstream_random_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_random(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_update_random(
+    ngx_http_upstream_srv_conf_t *us, ngx_http_upstream_random_srv_conf_t *rcf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_log_t *log);
+static ngx_int_t ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc,
+    void *data);
+static ngx_int_t ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc,
+    void *data);
+static ngx_uint_t ngx_http_upstream_peek_random_peer(
+    ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_random_srv_conf_t *rcf);
+static ngx_uint_t ngx_http_upstream_random_peer_usable(
+    ngx_http_upstream_random_peer_data_t *rp, ngx_uint_t i, time_t now);
+static void *ngx_http_upstream_random_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_random_commands[] = {
+
+    { ngx_string("random"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_http_upstream_random,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_random_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_random_create_conf,  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_random_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_random_module_ctx,  /* module context */
+    ngx_http_upstream_random_commands,     /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_random(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "init random");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_random_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_random_srv_conf_t   *rcf;
+    ngx_http_upstream_random_peer_data_t  *rp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init random peer");
+
+    rcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_random_module);
+
+    rp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_random_peer_data_t));
+    if (rp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &rp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* the ranges are rebuilt once the servers were re-resolved */
+
+    if (rcf->peers != rp->rrp.peers) {
+        if (ngx_http_upstream_update_random(us, rcf, rp->rrp.peers,
+                                            r->connection->log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    r->upstream->peer.get = rcf->two ? ngx_http_upstream_get_random2_peer
+                                     : ngx_http_upstream_get_random_peer;
+
+    rp->conf = rcf;
+    rp->tries = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_update_random(ngx_http_upstream_srv_conf_t *us,
+    ngx_http_upstream_random_srv_conf_t *rcf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_log_t *log)
+{
+    ngx_uint_t   i, total, *ranges;
+
+    ranges = ngx_alloc(peers->number * sizeof(ngx_uint_t), log);
+    if (ranges == NULL) {
+        return NGX_ERROR;
+    }
+
+    total = 0;
+
+    for (i = 0; i < peers->number; i++) {
+        total += peers->peer[i].weight;
+        ranges[i] = total;
+    }
+
+    if (rcf->ranges) {
+        ngx_free(rcf->ranges);
+    }
+
+    /* the peers are kept while the ranges refer to them */
+
+    if (rcf->peers) {
+        ngx_http_upstream_rr_peers_release(us, rcf->peers);
+    }
+
+    if (peers != us->peer.data) {
+        (void) ngx_atomic_fetch_add(&peers->refs, 1);
+    }
+
+    rcf->ranges = ranges;
+    rcf->peers = peers;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_random_peer_data_t  *rp = data;
+
+    time_t                         now;
+    uintptr_t                      m;
+    ngx_uint_t                     i, n;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get random peer, try: %ui", pc->tries);
+
+    peers = rp->rrp.peers;
+
+    if (rp->tries > 20 || peers->single) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &rp->rrp);
+    }
+
+    /*
+     * the ranges may have been rebuilt for the re-resolved servers
+     * by another request, and are never built for the backup ones
+     */
+
+    if (peers->weighted && peers != rp->conf->peers) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &rp->rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    for ( ;; ) {
+
+        i = ngx_http_upstream_peek_random_peer(peers, rp->conf);
+
+        if (ngx_http_upstream_random_peer_usable(rp, i, now)) {
+            break;
+        }
+
+        if (++rp->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(peers);
+            return ngx_http_upstream_get_round_robin_peer(pc, &rp->rrp);
+        }
+    }
+
+    peer = &peers->peer[i];
+
+    rp->rrp.current = i;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    rp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_random_peer_data_t  *rp = data;
+
+    time_t                         now;
+    uintptr_t                      m;
+    ngx_uint_t                     i, n, p;
+    ngx_http_upstream_rr_peer_t   *peer, *prev;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get random2 peer, try: %ui", pc->tries);
+
+    peers = rp->rrp.peers;
+
+    if (rp->tries > 20 || peers->single) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &rp->rrp);
+    }
+
+    if (peers->weighted && peers != rp->conf->peers) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &rp->rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    /* two distinct usable peers are sampled, the less loaded one is used */
+
+    prev = NULL;
+
+#if (NGX_SUPPRESS_WARN)
+    p = 0;
+#endif
+
+    for ( ;; ) {
+
+        i = ngx_http_upstream_peek_random_peer(peers, rp->conf);
+
+        if (ngx_http_upstream_random_peer_usable(rp, i, now)) {
+
+            if (prev == NULL) {
+                prev = &peers->peer[i];
+                p = i;
+
+            } else if (i != p) {
+                break;
+            }
+        }
+
+        if (++rp->tries > 20) {
+
+            if (prev) {
+                i = p;
+                break;
+            }
+
+            ngx_http_upstream_rr_peers_unlock(peers);
+            return ngx_http_upstream_get_round_robin_peer(pc, &rp->rrp);
+        }
+    }
+
+    peer = &peers->peer[i];
+
+    /* on a tie the first one sampled wins, as it is sampled by weight */
+
+    if (peer->conns * prev->weight >= prev->conns * peer->weight) {
+        peer = prev;
+        i = p;
+    }
+
+    rp->rrp.current = i;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    rp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_peek_random_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_random_srv_conf_t *rcf)
+{
+    ngx_uint_t  i, j, k, x;
+
+    if (!peers->weighted) {
+        return ngx_random() % peers->number;
+    }
+
+    x = ngx_random() % rcf->ranges[peers->number - 1];
+
+    /* the first peer whose cumulative weight exceeds x */
+
+    i = 0;
+    j = peers->number;
+
+    while (j - i > 1) {
+        k = (i + j) / 2;
+
+        if (x < rcf->ranges[k - 1]) {
+            j = k;
+
+        } else {
+            i = k;
+        }
+    }
+
+    return i;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_random_peer_usable(ngx_http_upstream_random_peer_data_t *rp,
+    ngx_uint_t i, time_t now)
+{
+    uintptr_t                     m;
+    ngx_uint_t                    n;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    if (rp->rrp.tried[n] & m) {
+        return 0;
+    }
+
+    peer = &rp->rrp.peers->peer[i];
+
+    if (peer->down || peer->unhealthy) {
+        return 0;
+    }
+
+    if (peer->max_fails
+        && peer->fails >= peer->max_fails
+        && now - peer->checked <= peer->fail_timeout)
+    {
+        return 0;
+    }
+
+    if (peer->max_conns && peer->conns >= peer->max_conns) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static void *
+ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_random_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_random_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->ranges = NULL;
+     *     conf->peers = NULL;
+     *     conf->two = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_random_srv_conf_t  *rcf = conf;
+
+    ngx_str_t                     *value;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_random;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS;
+
+    if (cf->args->nelts == 1) {
+        return NGX_CONF_OK;
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "two") != 0) {
+        goto invalid;
+    }
+
+    rcf->two = 1;
+
+    /* the less loaded of the two is the one with less connections */
+
+    if (cf->args->nelts == 3 && ngx_strcmp(value[2].data, "least_conn") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
@@ -29,6 +29,12 @@
 
 #define NGX_HTTP_CACHE_VERSION       3
 
+#define NGX_HTTP_CACHE_INDEX_VERSION 1
+
+#define NGX_HTTP_CACHE_POLICY_LRU    0
+#define NGX_HTTP_CACHE_POLICY_SLRU   1
+#define NGX_HTTP_CACHE_POLICY_TINYLFU  2
+
 
 typedef struct {
     ngx_uint_t                       status;
@@ -36,31 +42,73 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+/*
+ * the nodes live in an array in the keys zone and refer to each other
+ * by indices, 0 is no node; a node takes 64 bytes on 64-bit platforms
+ */
+
 typedef struct {
-    ngx_rbtree_node_t                node;
-    ngx_queue_t                      queue;
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
 
-    u_char                           key[NGX_HTTP_CACHE_KEY_LEN
-                                         - sizeof(ngx_rbtree_key_t)];
+    uint32_t                         next;
+    uint32_t                         lru_prev;
+    uint32_t                         lru_next;
+
+    /* seconds since the keys zone was created */
+    uint32_t                         expire;
+    uint32_t                         valid_sec;
+
+    /* in cache->bsize blocks */
+    uint32_t                         fs_size;
+
+    /* the low 32 bits of ngx_current_msec */
+    uint32_t                         lock_time;
 
     unsigned                         count:20;
     unsigned                         uses:10;
-    unsigned                         valid_msec:10;
-    unsigned                         error:10;
     unsigned                         exists:1;
     unsigned                         updating:1;
+
+    unsigned                         valid_msec:10;
+    unsigned                         error:10;
     unsigned                         deleting:1;
-                                     /* 11 unused bits */
+    unsigned                         unchecked:1;
+    unsigned                         segment:1;
+                                     /* 9 unused bits */
 
-    ngx_file_uniq_t                  uniq;
-    time_t                           expire;
-    time_t                           valid_sec;
-    size_t                           body_start;
-    off_t                            fs_size;
-    ngx_msec_t                       lock_time;
+    u_short                          body_start;
 } ngx_http_file_cache_node_t;
 
 
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_queue_t                      queue;
+
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN
+                                         - sizeof(ngx_rbtree_key_t)];
+
+    ngx_uint_t                       count;
+    unsigned                         deleted:1;
+
+    ngx_file_uniq_t                  uniq;
+    size_t                           len;
+
+    /* the whole cache file: the header, the response header and the body */
+    u_char                           data[1];
+} ngx_http_file_cache_mem_node_t;
+
+
+typedef struct {
+    ngx_file_uniq_t                  uniq;
+    off_t                            length;
+    size_t                           len;
+
+    /* the cache file header and the response header */
+    u_char                           data[1];
+} ngx_http_file_cache_head_t;
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -90,6 +138,7 @@ struct ngx_http_cache_s {
 
     ngx_http_file_cache_t           *file_cache;
     ngx_http_file_cache_node_t      *node;
+    ngx_http_file_cache_mem_node_t  *mem;
 
 #if (NGX_THREADS)
     ngx_thread_task_t               *thread_task;
@@ -111,6 +160,7 @@ struct ngx_http_cache_s {
     unsigned                         temp_file:1;
     unsigned                         reading:1;
     unsigned                         secondary:1;
+    unsigned                         head:1;
 };
 
 
@@ -132,15 +182,68 @@ typedef struct {
 
 
 typedef struct {
-    ngx_rbtree_t                     rbtree;
-    ngx_rbtree_node_t                sentinel;
-    ngx_queue_t                      queue;
+    ngx_uint_t                       version;
+    size_t                           bsize;
+    time_t                           time;
+    time_t                           min_expire;
+    time_t                           max_expire;
+    ngx_uint_t                       nodes;
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    time_t                           expire;
+    time_t                           valid_sec;
+    size_t                           body_start;
+    off_t                            fs_size;
+    ngx_uint_t                       uses;
+} ngx_http_file_cache_index_node_t;
+
+
+typedef struct {
+    ngx_http_file_cache_node_t      *nodes;
+    uint32_t                        *buckets;
+    uint32_t                         mask;
+    uint32_t                         nnodes;
+    uint32_t                         used;
+    uint32_t                         free;
+    uint32_t                         count;
+
+    /* the probation and protected segments */
+    uint32_t                         lru_head[2];
+    uint32_t                         lru_tail[2];
+    uint32_t                         nprotected;
+
+    /* the count-min frequency sketch, 4 rows */
+    u_char                          *sketch;
+    uint32_t                         sketch_mask;
+    ngx_uint_t                       sketch_adds;
+
+    ngx_atomic_t                     hits;
+    ngx_atomic_t                     misses;
+    ngx_atomic_t                     rejected;
+    ngx_atomic_t                     evicted;
+
+    /* the response headers, indexed as nodes */
+    ngx_http_file_cache_head_t     **heads;
+
+    time_t                           epoch;
     ngx_atomic_t                     cold;
     ngx_atomic_t                     loading;
+    ngx_atomic_t                     indexed;
     off_t                            size;
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+} ngx_http_file_cache_mem_sh_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
@@ -153,6 +256,9 @@ struct ngx_http_file_cache_s {
 
     time_t                           inactive;
 
+    ngx_uint_t                       policy;
+    size_t                           headers;
+
     ngx_uint_t                       files;
     ngx_uint_t                       loader_files;
     ngx_msec_t                       last;
@@ -160,6 +266,19 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       loader_threshold;
 
     ngx_shm_zone_t                  *shm_zone;
+
+    ngx_str_t                        index_name;
+    ngx_str_t                        index_temp;
+    time_t                           index_interval;
+    time_t                           index_next;
+
+    ngx_http_file_cache_mem_sh_t    *mem_sh;
+    ngx_slab_pool_t                 *mem_shpool;
+
+    ngx_uint_t                       mem_min_uses;
+    size_t                           mem_max_object;
+
+    ngx_shm_zone_t                  *mem_zone;
 };
 
 
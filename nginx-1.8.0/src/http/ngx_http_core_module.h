@@ -570,6 +570,7 @@ struct ngx_http_core_loc_conf_s {
     ngx_flag_t    internal;                /* internal */
     ngx_flag_t    sendfile;                /* sendfile */
     ngx_flag_t    aio;                     /* aio */
+    ngx_flag_t    aio_write;               /* aio_write */
     ngx_flag_t    tcp_nopush;              /* tcp_nopush */
     ngx_flag_t    tcp_nodelay;             /* tcp_nodelay */
     ngx_flag_t    reset_timedout_connection; /* reset_timedout_connection */
@@ -746,9 +747,15 @@ extern ngx_uint_t ngx_http_max_module;
 extern ngx_str_t  ngx_http_core_get_method;
 
 
+/*
+ * a filter that clears the content length changes the response body,
+ * so the upstream chunked framing can not be passed to the client as is
+ */
+
 #define ngx_http_clear_content_length(r)                                      \
                                                                               \
     r->headers_out.content_length_n = -1;                                     \
+    r->body_transformed = 1;                                                  \
     if (r->headers_out.content_length) {                                      \
         r->headers_out.content_length->hash = 0;                              \
         r->headers_out.content_length = NULL;                                 \
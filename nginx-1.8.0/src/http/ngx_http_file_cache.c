@@ -11,6 +11,21 @@
 #include <ngx_md5.h>
 
 
+#define NGX_HTTP_CACHE_INDEX_BATCH    8192
+#define NGX_HTTP_CACHE_INDEX_BUCKETS  1024
+
+
+/* the node times are kept in seconds since the keys zone was created */
+
+#define ngx_http_file_cache_rel_time(sh, t)                                  \
+    ((t) > (sh)->epoch ? (uint32_t) ((t) - (sh)->epoch) : 0)
+
+#define ngx_http_file_cache_abs_time(sh, t)  ((time_t) (t) + (sh)->epoch)
+
+#define ngx_http_file_cache_node_index(sh, fcn)                              \
+    ((uint32_t) ((fcn) - (sh)->nodes))
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
@@ -34,8 +49,34 @@ static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
     ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
-static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static uint32_t *ngx_http_file_cache_bucket(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_http_file_cache_node_t *
+    ngx_http_file_cache_alloc_node(ngx_http_file_cache_t *cache, u_char *key);
+static void ngx_http_file_cache_free_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_lru_insert_head(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_lru_insert_tail(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_lru_remove(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_promote(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_sketch_add(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_sketch_estimate(
+    ngx_http_file_cache_t *cache, u_char *key);
+static ngx_uint_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_int_t ngx_http_file_cache_head_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_head_add(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_head_free_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_int_t ngx_http_file_cache_open_body(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
 static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
     size_t len, u_char *hash);
 static void ngx_http_file_cache_vary_header(ngx_http_request_t *r,
@@ -48,7 +89,7 @@ static void ngx_http_file_cache_cleanup(void *data);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
+    ngx_http_file_cache_node_t *fcn, u_char *name);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -62,6 +103,29 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
+static void ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache,
+    ngx_log_t *log);
+static void ngx_http_file_cache_index_write(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_index_sweep(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_mem_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_file_cache_mem_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_mem_add(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_http_file_cache_mem_node_t *
+    ngx_http_file_cache_mem_alloc_locked(ngx_http_file_cache_t *cache,
+    size_t size);
+static ngx_http_file_cache_mem_node_t *
+    ngx_http_file_cache_mem_lookup(ngx_http_file_cache_t *cache, u_char *key);
+static void ngx_http_file_cache_mem_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_file_cache_mem_drop(ngx_http_file_cache_t *cache,
+    u_char *key);
+static void ngx_http_file_cache_mem_delete_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_mem_node_t *mn);
+static void ngx_http_file_cache_mem_free(ngx_http_cache_t *c);
+static void ngx_http_file_cache_mem_cleanup(void *data);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -83,7 +147,8 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
+    size_t                  len, size;
+    uint32_t                nbuckets;
     ngx_uint_t              n;
     ngx_http_file_cache_t  *cache;
 
@@ -116,7 +181,23 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
         cache->max_size /= cache->bsize;
 
-        if (!cache->sh->cold || cache->sh->loading) {
+        if (cache->policy == NGX_HTTP_CACHE_POLICY_TINYLFU
+            && cache->sh->sketch == NULL)
+        {
+            ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0,
+                          "cache \"%V\" was created without the frequency "
+                          "sketch, admission is disabled until restart",
+                          &shm_zone->shm.name);
+        }
+
+        if (cache->headers && cache->sh->heads == NULL) {
+            ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0,
+                          "cache \"%V\" was created without headers, "
+                          "they are not kept until restart",
+                          &shm_zone->shm.name);
+        }
+
+        if ((!cache->sh->cold && !cache->sh->indexed) || cache->sh->loading) {
             cache->path->loader = NULL;
         }
 
@@ -139,13 +220,27 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->data = cache->sh;
 
-    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
-                    ngx_http_file_cache_rbtree_insert_value);
-
-    ngx_queue_init(&cache->sh->queue);
+    cache->sh->free = 0;
+    cache->sh->used = 0;
+    cache->sh->count = 0;
+    cache->sh->lru_head[0] = 0;
+    cache->sh->lru_head[1] = 0;
+    cache->sh->lru_tail[0] = 0;
+    cache->sh->lru_tail[1] = 0;
+    cache->sh->nprotected = 0;
+    cache->sh->sketch = NULL;
+    cache->sh->sketch_mask = 0;
+    cache->sh->sketch_adds = 0;
+    cache->sh->hits = 0;
+    cache->sh->misses = 0;
+    cache->sh->rejected = 0;
+    cache->sh->evicted = 0;
+    cache->sh->heads = NULL;
+    cache->sh->epoch = ngx_time();
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
+    cache->sh->indexed = 0;
     cache->sh->size = 0;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
@@ -164,7 +259,112 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->log_nomem = 0;
 
+    /*
+     * the rest of the zone is taken by the nodes array
+     * and by the hash buckets, about one bucket per node;
+     * the response headers are allocated from the reserved part
+     */
+
+    size = (cache->shpool->end - cache->shpool->start) - 4 * ngx_pagesize;
+
+    if ((ssize_t) size <= (ssize_t) cache->headers) {
+        goto small;
+    }
+
+    size -= cache->headers;
+
+    len = sizeof(ngx_http_file_cache_node_t) + sizeof(uint32_t);
+
+    if (cache->headers) {
+        len += sizeof(ngx_http_file_cache_head_t *);
+    }
+
+    n = size / len;
+
+    if (n > NGX_MAX_UINT32_VALUE / 2) {
+        n = NGX_MAX_UINT32_VALUE / 2;
+    }
+
+    for (nbuckets = 1; nbuckets * 2 <= n; nbuckets *= 2) { /* void */ }
+
+    cache->sh->buckets = ngx_slab_calloc(cache->shpool,
+                                         nbuckets * sizeof(uint32_t));
+    if (cache->sh->buckets == NULL) {
+        goto small;
+    }
+
+    cache->sh->mask = nbuckets - 1;
+
+    size -= ngx_align(nbuckets * sizeof(uint32_t), ngx_pagesize);
+
+    if (cache->policy == NGX_HTTP_CACHE_POLICY_TINYLFU) {
+
+        /* the sketch is as wide as the hash, 4 one-byte counters per bucket */
+
+        cache->sh->sketch = ngx_slab_calloc(cache->shpool, 4 * nbuckets);
+        if (cache->sh->sketch == NULL) {
+            goto small;
+        }
+
+        cache->sh->sketch_mask = nbuckets - 1;
+
+        size -= ngx_min(size, ngx_align(4 * nbuckets, ngx_pagesize));
+    }
+
+    /* each node has a slot for its header copy, allocated below */
+
+    if (cache->headers) {
+        n = size / (sizeof(ngx_http_file_cache_node_t)
+                    + sizeof(ngx_http_file_cache_head_t *));
+
+    } else {
+        n = size / sizeof(ngx_http_file_cache_node_t);
+    }
+
+    for ( ;; ) {
+
+        if (n < 2) {
+            goto small;
+        }
+
+        /* the node 0 is not used */
+
+        cache->sh->nodes = ngx_slab_alloc(cache->shpool,
+                                      n * sizeof(ngx_http_file_cache_node_t));
+        if (cache->sh->nodes) {
+            break;
+        }
+
+        n -= n / 8 + 1;
+    }
+
+    if (cache->headers) {
+        cache->sh->heads = ngx_slab_calloc(cache->shpool,
+                                   n * sizeof(ngx_http_file_cache_head_t *));
+        if (cache->sh->heads == NULL) {
+            goto small;
+        }
+    }
+
+    cache->sh->nnodes = (uint32_t) (n - 1);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, shm_zone->shm.log, 0,
+                   "http file cache zone \"%V\": %ui nodes, %uD buckets",
+                   &shm_zone->shm.name, n - 1, nbuckets);
+
+    if (cache->index_interval) {
+        ngx_http_file_cache_index_load(cache, shm_zone->shm.log);
+    }
+
     return NGX_OK;
+
+small:
+
+    ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                  "cache keys zone \"%V\" is too small",
+                  &shm_zone->shm.name);
+
+    return NGX_ERROR;
 }
 
 
@@ -260,6 +460,7 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
+    size_t                     size;
     ngx_int_t                  rc, rv;
     ngx_uint_t                 test;
     ngx_http_cache_t          *c;
@@ -339,6 +540,38 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->exists && cache->mem_shpool) {
+
+        rc = ngx_http_file_cache_mem_open(r, c);
+
+        if (rc == NGX_ERROR) {
+            return rc;
+        }
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+    }
+
+    /* HEAD and conditional requests may need no body at all */
+
+    if (c->exists
+        && cache->sh->heads
+        && (r->method == NGX_HTTP_HEAD
+            || r->headers_in.if_none_match
+            || r->headers_in.if_modified_since))
+    {
+        rc = ngx_http_file_cache_head_open(r, c);
+
+        if (rc == NGX_ERROR) {
+            return rc;
+        }
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -378,7 +611,22 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
-    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    /*
+     * an object to be stored in memory is read whole along with
+     * the header, as ngx_http_file_cache_mem_add() does not read
+     */
+
+    size = c->body_start;
+
+    if (cache->mem_shpool
+        && c->node->uses >= cache->mem_min_uses
+        && c->length <= (off_t) cache->mem_max_object
+        && c->length > (off_t) size)
+    {
+        size = (size_t) c->length;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, size);
     if (c->buf == NULL) {
         return NGX_ERROR;
     }
@@ -411,11 +659,11 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    timer = c->node->lock_time - now;
+    timer = (ngx_msec_t) (int32_t) (c->node->lock_time - (uint32_t) now);
 
     if (!c->node->updating || (ngx_msec_int_t) timer <= 0) {
         c->node->updating = 1;
-        c->node->lock_time = now + c->lock_age;
+        c->node->lock_time = (uint32_t) (now + c->lock_age);
         c->updating = 1;
         c->lock_time = c->node->lock_time;
     }
@@ -497,7 +745,7 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    timer = c->node->lock_time - now;
+    timer = (ngx_msec_t) (int32_t) (c->node->lock_time - (uint32_t) now);
 
     if (c->node->updating && (ngx_msec_int_t) timer > 0) {
         wait = 1;
@@ -527,10 +775,18 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->mem) {
+        n = ngx_min(c->length, (off_t) c->body_start);
 
-    if (n < 0) {
-        return n;
+    } else if (c->head) {
+        n = c->buf->last - c->buf->pos;
+
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -577,7 +833,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         }
     }
 
-    c->buf->last += n;
+    c->buf->last = c->buf->pos + n;
 
     c->valid_sec = h->valid_sec;
     c->last_modified = h->last_modified;
@@ -598,10 +854,10 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
         if (!c->node->exists) {
             c->node->uses = 1;
-            c->node->body_start = c->body_start;
+            c->node->body_start = (u_short) c->body_start;
             c->node->exists = 1;
             c->node->uniq = c->uniq;
-            c->node->fs_size = c->fs_size;
+            c->node->fs_size = (uint32_t) c->fs_size;
 
             cache->sh->size += c->fs_size;
         }
@@ -634,6 +890,21 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return rc;
     }
 
+    if (c->mem || c->head) {
+        return NGX_OK;
+    }
+
+    if (cache->mem_shpool
+        && c->node->uses >= cache->mem_min_uses
+        && c->length <= (off_t) cache->mem_max_object)
+    {
+        ngx_http_file_cache_mem_add(r, c);
+    }
+
+    if (cache->sh->heads) {
+        ngx_http_file_cache_head_add(r, c);
+    }
+
     return NGX_OK;
 }
 
@@ -651,7 +922,8 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 #if (NGX_HAVE_FILE_AIO)
 
     if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_file_aio_read(&c->file, c->buf->pos,
+                              c->buf->end - c->buf->pos, 0, r->pool);
 
         if (n != NGX_AGAIN) {
             c->reading = 0;
@@ -678,7 +950,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->file.thread_ctx = r;
 
         n = ngx_thread_read(&c->thread_task, &c->file, c->buf->pos,
-                            c->body_start, 0, r->pool);
+                            c->buf->end - c->buf->pos, 0, r->pool);
 
         c->reading = (n == NGX_AGAIN);
 
@@ -687,7 +959,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
 #endif
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+    return ngx_read_file(&c->file, c->buf->pos, c->buf->end - c->buf->pos, 0);
 }
 
 
@@ -802,10 +1074,21 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
     if (fcn == NULL) {
         fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (fcn && fcn->exists) {
+            cache->sh->hits++;
+
+        } else {
+            cache->sh->misses++;
+        }
+
+        if (cache->sh->sketch) {
+            ngx_http_file_cache_sketch_add(cache, c->key);
+        }
     }
 
     if (fcn) {
-        ngx_queue_remove(&fcn->queue);
+        ngx_http_file_cache_lru_remove(cache, fcn);
 
         if (c->node == NULL) {
             fcn->uses++;
@@ -814,7 +1097,9 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
         if (fcn->error) {
 
-            if (fcn->valid_sec < ngx_time()) {
+            if (ngx_http_file_cache_abs_time(cache->sh, fcn->valid_sec)
+                < ngx_time())
+            {
                 goto renew;
             }
 
@@ -825,6 +1110,13 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
         if (fcn->exists || fcn->uses >= c->min_uses) {
 
+            if (!fcn->exists && c->node == NULL
+                && !ngx_http_file_cache_admit(cache, c->key))
+            {
+                rc = NGX_AGAIN;
+                goto done;
+            }
+
             c->exists = fcn->exists;
             if (fcn->body_start) {
                 c->body_start = fcn->body_start;
@@ -840,8 +1132,7 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         goto done;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
+    fcn = ngx_http_file_cache_alloc_node(cache, c->key);
     if (fcn == NULL) {
         ngx_shmtx_unlock(&cache->shpool->mutex);
 
@@ -849,8 +1140,7 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
         ngx_shmtx_lock(&cache->shpool->mutex);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
+        fcn = ngx_http_file_cache_alloc_node(cache, c->key);
         if (fcn == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", cache->shpool->log_ctx);
@@ -859,13 +1149,6 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         }
     }
 
-    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
-
-    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
-
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
-
     fcn->uses = 1;
     fcn->count = 1;
 
@@ -881,11 +1164,24 @@ renew:
     fcn->body_start = 0;
     fcn->fs_size = 0;
 
+    if (c->node == NULL && fcn->uses >= c->min_uses
+        && !ngx_http_file_cache_admit(cache, c->key))
+    {
+        rc = NGX_AGAIN;
+    }
+
 done:
 
-    fcn->expire = ngx_time() + cache->inactive;
+    if (c->node == NULL && fcn->exists && !fcn->segment
+        && cache->policy != NGX_HTTP_CACHE_POLICY_LRU)
+    {
+        ngx_http_file_cache_promote(cache, fcn);
+    }
+
+    fcn->expire = ngx_http_file_cache_rel_time(cache->sh,
+                                               ngx_time() + cache->inactive);
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_http_file_cache_lru_insert_head(cache, fcn);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -937,40 +1233,16 @@ ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 static ngx_http_file_cache_node_t *
 ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
+    uint32_t                     n;
     ngx_http_file_cache_node_t  *fcn;
 
-    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
-
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
-
-    while (node != sentinel) {
-
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
-        }
-
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
-        }
-
-        /* node_key == node->key */
-
-        fcn = (ngx_http_file_cache_node_t *) node;
+    for (n = *ngx_http_file_cache_bucket(cache, key); n; n = fcn->next) {
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        fcn = &cache->sh->nodes[n];
 
-        if (rc == 0) {
+        if (ngx_memcmp(key, fcn->key, NGX_HTTP_CACHE_KEY_LEN) == 0) {
             return fcn;
         }
-
-        node = (rc < 0) ? node->left : node->right;
     }
 
     /* not found */
@@ -979,142 +1251,415 @@ ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
 }
 
 
-static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+static uint32_t *
+ngx_http_file_cache_bucket(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
+    uint32_t  hash;
 
-    for ( ;; ) {
-
-        if (node->key < temp->key) {
+    /* the key is md5 already */
 
-            p = &temp->left;
+    ngx_memcpy(&hash, key, sizeof(uint32_t));
 
-        } else if (node->key > temp->key) {
+    return &cache->sh->buckets[hash & cache->sh->mask];
+}
 
-            p = &temp->right;
 
-        } else { /* node->key == temp->key */
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_alloc_node(ngx_http_file_cache_t *cache, u_char *key)
+{
+    uint32_t                     n, *bucket;
+    ngx_http_file_cache_sh_t    *sh;
+    ngx_http_file_cache_node_t  *fcn;
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+    sh = cache->sh;
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
-        }
+    if (sh->free) {
+        n = sh->free;
+        sh->free = sh->nodes[n].next;
 
-        if (*p == sentinel) {
-            break;
-        }
+    } else if (sh->used < sh->nnodes) {
+        n = ++sh->used;
 
-        temp = *p;
+    } else {
+        return NULL;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    sh->count++;
+
+    fcn = &sh->nodes[n];
+
+    ngx_memzero(fcn, sizeof(ngx_http_file_cache_node_t));
+    ngx_memcpy(fcn->key, key, NGX_HTTP_CACHE_KEY_LEN);
+
+    bucket = ngx_http_file_cache_bucket(cache, key);
+
+    fcn->next = *bucket;
+    *bucket = n;
+
+    return fcn;
 }
 
 
 static void
-ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
-    u_char *hash)
+ngx_http_file_cache_free_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+    uint32_t                   n, *p;
+    ngx_http_file_cache_sh_t  *sh;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache vary: \"%*s\"", len, vary);
+    sh = cache->sh;
+    n = ngx_http_file_cache_node_index(sh, fcn);
 
-    ngx_md5_init(&md5);
-    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+    for (p = ngx_http_file_cache_bucket(cache, fcn->key);
+         *p != n;
+         p = &sh->nodes[*p].next)
+    {
+        /* void */
+    }
 
-    ngx_strlow(buf, vary, len);
+    *p = fcn->next;
 
-    p = buf;
-    last = buf + len;
+    ngx_http_file_cache_lru_remove(cache, fcn);
 
-    while (p < last) {
+    if (fcn->segment) {
+        sh->nprotected--;
+    }
 
-        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+    if (sh->heads) {
+        ngx_http_file_cache_head_free_locked(cache, fcn);
+    }
 
-        name.data = p;
+    sh->count--;
 
-        while (p < last && *p != ',' && *p != ' ') { p++; }
+    ngx_memzero(fcn, sizeof(ngx_http_file_cache_node_t));
 
-        name.len = p - name.data;
+    fcn->next = sh->free;
+    sh->free = n;
+}
 
-        if (name.len == 0) {
-            break;
-        }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache vary: %V", &name);
+static void
+ngx_http_file_cache_lru_insert_head(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    uint32_t                   n;
+    ngx_http_file_cache_sh_t  *sh;
 
-        ngx_md5_update(&md5, name.data, name.len);
-        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+    sh = cache->sh;
+    n = ngx_http_file_cache_node_index(sh, fcn);
 
-        ngx_http_file_cache_vary_header(r, &md5, &name);
+    fcn->lru_prev = 0;
+    fcn->lru_next = sh->lru_head[fcn->segment];
 
-        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    if (sh->lru_head[fcn->segment]) {
+        sh->nodes[sh->lru_head[fcn->segment]].lru_prev = n;
+
+    } else {
+        sh->lru_tail[fcn->segment] = n;
     }
 
-    ngx_md5_final(hash, &md5);
+    sh->lru_head[fcn->segment] = n;
 }
 
 
 static void
-ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
-    ngx_str_t *name)
+ngx_http_file_cache_lru_insert_tail(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    size_t            len;
-    u_char           *p, *start, *last;
-    ngx_uint_t        i, multiple, normalize;
-    ngx_list_part_t  *part;
-    ngx_table_elt_t  *header;
+    uint32_t                   n;
+    ngx_http_file_cache_sh_t  *sh;
 
-    multiple = 0;
-    normalize = 0;
+    sh = cache->sh;
+    n = ngx_http_file_cache_node_index(sh, fcn);
 
-    if (name->len == sizeof("Accept-Charset") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
-                           sizeof("Accept-Charset") - 1) == 0)
-    {
-        normalize = 1;
+    fcn->lru_next = 0;
+    fcn->lru_prev = sh->lru_tail[fcn->segment];
 
-    } else if (name->len == sizeof("Accept-Encoding") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
-                           sizeof("Accept-Encoding") - 1) == 0)
-    {
-        normalize = 1;
+    if (sh->lru_tail[fcn->segment]) {
+        sh->nodes[sh->lru_tail[fcn->segment]].lru_next = n;
 
-    } else if (name->len == sizeof("Accept-Language") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
-                           sizeof("Accept-Language") - 1) == 0)
-    {
-        normalize = 1;
+    } else {
+        sh->lru_head[fcn->segment] = n;
     }
 
-    part = &r->headers_in.headers.part;
-    header = part->elts;
+    sh->lru_tail[fcn->segment] = n;
+}
 
-    for (i = 0; /* void */ ; i++) {
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
-            }
+static void
+ngx_http_file_cache_lru_remove(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_sh_t  *sh;
 
-            part = part->next;
-            header = part->elts;
+    sh = cache->sh;
+
+    if (fcn->lru_prev) {
+        sh->nodes[fcn->lru_prev].lru_next = fcn->lru_next;
+
+    } else {
+        sh->lru_head[fcn->segment] = fcn->lru_next;
+    }
+
+    if (fcn->lru_next) {
+        sh->nodes[fcn->lru_next].lru_prev = fcn->lru_prev;
+
+    } else {
+        sh->lru_tail[fcn->segment] = fcn->lru_prev;
+    }
+
+    fcn->lru_prev = 0;
+    fcn->lru_next = 0;
+}
+
+
+static void
+ngx_http_file_cache_promote(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_sh_t    *sh;
+    ngx_http_file_cache_node_t  *tail;
+
+    /* the node is not linked yet, it is inserted by the caller */
+
+    sh = cache->sh;
+
+    fcn->segment = 1;
+    sh->nprotected++;
+
+    /* the protected segment is limited to 80% of the zone */
+
+    while (sh->nprotected > sh->nnodes - sh->nnodes / 5
+           && sh->lru_tail[1])
+    {
+        tail = &sh->nodes[sh->lru_tail[1]];
+
+        ngx_http_file_cache_lru_remove(cache, tail);
+
+        tail->segment = 0;
+        sh->nprotected--;
+
+        /*
+         * the demoted node goes to the head of the probationary segment,
+         * its expire time is refreshed to keep the queue ordered
+         */
+
+        tail->expire = ngx_http_file_cache_rel_time(sh, ngx_time()
+                                                        + cache->inactive);
+
+        ngx_http_file_cache_lru_insert_head(cache, tail);
+    }
+}
+
+
+static void
+ngx_http_file_cache_sketch_add(ngx_http_file_cache_t *cache, u_char *key)
+{
+    u_char                    *p, *last;
+    uint32_t                   hash, width;
+    ngx_uint_t                 i;
+    ngx_http_file_cache_sh_t  *sh;
+
+    sh = cache->sh;
+    width = sh->sketch_mask + 1;
+
+    /* the key is md5, each row uses its own part of it */
+
+    for (i = 0; i < 4; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
+
+        p = &sh->sketch[i * width + (hash & sh->sketch_mask)];
+
+        if (*p != 0xff) {
+            (*p)++;
+        }
+    }
+
+    if (++sh->sketch_adds < 10 * (ngx_uint_t) width) {
+        return;
+    }
+
+    /* halve all counters so old popularity fades out */
+
+    last = sh->sketch + 4 * (size_t) width;
+
+    for (p = sh->sketch; p < last; p++) {
+        *p >>= 1;
+    }
+
+    sh->sketch_adds /= 2;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_sketch_estimate(ngx_http_file_cache_t *cache, u_char *key)
+{
+    uint32_t                   hash, width;
+    ngx_uint_t                 i, min;
+    ngx_http_file_cache_sh_t  *sh;
+
+    sh = cache->sh;
+    width = sh->sketch_mask + 1;
+    min = 0xff;
+
+    for (i = 0; i < 4; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
+
+        min = ngx_min(min, sh->sketch[i * width + (hash & sh->sketch_mask)]);
+    }
+
+    return min;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache, u_char *key)
+{
+    uint32_t                     n;
+    ngx_uint_t                   i, tries;
+    ngx_http_file_cache_sh_t    *sh;
+    ngx_http_file_cache_node_t  *fcn, *victim;
+
+    sh = cache->sh;
+
+    if (sh->sketch == NULL || sh->cold) {
+        return 1;
+    }
+
+    /* admission matters only when something is to be evicted */
+
+    if (sh->size < cache->max_size - cache->max_size / 16
+        && sh->count < sh->nnodes - sh->nnodes / 16)
+    {
+        return 1;
+    }
+
+    victim = NULL;
+
+    for (i = 0; i < 2 && victim == NULL; i++) {
+
+        tries = 20;
+
+        for (n = sh->lru_tail[i]; n && tries; n = fcn->lru_prev, tries--) {
+
+            fcn = &sh->nodes[n];
+
+            if (fcn->exists && fcn->count == 0) {
+                victim = fcn;
+                break;
+            }
+        }
+    }
+
+    if (victim == NULL
+        || ngx_http_file_cache_sketch_estimate(cache, key)
+           > ngx_http_file_cache_sketch_estimate(cache, victim->key))
+    {
+        return 1;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache admission rejected");
+
+    sh->rejected++;
+
+    return 0;
+}
+
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_strlow(buf, vary, len);
+
+    p = buf;
+    last = buf + len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') { p++; }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache vary: %V", &name);
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    }
+
+    ngx_md5_final(hash, &md5);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    normalize = 0;
+
+    if (name->len == sizeof("Accept-Charset") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
+                           sizeof("Accept-Charset") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Encoding") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
+                           sizeof("Accept-Encoding") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Language") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
+                           sizeof("Accept-Language") - 1) == 0)
+    {
+        normalize = 1;
+    }
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
             i = 0;
         }
 
@@ -1198,6 +1743,11 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
+    if (c->mem) {
+        ngx_http_file_cache_mem_free(c);
+    }
+
+    c->head = 0;
     c->secondary = 1;
     c->file.name.len = 0;
     c->body_start = c->buf->end - c->buf->start;
@@ -1379,18 +1929,27 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     c->node->count--;
     c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
+    c->node->body_start = (u_short) c->body_start;
+
+    if (cache->sh->heads) {
+        ngx_http_file_cache_head_free_locked(cache, c->node);
+    }
 
     cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+    c->node->fs_size = (uint32_t) fs_size;
 
     if (rc == NGX_OK) {
         c->node->exists = 1;
     }
 
     c->node->updating = 0;
+    c->node->unchecked = 0;
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (cache->mem_shpool) {
+        ngx_http_file_cache_mem_drop(cache, c->key);
+    }
 }
 
 
@@ -1402,6 +1961,8 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     ngx_file_t                     file;
     ngx_file_info_t                fi;
     ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_head_t    *head;
     ngx_http_file_cache_header_t   h;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -1515,6 +2076,27 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     (void) ngx_write_file(&file, (u_char *) &h,
                           sizeof(ngx_http_file_cache_header_t), 0);
 
+    cache = c->file_cache;
+
+    if (cache->sh->heads) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        head = cache->sh->heads[ngx_http_file_cache_node_index(cache->sh,
+                                                               c->node)];
+
+        if (head && head->uniq == c->uniq) {
+            ngx_memcpy(head->data, &h, sizeof(ngx_http_file_cache_header_t));
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+    /* the copy in memory still has the old header */
+
+    if (c->file_cache->mem_shpool) {
+        ngx_http_file_cache_mem_drop(c->file_cache, c->key);
+    }
+
 done:
 
     if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
@@ -1548,8 +2130,23 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
+    if (c->mem == NULL) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    /*
+     * the header may come from the keys zone, the body file is opened
+     * before the header is sent, so a missing file results in an error
+     * response rather than in a truncated one
+     */
+
+    if (c->head
+        && !(r->method & NGX_HTTP_HEAD)
+        && ngx_http_file_cache_open_body(r, c) != NGX_OK)
+    {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
@@ -1559,12 +2156,27 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return rc;
     }
 
+    b->last_buf = (r == r->main) ? 1: 0;
+    b->last_in_chain = 1;
+
+    if (c->mem) {
+
+        /* the object stays in the memory zone until the request is freed */
+
+        b->pos = c->mem->data + c->body_start;
+        b->last = c->mem->data + c->length;
+        b->memory = (c->length - c->body_start) ? 1: 0;
+
+        out.buf = b;
+        out.next = NULL;
+
+        return ngx_http_output_filter(r, &out);
+    }
+
     b->file_pos = c->body_start;
     b->file_last = c->length;
 
     b->in_file = (c->length - c->body_start) ? 1: 0;
-    b->last_buf = (r == r->main) ? 1: 0;
-    b->last_in_chain = 1;
 
     b->file->fd = c->file.fd;
     b->file->name = c->file.name;
@@ -1605,14 +2217,13 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
         fcn->error = c->error;
 
         if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
+            fcn->valid_sec = ngx_http_file_cache_rel_time(cache->sh,
+                                                          c->valid_sec);
             fcn->valid_msec = c->valid_msec;
         }
 
     } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
+        ngx_http_file_cache_free_node(cache, fcn);
         c->node = NULL;
     }
 
@@ -1668,9 +2279,9 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
     u_char                      *name;
     size_t                       len;
     time_t                       wait;
-    ngx_uint_t                   tries;
+    uint32_t                     n;
+    ngx_uint_t                   i, tries;
     ngx_path_t                  *path;
-    ngx_queue_t                 *q;
     ngx_http_file_cache_node_t  *fcn;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
@@ -1691,32 +2302,35 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    for (q = ngx_queue_last(&cache->sh->queue);
-         q != ngx_queue_sentinel(&cache->sh->queue);
-         q = ngx_queue_prev(q))
-    {
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    /* the probation segment is evicted first */
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+    for (i = 0; i < 2; i++) {
+
+        for (n = cache->sh->lru_tail[i]; n; n = fcn->lru_prev) {
+
+            fcn = &cache->sh->nodes[n];
+
+            ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                   "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
                   fcn->count, fcn->exists,
                   fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
-
-        } else {
-            if (--tries) {
-                continue;
+            if (fcn->count == 0) {
+                ngx_http_file_cache_delete(cache, fcn, name);
+                cache->sh->evicted++;
+                wait = 0;
+                goto done;
             }
 
-            wait = 1;
+            if (--tries == 0) {
+                wait = 1;
+                goto done;
+            }
         }
-
-        break;
     }
 
+done:
+
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
     ngx_free(name);
@@ -1728,11 +2342,11 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 static time_t
 ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 {
-    u_char                      *name, *p;
+    u_char                      *name;
     size_t                       len;
     time_t                       now, wait;
+    uint32_t                     n, m;
     ngx_path_t                  *path;
-    ngx_queue_t                 *q;
     ngx_http_file_cache_node_t  *fcn;
     u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
 
@@ -1760,16 +2374,26 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
             break;
         }
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
+        n = cache->sh->lru_tail[0];
+        m = cache->sh->lru_tail[1];
+
+        if (n == 0 && m == 0) {
             wait = 10;
             break;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        /* the segment tail which becomes inactive first */
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        if (n == 0
+            || (m && (int32_t) (cache->sh->nodes[m].expire
+                                - cache->sh->nodes[n].expire) < 0))
+        {
+            n = m;
+        }
 
-        wait = fcn->expire - now;
+        fcn = &cache->sh->nodes[n];
+
+        wait = ngx_http_file_cache_abs_time(cache->sh, fcn->expire) - now;
 
         if (wait > 0) {
             wait = wait > 10 ? 10 : wait;
@@ -1782,7 +2406,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
                        fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
         if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
+            ngx_http_file_cache_delete(cache, fcn, name);
             continue;
         }
 
@@ -1791,10 +2415,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
             break;
         }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+        (void) ngx_hex_dump(key, fcn->key, NGX_HTTP_CACHE_KEY_LEN);
 
         /*
          * abnormally exited workers may leave locked cache entries,
@@ -1802,9 +2423,10 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
          * we prefer to just move them to the top of the inactive queue
          */
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        ngx_http_file_cache_lru_remove(cache, fcn);
+        fcn->expire = ngx_http_file_cache_rel_time(cache->sh,
+                                               ngx_time() + cache->inactive);
+        ngx_http_file_cache_lru_insert_head(cache, fcn);
 
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                       "ignore long locked inactive cache entry %*s, count:%d",
@@ -1820,27 +2442,25 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
 
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, u_char *name)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
-
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    u_char      *p;
+    size_t       len;
+    ngx_path_t  *path;
 
     if (fcn->exists) {
         cache->sh->size -= fcn->fs_size;
 
         path = cache->path;
         p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
+        p = ngx_hex_dump(p, fcn->key, NGX_HTTP_CACHE_KEY_LEN);
         *p = '\0';
 
+        if (cache->mem_shpool) {
+            ngx_http_file_cache_mem_drop(cache, fcn->key);
+        }
+
         fcn->count++;
         fcn->deleting = 1;
         ngx_shmtx_unlock(&cache->shpool->mutex);
@@ -1862,9 +2482,7 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
     }
 
     if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
+        ngx_http_file_cache_free_node(cache, fcn);
     }
 }
 
@@ -1875,10 +2493,30 @@ ngx_http_file_cache_manager(void *data)
     ngx_http_file_cache_t  *cache = data;
 
     off_t   size;
-    time_t  next, wait;
+    time_t  next, wait, now;
 
     next = ngx_http_file_cache_expire(cache);
 
+    if (cache->index_interval && !cache->sh->cold) {
+        now = ngx_time();
+
+        if (cache->index_next == 0) {
+            cache->index_next = now + cache->index_interval;
+
+        } else if (now >= cache->index_next) {
+            ngx_http_file_cache_index_write(cache);
+
+            now = ngx_time();
+            cache->index_next = now + cache->index_interval;
+        }
+
+        wait = cache->index_next - now;
+
+        if (wait < next) {
+            next = wait;
+        }
+    }
+
     cache->last = ngx_current_msec;
     cache->files = 0;
 
@@ -1916,7 +2554,7 @@ ngx_http_file_cache_loader(void *data)
 
     ngx_tree_ctx_t  tree;
 
-    if (!cache->sh->cold || cache->sh->loading) {
+    if ((!cache->sh->cold && !cache->sh->indexed) || cache->sh->loading) {
         return;
     }
 
@@ -1944,6 +2582,11 @@ ngx_http_file_cache_loader(void *data)
         return;
     }
 
+    if (cache->sh->indexed) {
+        ngx_http_file_cache_index_sweep(cache);
+        cache->sh->indexed = 0;
+    }
+
     cache->sh->cold = 0;
     cache->sh->loading = 0;
 
@@ -1970,155 +2613,1111 @@ ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 
     cache = ctx->data;
 
+    if (cache->index_name.len
+        && path->len >= cache->index_name.len
+        && ngx_strncmp(path->data, cache->index_name.data,
+                       cache->index_name.len)
+           == 0)
+    {
+        return NGX_OK;
+    }
+
     if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
         (void) ngx_http_file_cache_delete_file(ctx, path);
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
+    }
+
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
+
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
+
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
+    }
+
+    return ngx_http_file_cache_add(cache, &c);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+    if (fcn == NULL) {
+
+        fcn = ngx_http_file_cache_alloc_node(cache, c->key);
+        if (fcn == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = (uint32_t) c->fs_size;
+
+        cache->sh->size += c->fs_size;
+
+    } else if (fcn->unchecked) {
+
+        /* the node is loaded from the index, keep its place in the queue */
+
+        fcn->unchecked = 0;
+
+        if (fcn->fs_size != c->fs_size) {
+
+            /* the file was replaced after the index was written */
+
+            fcn->uniq = 0;
+            fcn->body_start = 0;
+
+            if (cache->sh->heads) {
+                ngx_http_file_cache_head_free_locked(cache, fcn);
+            }
+
+            cache->sh->size += c->fs_size - fcn->fs_size;
+            fcn->fs_size = (uint32_t) c->fs_size;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        return NGX_OK;
+
+    } else {
+        ngx_http_file_cache_lru_remove(cache, fcn);
+    }
+
+    fcn->expire = ngx_http_file_cache_rel_time(cache->sh,
+                                               ngx_time() + cache->inactive);
+
+    ngx_http_file_cache_lru_insert_head(cache, fcn);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
+
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache, ngx_log_t *log)
+{
+    off_t                                offset;
+    time_t                               shift, range;
+    uint32_t                            *buckets, next;
+    ngx_uint_t                           i, k, n, b;
+    ngx_file_t                           file;
+    ngx_file_info_t                      fi;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_index_node_t    *in;
+    ngx_http_file_cache_index_header_t   h;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->index_name;
+    file.log = log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", file.name.data);
+        }
+
+        return;
+    }
+
+    in = NULL;
+    buckets = NULL;
+
+    if (ngx_read_file(&file, (u_char *) &h, sizeof(h), 0) != sizeof(h)) {
+        goto invalid;
+    }
+
+    if (h.version != NGX_HTTP_CACHE_INDEX_VERSION || h.bsize != cache->bsize) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "cache index \"%s\" is outdated", file.name.data);
+        goto done;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    if (ngx_file_size(&fi) != (off_t) (sizeof(h) + h.nodes * sizeof(*in))) {
+        goto invalid;
+    }
+
+    in = ngx_alloc(NGX_HTTP_CACHE_INDEX_BATCH * sizeof(*in), log);
+    if (in == NULL) {
+        goto done;
+    }
+
+    buckets = ngx_calloc(NGX_HTTP_CACHE_INDEX_BUCKETS * sizeof(uint32_t), log);
+    if (buckets == NULL) {
+        goto done;
+    }
+
+    /* the time nginx was not running does not count as inactivity */
+
+    shift = ngx_time() - h.time;
+
+    if (shift < 0) {
+        shift = 0;
+    }
+
+    range = h.max_expire - h.min_expire + 1;
+
+    if (range < 1) {
+        range = 1;
+    }
+
+    offset = sizeof(h);
+
+    /*
+     * the nodes are first chained through lru_next in buckets sorted
+     * by the expiration time, so the LRU order is restored
+     */
+
+    cache->sh->indexed = 1;
+
+    for (k = 0; k < h.nodes; k += n) {
+
+        n = ngx_min(h.nodes - k, NGX_HTTP_CACHE_INDEX_BATCH);
+
+        if (ngx_read_file(&file, (u_char *) in, n * sizeof(*in), offset)
+            != (ssize_t) (n * sizeof(*in)))
+        {
+            break;
+        }
+
+        offset += n * sizeof(*in);
+
+        for (i = 0; i < n; i++) {
+
+            fcn = ngx_http_file_cache_alloc_node(cache, in[i].key);
+            if (fcn == NULL) {
+                ngx_log_error(NGX_LOG_WARN, log, 0,
+                              "cache index \"%s\" is loaded partially, "
+                              "the keys zone is too small", file.name.data);
+                goto queue;
+            }
+
+            fcn->uses = in[i].uses;
+            fcn->exists = 1;
+            fcn->unchecked = 1;
+            fcn->uniq = in[i].uniq;
+            fcn->expire = ngx_http_file_cache_rel_time(cache->sh,
+                                                       in[i].expire + shift);
+            fcn->valid_sec = ngx_http_file_cache_rel_time(cache->sh,
+                                                          in[i].valid_sec);
+            fcn->body_start = (u_short) in[i].body_start;
+            fcn->fs_size = (uint32_t) in[i].fs_size;
+
+            cache->sh->size += fcn->fs_size;
+
+            b = (ngx_uint_t) ((in[i].expire - h.min_expire)
+                              * NGX_HTTP_CACHE_INDEX_BUCKETS / range);
+
+            if (b >= NGX_HTTP_CACHE_INDEX_BUCKETS) {
+                b = NGX_HTTP_CACHE_INDEX_BUCKETS - 1;
+            }
+
+            fcn->lru_next = buckets[b];
+            buckets[b] = ngx_http_file_cache_node_index(cache->sh, fcn);
+        }
+    }
+
+    if (k == h.nodes) {
+
+        /* lookups may trust the keys zone, the loader verifies it */
+
+        cache->sh->cold = 0;
+    }
+
+queue:
+
+    for (b = NGX_HTTP_CACHE_INDEX_BUCKETS; b--; /* void */) {
+        while (buckets[b]) {
+            fcn = &cache->sh->nodes[buckets[b]];
+            next = fcn->lru_next;
+
+            ngx_http_file_cache_lru_insert_tail(cache, fcn);
+
+            buckets[b] = next;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "http file cache: %V %.3fM, %ui nodes from index",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  k);
+
+    goto done;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_CRIT, log, 0,
+                  "cache index \"%s\" is invalid", file.name.data);
+
+done:
+
+    if (in) {
+        ngx_free(in);
+    }
+
+    if (buckets) {
+        ngx_free(buckets);
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+static void
+ngx_http_file_cache_index_write(ngx_http_file_cache_t *cache)
+{
+    off_t                                offset;
+    time_t                               expire;
+    size_t                               size;
+    uint32_t                             i;
+    ngx_uint_t                           n, done;
+    ngx_file_t                           file;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_index_node_t    *in;
+    ngx_http_file_cache_index_header_t   h;
+
+    in = ngx_alloc(NGX_HTTP_CACHE_INDEX_BATCH * sizeof(*in), ngx_cycle->log);
+    if (in == NULL) {
+        return;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->index_temp;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                            NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        ngx_free(in);
+        return;
+    }
+
+    ngx_memzero(&h, sizeof(h));
+
+    h.version = NGX_HTTP_CACHE_INDEX_VERSION;
+    h.bsize = cache->bsize;
+    h.time = ngx_time();
+
+    offset = sizeof(h);
+
+    /* the nodes are copied in batches, so the keys zone is not locked long */
+
+    for (i = 1; /* void */; /* void */) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        for (n = 0;
+             i <= cache->sh->used && n < NGX_HTTP_CACHE_INDEX_BATCH;
+             i++)
+        {
+            fcn = &cache->sh->nodes[i];
+
+            if (!fcn->exists || fcn->deleting) {
+                continue;
+            }
+
+            expire = ngx_http_file_cache_abs_time(cache->sh, fcn->expire);
+
+            ngx_memcpy(in[n].key, fcn->key, NGX_HTTP_CACHE_KEY_LEN);
+            in[n].uniq = fcn->uniq;
+            in[n].expire = expire;
+            in[n].valid_sec = ngx_http_file_cache_abs_time(cache->sh,
+                                                           fcn->valid_sec);
+            in[n].body_start = fcn->body_start;
+            in[n].fs_size = fcn->fs_size;
+            in[n].uses = fcn->uses;
+
+            if (h.nodes + n == 0 || expire < h.min_expire) {
+                h.min_expire = expire;
+            }
+
+            if (expire > h.max_expire) {
+                h.max_expire = expire;
+            }
+
+            n++;
+        }
+
+        done = (i > cache->sh->used);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (n) {
+            size = n * sizeof(*in);
+
+            if (ngx_write_file(&file, (u_char *) in, size, offset)
+                != (ssize_t) size)
+            {
+                goto failed;
+            }
+
+            offset += size;
+            h.nodes += n;
+        }
+
+        if (done) {
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            goto failed;
+        }
+    }
+
+    if (ngx_write_file(&file, (u_char *) &h, sizeof(h), 0) != sizeof(h)) {
+        goto failed;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    ngx_free(in);
+
+    if (ngx_rename_file(cache->index_temp.data, cache->index_name.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      cache->index_temp.data, cache->index_name.data);
+
+        (void) ngx_delete_file(cache->index_temp.data);
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index: %ui nodes, %O bytes",
+                   h.nodes, offset);
+
+    return;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    ngx_free(in);
+
+    (void) ngx_delete_file(cache->index_temp.data);
+}
+
+
+static void
+ngx_http_file_cache_index_sweep(ngx_http_file_cache_t *cache)
+{
+    uint32_t                     i;
+    ngx_uint_t                   k, n, done;
+    ngx_http_file_cache_node_t  *fcn;
+
+    /* remove the nodes loaded from the index if the loader missed their files */
+
+    n = 0;
+
+    for (i = 1; /* void */; /* void */) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        for (k = 0;
+             i <= cache->sh->used && k < NGX_HTTP_CACHE_INDEX_BATCH;
+             i++, k++)
+        {
+            fcn = &cache->sh->nodes[i];
+
+            if (fcn->unchecked && fcn->count == 0) {
+                cache->sh->size -= fcn->fs_size;
+
+                ngx_http_file_cache_free_node(cache, fcn);
+
+                n++;
+            }
+        }
+
+        done = (i > cache->sh->used);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (done) {
+            break;
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index sweep: %ui nodes", n);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_mem_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_file_cache_t  *ocache = data;
+
+    size_t                  len;
+    ngx_http_file_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->mem_sh = ocache->mem_sh;
+        cache->mem_shpool = ocache->mem_shpool;
+
+        return NGX_OK;
+    }
+
+    cache->mem_shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->mem_sh = cache->mem_shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->mem_sh = ngx_slab_alloc(cache->mem_shpool,
+                                   sizeof(ngx_http_file_cache_mem_sh_t));
+    if (cache->mem_sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->mem_shpool->data = cache->mem_sh;
+
+    ngx_rbtree_init(&cache->mem_sh->rbtree, &cache->mem_sh->sentinel,
+                    ngx_http_file_cache_mem_insert_value);
+
+    ngx_queue_init(&cache->mem_sh->queue);
+
+    len = sizeof(" in cache memory zone \"\"") + shm_zone->shm.name.len;
+
+    cache->mem_shpool->log_ctx = ngx_slab_alloc(cache->mem_shpool, len);
+    if (cache->mem_shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->mem_shpool->log_ctx, " in cache memory zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->mem_shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_mem_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    size_t                           n;
+    ngx_pool_cleanup_t              *cln;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_mem_node_t  *mn;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->mem_shpool->mutex);
+
+    mn = ngx_http_file_cache_mem_lookup(cache, c->key);
+
+    if (mn == NULL) {
+        ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    if (mn->uniq != c->uniq) {
+
+        /* the cache file was replaced after the object was stored */
+
+        ngx_http_file_cache_mem_delete_locked(cache, mn);
+
+        ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    mn->count++;
+
+    ngx_queue_remove(&mn->queue);
+    ngx_queue_insert_head(&cache->mem_sh->queue, &mn->queue);
+
+    ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+
+    c->mem = mn;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        ngx_http_file_cache_mem_free(c);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_file_cache_mem_cleanup;
+    cln->data = c;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory: %uz", mn->len);
+
+    c->length = mn->len;
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = ngx_min(mn->len, c->body_start);
+
+    ngx_memcpy(c->buf->pos, mn->data, n);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_mem_add(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_mem_node_t  *mn, *dup;
+
+    /* the object is stored only if it was read whole on open */
+
+    if ((off_t) (c->buf->last - c->buf->pos) < c->length) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->mem_shpool->mutex);
+
+    mn = ngx_http_file_cache_mem_lookup(cache, c->key);
+
+    if (mn) {
+        if (mn->uniq == c->uniq) {
+            ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+            return;
+        }
+
+        ngx_http_file_cache_mem_delete_locked(cache, mn);
+    }
+
+    mn = ngx_http_file_cache_mem_alloc_locked(cache,
+                      offsetof(ngx_http_file_cache_mem_node_t, data)
+                      + (size_t) c->length);
+
+    ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+
+    if (mn == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache memory full");
+        return;
+    }
+
+    ngx_memcpy(mn->data, c->buf->pos, (size_t) c->length);
+
+    ngx_memcpy((u_char *) &mn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(mn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    mn->count = 0;
+    mn->deleted = 0;
+    mn->uniq = c->uniq;
+    mn->len = (size_t) c->length;
+
+    ngx_shmtx_lock(&cache->mem_shpool->mutex);
+
+    dup = ngx_http_file_cache_mem_lookup(cache, c->key);
+
+    if (dup) {
+
+        /* another worker has stored the object meanwhile */
+
+        ngx_slab_free_locked(cache->mem_shpool, mn);
+
+    } else {
+        ngx_rbtree_insert(&cache->mem_sh->rbtree, &mn->node);
+        ngx_queue_insert_head(&cache->mem_sh->queue, &mn->queue);
+    }
+
+    ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory store: %uz d:%d",
+                   mn->len, dup ? 1 : 0);
+}
+
+
+static ngx_http_file_cache_mem_node_t *
+ngx_http_file_cache_mem_alloc_locked(ngx_http_file_cache_t *cache,
+    size_t size)
+{
+    ngx_uint_t                       tries;
+    ngx_queue_t                     *q;
+    ngx_http_file_cache_mem_node_t  *mn;
+
+    for (tries = 0; tries < 64; tries++) {
+
+        mn = ngx_slab_alloc_locked(cache->mem_shpool, size);
+        if (mn) {
+            return mn;
+        }
+
+        /* evict the least recently used object that is not being sent */
+
+        for (q = ngx_queue_last(&cache->mem_sh->queue);
+             q != ngx_queue_sentinel(&cache->mem_sh->queue);
+             q = ngx_queue_prev(q))
+        {
+            mn = ngx_queue_data(q, ngx_http_file_cache_mem_node_t, queue);
+
+            if (mn->count == 0) {
+                break;
+            }
+        }
+
+        if (q == ngx_queue_sentinel(&cache->mem_sh->queue)) {
+            return NULL;
+        }
+
+        ngx_http_file_cache_mem_delete_locked(cache, mn);
+    }
+
+    return NULL;
+}
+
+
+static ngx_http_file_cache_mem_node_t *
+ngx_http_file_cache_mem_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                        rc;
+    ngx_rbtree_key_t                 node_key;
+    ngx_rbtree_node_t               *node, *sentinel;
+    ngx_http_file_cache_mem_node_t  *mn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->mem_sh->rbtree.root;
+    sentinel = cache->mem_sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        mn = (ngx_http_file_cache_mem_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], mn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return mn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_mem_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t               **p;
+    ngx_http_file_cache_mem_node_t   *mn, *mnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            mn = (ngx_http_file_cache_mem_node_t *) node;
+            mnt = (ngx_http_file_cache_mem_node_t *) temp;
+
+            p = (ngx_memcmp(mn->key, mnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
 
-    } else {
-        ngx_time_update();
+static void
+ngx_http_file_cache_mem_drop(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_http_file_cache_mem_node_t  *mn;
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_shmtx_lock(&cache->mem_shpool->mutex);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    mn = ngx_http_file_cache_mem_lookup(cache, key);
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
-        }
+    if (mn) {
+        ngx_http_file_cache_mem_delete_locked(cache, mn);
     }
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+    ngx_shmtx_unlock(&cache->mem_shpool->mutex);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static void
+ngx_http_file_cache_mem_delete_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_mem_node_t *mn)
 {
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
+    ngx_rbtree_delete(&cache->mem_sh->rbtree, &mn->node);
+    ngx_queue_remove(&mn->queue);
+
+    if (mn->count) {
+
+        /* the object is freed by the last request that sends it */
+
+        mn->deleted = 1;
+        return;
     }
 
-    return NGX_OK;
+    ngx_slab_free_locked(cache->mem_shpool, mn);
 }
 
 
 static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_mem_free(ngx_http_cache_t *c)
 {
-    ngx_msleep(cache->loader_sleep);
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_mem_node_t  *mn;
 
-    ngx_time_update();
+    cache = c->file_cache;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    mn = c->mem;
+    c->mem = NULL;
+
+    ngx_shmtx_lock(&cache->mem_shpool->mutex);
+
+    if (--mn->count == 0 && mn->deleted) {
+        ngx_slab_free_locked(cache->mem_shpool, mn);
+    }
+
+    ngx_shmtx_unlock(&cache->mem_shpool->mutex);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+static void
+ngx_http_file_cache_mem_cleanup(void *data)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    ngx_http_cache_t  *c = data;
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
+    if (c->mem) {
+        ngx_http_file_cache_mem_free(c);
     }
+}
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
+
+static ngx_int_t
+ngx_http_file_cache_head_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_head_t  *head;
+
+    cache = c->file_cache;
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    head = cache->sh->heads[ngx_http_file_cache_node_index(cache->sh,
+                                                           c->node)];
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+    if (head == NULL || head->uniq != c->uniq || head->len > c->body_start) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+    /* the header is small, it is copied under the lock */
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
-        }
+    c->buf->last = ngx_cpymem(c->buf->pos, head->data, head->len);
+    c->length = head->length;
 
-        p += 2;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        c.key[i] = (u_char) n;
-    }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache header: %uz", c->buf->last - c->buf->pos);
 
-    return ngx_http_file_cache_add(cache, &c);
+    c->head = 1;
+
+    return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_head_add(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_node_t  *fcn;
+    size_t                        len;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_head_t   *head, **p;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
-
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+    cache = c->file_cache;
 
-    if (fcn == NULL) {
+    len = c->body_start;
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
-        }
+    if ((size_t) (c->buf->last - c->buf->pos) < len) {
+        return;
+    }
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    p = &cache->sh->heads[ngx_http_file_cache_node_index(cache->sh, c->node)];
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    if ((*p && (*p)->uniq == c->uniq) || c->node->uniq != c->uniq) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+    head = ngx_slab_alloc_locked(cache->shpool,
+                      offsetof(ngx_http_file_cache_head_t, data) + len);
 
-        cache->sh->size += c->fs_size;
+    if (head == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
+    if (*p) {
+        ngx_slab_free_locked(cache->shpool, *p);
     }
 
-    fcn->expire = ngx_time() + cache->inactive;
+    head->uniq = c->uniq;
+    head->length = c->length;
+    head->len = len;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_memcpy(head->data, c->buf->pos, len);
+
+    *p = head;
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    return NGX_OK;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache header store: %uz", len);
+}
+
+
+static void
+ngx_http_file_cache_head_free_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_head_t  **p;
+
+    p = &cache->sh->heads[ngx_http_file_cache_node_index(cache->sh, fcn)];
+
+    if (*p) {
+        ngx_slab_free_locked(cache->shpool, *p);
+        *p = NULL;
+    }
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+ngx_http_file_cache_open_body(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    ngx_open_file_info_t       of;
+    ngx_http_file_cache_t     *cache;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+    /* the header was taken from the keys zone, the body is in the file */
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.uniq = c->uniq;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.events = clcf->open_file_cache_events;
+    of.directio = NGX_OPEN_FILE_DIRECTIO_OFF;
+    of.read_ahead = clcf->read_ahead;
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &c->file.name, &of, r->pool)
+        != NGX_OK)
+    {
+        if (of.err) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, of.err,
+                          ngx_open_file_n " \"%s\" failed", c->file.name.data);
+        }
+
+        goto failed;
+    }
+
+    if (of.uniq != c->uniq || of.size != c->length) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache file \"%s\" does not match its header",
+                      c->file.name.data);
+        goto failed;
     }
 
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache body fd: %d", of.fd);
+
+    c->file.fd = of.fd;
+    c->file.log = r->connection->log;
+    c->head = 0;
+
     return NGX_OK;
+
+failed:
+
+    /* the header copy is stale, the next request reads the file */
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (c->node->uniq == c->uniq) {
+        ngx_http_file_cache_head_free_locked(cache, c->node);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_ERROR;
 }
 
 
@@ -2157,9 +3756,10 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     u_char                 *last, *p;
     time_t                  inactive;
     size_t                  len;
-    ssize_t                 size;
-    ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files;
+    ssize_t                 size, msize, hsize, max_object;
+    ngx_str_t               s, name, mname, *value;
+    ngx_int_t               loader_files, min_uses;
+    time_t                  index_interval;
     ngx_msec_t              loader_sleep, loader_threshold;
     ngx_uint_t              i, n, use_temp_path;
     ngx_array_t            *caches;
@@ -2186,6 +3786,12 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
 
+    index_interval = 0;
+
+    msize = 0;
+    min_uses = 2;
+    max_object = 64 * 1024;
+
     value = cf->args->elts;
 
     cache->path->name = value[1];
@@ -2256,6 +3862,29 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "policy=", 7) == 0) {
+
+            if (ngx_strcmp(&value[i].data[7], "lru") == 0) {
+                cache->policy = NGX_HTTP_CACHE_POLICY_LRU;
+
+            } else if (ngx_strcmp(&value[i].data[7], "slru") == 0) {
+                cache->policy = NGX_HTTP_CACHE_POLICY_SLRU;
+
+            } else if (ngx_strcmp(&value[i].data[7], "tinylfu") == 0) {
+                cache->policy = NGX_HTTP_CACHE_POLICY_TINYLFU;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid policy value \"%V\", "
+                                   "it must be \"lru\", \"slru\" "
+                                   "or \"tinylfu\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
 
             name.data = value[i].data + 10;
@@ -2353,6 +3982,81 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "index_interval=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            index_interval = ngx_parse_time(&s, 1);
+            if (index_interval == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid index_interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "headers=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            hsize = ngx_parse_size(&s);
+            if (hsize == NGX_ERROR || hsize == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid headers size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            cache->headers = (size_t) hsize;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            msize = ngx_parse_size(&s);
+            if (msize > 8191) {
+                continue;
+            }
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid memory zone size \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_min_uses=", 16) == 0) {
+
+            min_uses = ngx_atoi(value[i].data + 16, value[i].len - 16);
+            if (min_uses == NGX_ERROR || min_uses == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_min_uses value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_max_object=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            max_object = ngx_parse_size(&s);
+            if (max_object == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_max_object value \"%V\"",
+                           &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -2409,6 +4113,29 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
     }
 
+    if (index_interval) {
+        len = cache->path->name.len + sizeof("/index") - 1;
+
+        p = ngx_pnalloc(cf->pool, 2 * (len + sizeof(".tmp")));
+        if (p == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        cache->index_name.len = len;
+        cache->index_name.data = p;
+
+        p = ngx_cpymem(p, cache->path->name.data, cache->path->name.len);
+        p = ngx_cpymem(p, "/index", sizeof("/index"));
+
+        cache->index_temp.len = len + sizeof(".tmp") - 1;
+        cache->index_temp.data = p;
+
+        p = ngx_cpymem(p, cache->index_name.data, len);
+        ngx_memcpy(p, ".tmp", sizeof(".tmp"));
+
+        cache->index_interval = index_interval;
+    }
+
     cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
@@ -2427,6 +4154,35 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->inactive = inactive;
     cache->max_size = max_size;
 
+    if (msize) {
+        mname.len = name.len + sizeof("_memory") - 1;
+
+        mname.data = ngx_pnalloc(cf->pool, mname.len);
+        if (mname.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memcpy(ngx_cpymem(mname.data, name.data, name.len),
+                   "_memory", sizeof("_memory") - 1);
+
+        cache->mem_zone = ngx_shared_memory_add(cf, &mname, msize, cmd->post);
+        if (cache->mem_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (cache->mem_zone->data) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate zone \"%V\"", &mname);
+            return NGX_CONF_ERROR;
+        }
+
+        cache->mem_zone->init = ngx_http_file_cache_mem_init;
+        cache->mem_zone->data = cache;
+
+        cache->mem_min_uses = min_uses;
+        cache->mem_max_object = max_object;
+    }
+
     caches = (ngx_array_t *) (confp + cmd->offset);
 
     ce = ngx_array_push(caches);
@@ -508,6 +508,8 @@ struct ngx_http_request_s {
 
     unsigned                          pipeline:1;
     unsigned                          chunked:1;
+    unsigned                          chunked_passthrough:1;
+    unsigned                          body_transformed:1;
     unsigned                          header_only:1;
     unsigned                          keepalive:1;
     unsigned                          lingering_close:1;
@@ -10,6 +10,94 @@
 #include <ngx_http.h>
 
 
+struct ngx_http_upstream_hedge_s {
+    ngx_peer_connection_t            peer;
+    ngx_event_t                      timer;
+    ngx_http_upstream_state_t        state;
+    ngx_chain_t                     *out;
+
+    /* the balancer of the hedged request, and the peer already in use */
+    ngx_event_get_peer_pt            get;
+    void                            *data;
+    struct sockaddr                 *sockaddr;
+    socklen_t                        socklen;
+
+    unsigned                         connected:1;
+};
+
+
+struct ngx_http_upstream_waiter_s {
+    ngx_queue_t                      queue;
+    ngx_event_t                      event;
+    ngx_http_upstream_queue_t       *waiting;
+
+    ngx_msec_t                       start;
+    ngx_msec_t                       deadline;
+    ngx_msec_t                       time;
+
+    unsigned                         queued:1;
+};
+
+
+/* a waiter is woken up at least this often, in milliseconds */
+
+#define NGX_HTTP_UPSTREAM_QUEUE_RETRY  100
+
+
+struct ngx_http_upstream_collapse_s {
+    ngx_str_node_t                   sn;
+    ngx_pool_t                      *pool;
+    ngx_uint_t                       refs;
+    ngx_queue_t                      followers;
+
+    ngx_uint_t                       status;
+    ngx_str_t                        status_line;
+    ngx_str_t                        peer;
+    ngx_array_t                      headers;
+
+    ngx_chain_t                     *body;
+    ngx_chain_t                    **last;
+    size_t                           size;
+    size_t                           max_size;
+
+    unsigned                         linked:1;
+    unsigned                         header:1;
+    unsigned                         done:1;
+    unsigned                         overflow:1;
+};
+
+
+struct ngx_http_upstream_follower_s {
+    ngx_queue_t                      queue;
+    ngx_event_t                      event;
+
+    unsigned                         waiting:1;
+};
+
+
+#if (NGX_HAVE_SPLICE)
+
+typedef struct {
+    ngx_fd_t                         fd[2];
+    size_t                           size;
+} ngx_http_upstream_splice_pipe_t;
+
+
+struct ngx_http_upstream_splice_s {
+    ngx_http_upstream_splice_pipe_t  pipe[2];   /* from client, from upstream */
+    size_t                           capacity;
+    ngx_log_t                       *log;
+};
+
+#endif
+
+
+/* the requests in flight that may be joined, per worker */
+
+static ngx_rbtree_t              ngx_http_upstream_collapse_tree;
+static ngx_rbtree_node_t         ngx_http_upstream_collapse_sentinel;
+
+
 #if (NGX_HTTP_CACHE)
 static ngx_int_t ngx_http_upstream_cache(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
@@ -23,9 +111,13 @@ static ngx_int_t ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_stat(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 #endif
 
 static void ngx_http_upstream_init_request(ngx_http_request_t *r);
+static void ngx_http_upstream_start(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static void ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx);
 static void ngx_http_upstream_rd_check_broken_connection(ngx_http_request_t *r);
 static void ngx_http_upstream_wr_check_broken_connection(ngx_http_request_t *r);
@@ -55,6 +147,8 @@ static void ngx_http_upstream_process_body_in_memory(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_send_response(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_pin_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static void ngx_http_upstream_upgrade(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_upgraded_read_downstream(ngx_http_request_t *r);
@@ -65,6 +159,13 @@ static void ngx_http_upstream_upgraded_write_upstream(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_http_upstream_splice_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_process_spliced(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t from_upstream, ngx_uint_t do_write);
+static void ngx_http_upstream_splice_cleanup(void *data);
+#endif
 static void
     ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r);
 static void
@@ -81,12 +182,59 @@ static void ngx_http_upstream_process_upstream(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_process_request(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+#if (NGX_HAVE_FILE_AIO)
+static void ngx_http_upstream_aio_handler(ngx_event_pipe_t *p,
+    ngx_file_t *file);
+static void ngx_http_upstream_aio_event_handler(ngx_event_t *ev);
+#endif
 static void ngx_http_upstream_store(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_dummy_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_next(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_uint_t ft_type);
+static void ngx_http_upstream_hedge_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_hedge_connect(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_hedge_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_hedge_write_handler(ngx_event_t *wev);
+static void ngx_http_upstream_hedge_send(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_hedge_switch(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_cancel(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t state);
+static void ngx_http_upstream_hedge_sample(ngx_http_upstream_hedge_conf_t *hcf,
+    ngx_msec_t ms);
+static ngx_uint_t ngx_http_upstream_hedge_bucket(ngx_msec_t ms);
+static void ngx_http_upstream_close_peer_connection(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_queue_add(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_queue_handler(ngx_event_t *ev);
+static void ngx_http_upstream_queue_retry_handler(ngx_event_t *ev);
+static void ngx_http_upstream_queue_remove(ngx_http_upstream_waiter_t *w);
+static void ngx_http_upstream_queue_cancel(ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_collapse(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_uint_t ngx_http_upstream_collapse_private(ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_collapse_filter(void *data,
+    ngx_chain_t *in);
+static void ngx_http_upstream_collapse_capture(ngx_http_upstream_t *u,
+    ngx_chain_t *in);
+static void ngx_http_upstream_collapse_done(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_int_t rc);
+static void ngx_http_upstream_collapse_wake(
+    ngx_http_upstream_collapse_t *col);
+static void ngx_http_upstream_collapse_handler(ngx_event_t *ev);
+static void ngx_http_upstream_collapse_send(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_release(void *data);
 static void ngx_http_upstream_cleanup(void *data);
 static void ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_int_t rc);
@@ -151,18 +299,25 @@ static ngx_int_t ngx_http_upstream_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_response_time_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_queue_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_queue_stat_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_response_length_variable(
     ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 
 static char *ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static char *ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_queue(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
-static ngx_addr_t *ngx_http_upstream_get_local(ngx_http_request_t *r,
-    ngx_http_upstream_local_t *local);
+static void ngx_http_upstream_set_local(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_http_upstream_local_t *local);
 
 static void *ngx_http_upstream_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf);
+static ngx_int_t ngx_http_upstream_init_process(ngx_cycle_t *cycle);
 
 #if (NGX_HTTP_SSL)
 static void ngx_http_upstream_ssl_init_connection(ngx_http_request_t *,
@@ -318,6 +473,13 @@ static ngx_command_t  ngx_http_upstream_commands[] = {
       0,
       NULL },
 
+    { ngx_string("queue"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_queue,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -344,7 +506,7 @@ ngx_module_t  ngx_http_upstream_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_init_process,        /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -375,6 +537,35 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_response_length_variable, 0,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("upstream_queue_time"), NULL,
+      ngx_http_upstream_queue_time_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_queue_length"), NULL,
+      ngx_http_upstream_queue_stat_variable,
+      offsetof(ngx_http_upstream_queue_t, length),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_queue_queued"), NULL,
+      ngx_http_upstream_queue_stat_variable,
+      offsetof(ngx_http_upstream_queue_t, queued),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_queue_rejected"), NULL,
+      ngx_http_upstream_queue_stat_variable,
+      offsetof(ngx_http_upstream_queue_t, rejected),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_queue_timedout"), NULL,
+      ngx_http_upstream_queue_stat_variable,
+      offsetof(ngx_http_upstream_queue_t, timedout),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_queue_wait_time"), NULL,
+      ngx_http_upstream_queue_stat_variable,
+      offsetof(ngx_http_upstream_queue_t, wait_time),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
 #if (NGX_HTTP_CACHE)
 
     { ngx_string("upstream_cache_status"), NULL,
@@ -389,6 +580,26 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_cache_etag, 0,
       NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
 
+    { ngx_string("upstream_cache_hits"), NULL,
+      ngx_http_upstream_cache_stat,
+      offsetof(ngx_http_file_cache_sh_t, hits),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_misses"), NULL,
+      ngx_http_upstream_cache_stat,
+      offsetof(ngx_http_file_cache_sh_t, misses),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_rejected"), NULL,
+      ngx_http_upstream_cache_stat,
+      offsetof(ngx_http_file_cache_sh_t, rejected),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_evicted"), NULL,
+      ngx_http_upstream_cache_stat,
+      offsetof(ngx_http_file_cache_sh_t, evicted),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
 #endif
 
     { ngx_null_string, NULL, NULL, 0, 0, 0 }
@@ -501,14 +712,9 @@ ngx_http_upstream_init(ngx_http_request_t *r)
 static void
 ngx_http_upstream_init_request(ngx_http_request_t *r)
 {
-    ngx_str_t                      *host;
-    ngx_uint_t                      i;
-    ngx_resolver_ctx_t             *ctx, temp;
-    ngx_http_cleanup_t             *cln;
-    ngx_http_upstream_t            *u;
-    ngx_http_core_loc_conf_t       *clcf;
-    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
-    ngx_http_upstream_main_conf_t  *umcf;
+    ngx_http_cleanup_t        *cln;
+    ngx_http_upstream_t       *u;
+    ngx_http_core_loc_conf_t  *clcf;
 
     if (r->aio) {
         return;
@@ -563,7 +769,7 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
         return;
     }
 
-    u->peer.local = ngx_http_upstream_get_local(r, u->conf->local);
+    ngx_http_upstream_set_local(r, u, u->conf->local);
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
@@ -610,6 +816,37 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
     cln->data = r;
     u->cleanup = &cln->handler;
 
+    if (u->conf->collapse) {
+
+        switch (ngx_http_upstream_collapse(r, u)) {
+
+        case NGX_ERROR:
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+
+        case NGX_DONE:
+            return;
+
+        default: /* NGX_OK */
+            break;
+        }
+    }
+
+    ngx_http_upstream_start(r, u);
+}
+
+
+static void
+ngx_http_upstream_start(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_str_t                      *host;
+    ngx_uint_t                      i;
+    ngx_resolver_ctx_t             *ctx, temp;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
     if (u->resolved == NULL) {
 
         uscf = u->conf->upstream;
@@ -664,6 +901,8 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
 
         temp.name = *host;
 
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
         ctx = ngx_resolve_start(clcf->resolver, &temp);
         if (ctx == NULL) {
             ngx_http_upstream_finalize_request(r, u,
@@ -710,6 +949,8 @@ found:
     u->ssl_name = uscf->host;
 #endif
 
+    u->upstream = uscf;
+
     if (uscf->peer.init(r, uscf) != NGX_OK) {
         ngx_http_upstream_finalize_request(r, u,
                                            NGX_HTTP_INTERNAL_SERVER_ERROR);
@@ -1339,7 +1580,25 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     u->state->peer = u->peer.name;
 
     if (rc == NGX_BUSY) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no live upstreams");
+
+        if (u->upstream && u->upstream->queue) {
+            rc = ngx_http_upstream_queue_add(r, u);
+
+            if (rc == NGX_OK) {
+                return;
+            }
+
+            if (rc == NGX_ERROR) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
+        } else {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "no live upstreams");
+        }
+
         ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE);
         return;
     }
@@ -1354,6 +1613,7 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     c = u->peer.connection;
 
     c->data = r;
+    c->requests++;
 
     c->write->handler = ngx_http_upstream_handler;
     c->read->handler = ngx_http_upstream_handler;
@@ -1424,6 +1684,10 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->request_sent = 0;
 
+    if (u->conf->hedge && u->hedge == NULL) {
+        ngx_http_upstream_hedge_init(r, u);
+    }
+
     if (rc == NGX_AGAIN) {
         ngx_add_timer(c->write, u->conf->connect_timeout);
         return;
@@ -2100,6 +2364,11 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         u->buffer.last += n;
 
+        if (u->hedge) {
+            /* the response is coming, the hedged request is not needed */
+            ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_NEXT);
+        }
+
 #if 0
         u->valid_header_in = 0;
 
@@ -2142,6 +2411,12 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
     u->state->header_sec = tp->sec - u->state->response_sec;
     u->state->header_msec = tp->msec - u->state->response_msec;
 
+    if (u->conf->hedge && u->conf->hedge->percentile) {
+        ngx_http_upstream_hedge_sample(u->conf->hedge,
+                                       (ngx_msec_t) (u->state->header_sec * 1000
+                                                     + u->state->header_msec));
+    }
+
     if (u->headers_in.status_n >= NGX_HTTP_SPECIAL_RESPONSE) {
 
         if (ngx_http_upstream_test_next(r, u) == NGX_OK) {
@@ -2646,6 +2921,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
+    if (u->collapse) {
+        ngx_http_upstream_collapse_header(r, u);
+    }
+
     rc = ngx_http_send_header(r);
 
     if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
@@ -2655,6 +2934,13 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->header_sent = 1;
 
+    if (u->headers_in.in_buffer
+        && ngx_http_upstream_pin_header(r, u) != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
     if (u->upgrade) {
         ngx_http_upstream_upgrade(r, u);
         return;
@@ -2842,10 +3128,19 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     p = u->pipe;
 
-    p->output_filter = (ngx_event_pipe_output_filter_pt) ngx_http_output_filter;
+    if (u->collapse) {
+        p->output_filter = ngx_http_upstream_collapse_filter;
+
+    } else {
+        p->output_filter =
+                      (ngx_event_pipe_output_filter_pt) ngx_http_output_filter;
+    }
+
     p->output_ctx = r;
     p->tag = u->output.tag;
     p->bufs = u->conf->bufs;
+    p->max_bufs = u->conf->buffers_max;
+    p->budget = u->conf->buffers_budget;
     p->busy_size = u->conf->busy_buffers_size;
     p->upstream = u->peer.connection;
     p->downstream = c;
@@ -2940,6 +3235,35 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
         p->cyclic_temp_file = 0;
     }
 
+    /*
+     * the bufs saved to the cache or to the store are sent to the client
+     * from memory rather than read back from the temp file, unless they
+     * can be sent from the file with sendfile()
+     */
+
+    p->share_bufs = p->cacheable
+                    && (!c->sendfile
+                        || r->main_filter_need_in_memory
+                        || r->filter_need_in_memory);
+
+#if (NGX_HAVE_FILE_AIO && NGX_HAVE_EVENTFD)
+
+    /*
+     * the temp file offset of a cyclic temp file may be reset
+     * while a write is posted, so such files are written synchronously
+     */
+
+    if (ngx_file_aio
+        && clcf->aio == NGX_HTTP_AIO_ON
+        && clcf->aio_write
+        && !p->cyclic_temp_file)
+    {
+        p->temp_file->aio_write = 1;
+        p->aio_handler = ngx_http_upstream_aio_handler;
+    }
+
+#endif
+
     p->read_timeout = u->conf->read_timeout;
     p->send_timeout = clcf->send_timeout;
     p->send_lowat = clcf->send_lowat;
@@ -2960,6 +3284,48 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 }
 
 
+static ngx_int_t
+ngx_http_upstream_pin_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    u_char     *p;
+    size_t      size;
+    ngx_buf_t  *b;
+
+    /*
+     * the response header lines point into the buffer and are used
+     * until the request is finalized, so the part of the buffer before
+     * the body is excluded from it; if the rest is too small, the body
+     * read so far is moved to a new buffer
+     */
+
+    b = &u->buffer;
+
+    if ((size_t) (b->end - b->pos) >= u->conf->buffer_size / 2) {
+        b->start = b->pos;
+        return NGX_OK;
+    }
+
+    p = ngx_palloc(r->pool, u->conf->buffer_size);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    size = b->last - b->pos;
+
+    ngx_memcpy(p, b->pos, size);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream header pinned, %uz bytes moved", size);
+
+    b->start = p;
+    b->pos = p;
+    b->last = p + size;
+    b->end = p + u->conf->buffer_size;
+
+    return NGX_OK;
+}
+
+
 static void
 ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
@@ -3020,6 +3386,17 @@ ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    if (u->conf->splice) {
+        if (ngx_http_upstream_splice_init(r, u) == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+#endif
+
     if (u->peer.connection->read->ready
         || u->buffer.pos != u->buffer.last)
     {
@@ -3095,6 +3472,30 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         return;
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    if (u->splice) {
+
+        switch (ngx_http_upstream_process_spliced(r, u, from_upstream,
+                                                   do_write))
+        {
+        case NGX_OK:
+            goto events;
+
+        case NGX_DONE:
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http upstream upgraded done");
+            ngx_http_upstream_finalize_request(r, u, 0);
+            return;
+
+        default: /* NGX_ERROR */
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+#endif
+
     if (from_upstream) {
         src = upstream;
         dst = downstream;
@@ -3187,6 +3588,10 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         return;
     }
 
+#if (NGX_HAVE_SPLICE)
+events:
+#endif
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (ngx_handle_write_event(upstream->write, u->conf->send_lowat)
@@ -3236,58 +3641,313 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
 }
 
 
-static void
-ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_http_upstream_splice_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    ngx_event_t          *wev;
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
+    ngx_uint_t                   i, j;
+    ngx_connection_t            *c, *pc;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_upstream_splice_t  *sp;
+#ifdef F_GETPIPE_SZ
+    int                          n;
+#endif
 
     c = r->connection;
-    u = r->upstream;
-    wev = c->write;
+    pc = u->peer.connection;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process non buffered downstream");
+    /*
+     * the data bypass the user space only if nothing is to be done
+     * with them there: no SSL on either side and no rate limiting
+     */
 
-    c->log->action = "sending to client";
+    if (c->recv != ngx_recv || c->send != ngx_send
+        || pc->recv != ngx_recv || pc->send != ngx_send
+        || r->limit_rate)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream splice disabled");
+        return NGX_DECLINED;
+    }
 
-    if (wev->timedout) {
-        c->timedout = 1;
-        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
-        return;
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_upstream_splice_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_http_upstream_process_non_buffered_request(r, 1);
-}
+    sp = cln->data;
 
+    for (i = 0; i < 2; i++) {
+        sp->pipe[i].fd[0] = -1;
+        sp->pipe[i].fd[1] = -1;
+        sp->pipe[i].size = 0;
+    }
 
-static void
-ngx_http_upstream_process_non_buffered_upstream(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
-{
-    ngx_connection_t  *c;
+    sp->capacity = 16 * ngx_pagesize;
+    sp->log = c->log;
 
-    c = u->peer.connection;
+    cln->handler = ngx_http_upstream_splice_cleanup;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process non buffered upstream");
+    for (i = 0; i < 2; i++) {
 
-    c->log->action = "reading upstream";
+        if (pipe(sp->pipe[i].fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno, "pipe() failed");
+            sp->pipe[i].fd[0] = -1;
+            sp->pipe[i].fd[1] = -1;
+            return NGX_DECLINED;
+        }
 
-    if (c->read->timedout) {
-        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
-        return;
+        for (j = 0; j < 2; j++) {
+            if (ngx_nonblocking(sp->pipe[i].fd[j]) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                              ngx_nonblocking_n " pipe failed");
+                return NGX_DECLINED;
+            }
+        }
     }
 
-    ngx_http_upstream_process_non_buffered_request(r, 0);
-}
+#ifdef F_GETPIPE_SZ
 
+    n = fcntl(sp->pipe[0].fd[1], F_GETPIPE_SZ);
 
-static void
-ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
+    if (n > 0) {
+        sp->capacity = n;
+    }
+
+#endif
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream splice: %d:%d %d:%d %uz",
+                   sp->pipe[0].fd[0], sp->pipe[0].fd[1],
+                   sp->pipe[1].fd[0], sp->pipe[1].fd[1], sp->capacity);
+
+    u->splice = sp;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_process_spliced(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t from_upstream, ngx_uint_t do_write)
+{
+    ssize_t                           n;
+    ngx_err_t                         err;
+    ngx_buf_t                        *b;
+    ngx_connection_t                 *downstream, *upstream, *dst, *src;
+    ngx_http_upstream_splice_pipe_t  *p;
+
+    downstream = r->connection;
+    upstream = u->peer.connection;
+
+    /*
+     * the data already read into the user space buffers, the rest
+     * of the upstream response header buffer or the client request
+     * header buffer, are sent before anything from the pipe
+     */
+
+    if (from_upstream) {
+        src = upstream;
+        dst = downstream;
+        b = &u->buffer;
+        p = &u->splice->pipe[1];
+
+    } else {
+        src = downstream;
+        dst = upstream;
+        b = r->header_in;
+        p = &u->splice->pipe[0];
+
+        if (b->last > b->pos) {
+            do_write = 1;
+        }
+    }
+
+    for ( ;; ) {
+
+        if (do_write && b->pos != b->last && dst->write->ready) {
+
+            n = dst->send(dst, b->pos, b->last - b->pos);
+
+            if (n == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (n > 0) {
+                b->pos += n;
+            }
+        }
+
+        if (do_write && p->size && b->pos == b->last && dst->write->ready) {
+
+            n = splice(p->fd[0], NULL, dst->fd, NULL, p->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, downstream->log, 0,
+                           "splice to %d: %z of %uz", dst->fd, n, p->size);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err != NGX_EAGAIN && err != NGX_EINTR) {
+                    dst->write->error = 1;
+                    ngx_connection_error(dst, err, "splice() failed");
+                    return NGX_ERROR;
+                }
+
+                if (err == NGX_EAGAIN) {
+                    dst->write->ready = 0;
+                }
+
+            } else {
+                p->size -= n;
+            }
+        }
+
+        if (p->size < u->splice->capacity && src->read->ready) {
+
+            n = splice(src->fd, NULL, p->fd[1], NULL,
+                       u->splice->capacity - p->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, downstream->log, 0,
+                           "splice from %d: %z of %uz",
+                           src->fd, n, u->splice->capacity - p->size);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EINTR) {
+                    continue;
+                }
+
+                if (err == NGX_EAGAIN) {
+
+                    /*
+                     * a pipe may be full with less than its capacity
+                     * in it, so the socket is known to be drained only
+                     * if the pipe is empty
+                     */
+
+                    if (p->size == 0) {
+                        src->read->ready = 0;
+                    }
+
+                    break;
+                }
+
+                src->read->error = 1;
+                src->read->eof = 1;
+                ngx_connection_error(src, err, "splice() failed");
+
+                break;
+            }
+
+            if (n == 0) {
+                src->read->eof = 1;
+                break;
+            }
+
+            p->size += n;
+            do_write = 1;
+
+            continue;
+        }
+
+        break;
+    }
+
+    if ((upstream->read->eof && u->buffer.pos == u->buffer.last
+         && u->splice->pipe[1].size == 0)
+        || (downstream->read->eof && r->header_in->pos == r->header_in->last
+            && u->splice->pipe[0].size == 0)
+        || (downstream->read->eof && upstream->read->eof))
+    {
+        return NGX_DONE;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_splice_cleanup(void *data)
+{
+    ngx_http_upstream_splice_t  *sp = data;
+
+    ngx_uint_t  i, j;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+
+            if (sp->pipe[i].fd[j] == -1) {
+                continue;
+            }
+
+            if (close(sp->pipe[i].fd[j]) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, sp->log, ngx_errno,
+                              "close() pipe failed");
+            }
+        }
+    }
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
+{
+    ngx_event_t          *wev;
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = r->connection;
+    u = r->upstream;
+    wev = c->write;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process non buffered downstream");
+
+    c->log->action = "sending to client";
+
+    if (wev->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_upstream_process_non_buffered_request(r, 1);
+}
+
+
+static void
+ngx_http_upstream_process_non_buffered_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process non buffered upstream");
+
+    c->log->action = "reading upstream";
+
+    if (c->read->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
+        return;
+    }
+
+    ngx_http_upstream_process_non_buffered_request(r, 0);
+}
+
+
+static void
+ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
     ngx_uint_t do_write)
 {
     size_t                     size;
@@ -3311,6 +3971,11 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
         if (do_write) {
 
             if (u->out_bufs || u->busy_bufs) {
+
+                if (u->collapse) {
+                    ngx_http_upstream_collapse_capture(u, u->out_bufs);
+                }
+
                 rc = ngx_http_output_filter(r, u->out_bufs);
 
                 if (rc == NGX_ERROR) {
@@ -3606,6 +4271,27 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 
     p = u->pipe;
 
+#if (NGX_HAVE_FILE_AIO)
+
+    if (p->writing && !p->aio) {
+
+        /*
+         * the aio write has been completed,
+         * make sure the pipe picks up its result
+         */
+
+        if (ngx_event_pipe(p, 1) == NGX_ABORT) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+    if (p->writing) {
+        return;
+    }
+
+#endif
+
     if (u->peer.connection) {
 
         if (u->store) {
@@ -3685,6 +4371,59 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 }
 
 
+#if (NGX_HAVE_FILE_AIO)
+
+static void
+ngx_http_upstream_aio_handler(ngx_event_pipe_t *p, ngx_file_t *file)
+{
+    ngx_http_request_t  *r;
+
+    r = p->output_ctx;
+
+    file->write_aio->data = r;
+    file->write_aio->handler = ngx_http_upstream_aio_event_handler;
+
+    r->main->blocked++;
+    r->aio = 1;
+}
+
+
+static void
+ngx_http_upstream_aio_event_handler(ngx_event_t *ev)
+{
+    ngx_event_aio_t      *aio;
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
+
+    aio = ev->data;
+    r = aio->data;
+    u = r->upstream;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream aio write: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+    u->pipe->aio = 0;
+
+    if (u->cleanup == NULL) {
+        /* the upstream was finalized while the write was in progress */
+        c->write->handler(c->write);
+        return;
+    }
+
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
 static void
 ngx_http_upstream_store(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
@@ -3721,189 +4460,1700 @@ ngx_http_upstream_store(ngx_http_request_t *r, ngx_http_upstream_t *u)
         u->pipe->temp_file = tf;
     }
 
-    ext.access = u->conf->store_access;
-    ext.path_access = u->conf->store_access;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
+    ext.access = u->conf->store_access;
+    ext.path_access = u->conf->store_access;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = r->connection->log;
+
+    if (u->headers_in.last_modified) {
+
+        lm = ngx_http_parse_time(u->headers_in.last_modified->value.data,
+                                 u->headers_in.last_modified->value.len);
+
+        if (lm != NGX_ERROR) {
+            ext.time = lm;
+            ext.fd = tf->file.fd;
+        }
+    }
+
+    if (u->conf->store_lengths == NULL) {
+
+        if (ngx_http_map_uri_to_path(r, &path, &root, 0) == NULL) {
+            return;
+        }
+
+    } else {
+        if (ngx_http_script_run(r, &path, u->conf->store_lengths->elts, 0,
+                                u->conf->store_values->elts)
+            == NULL)
+        {
+            return;
+        }
+    }
+
+    path.len--;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "upstream stores \"%s\" to \"%s\"",
+                   tf->file.name.data, path.data);
+
+    (void) ngx_ext_rename_file(&tf->file.name, &path, &ext);
+
+    u->store = 0;
+}
+
+
+static void
+ngx_http_upstream_dummy_handler(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream dummy handler");
+}
+
+
+static void
+ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t ft_type)
+{
+    ngx_msec_t  timeout;
+    ngx_uint_t  status, state;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http next upstream, %xi", ft_type);
+
+    if (u->peer.sockaddr) {
+
+        if (ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_403
+            || ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_404)
+        {
+            state = NGX_PEER_NEXT;
+
+        } else {
+            state = NGX_PEER_FAILED;
+        }
+
+        u->peer.free(&u->peer, u->peer.data, state);
+        u->peer.sockaddr = NULL;
+    }
+
+    if (ft_type == NGX_HTTP_UPSTREAM_FT_TIMEOUT) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+    }
+
+    if (u->hedge) {
+
+        /* the hedged request already sent goes on instead of a new one */
+
+        if (u->hedge->connected && u->hedge->out == NULL) {
+            ngx_http_upstream_hedge_switch(r, u);
+
+            if (u->peer.connection->read->ready) {
+                ngx_http_upstream_process_header(r, u);
+            }
+
+            return;
+        }
+
+        ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_NEXT);
+    }
+
+    if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR
+        && (!u->request_sent || !r->request_body_no_buffering))
+    {
+        status = 0;
+
+        /* TODO: inform balancer instead */
+
+        u->peer.tries++;
+
+    } else {
+        switch (ft_type) {
+
+        case NGX_HTTP_UPSTREAM_FT_TIMEOUT:
+            status = NGX_HTTP_GATEWAY_TIME_OUT;
+            break;
+
+        case NGX_HTTP_UPSTREAM_FT_HTTP_500:
+            status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            break;
+
+        case NGX_HTTP_UPSTREAM_FT_HTTP_403:
+            status = NGX_HTTP_FORBIDDEN;
+            break;
+
+        case NGX_HTTP_UPSTREAM_FT_HTTP_404:
+            status = NGX_HTTP_NOT_FOUND;
+            break;
+
+        /*
+         * NGX_HTTP_UPSTREAM_FT_BUSY_LOCK and NGX_HTTP_UPSTREAM_FT_MAX_WAITING
+         * never reach here
+         */
+
+        default:
+            status = NGX_HTTP_BAD_GATEWAY;
+        }
+    }
+
+    if (r->connection->error) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
+        return;
+    }
+
+    if (status) {
+        u->state->status = status;
+        timeout = u->conf->next_upstream_timeout;
+
+        if (u->peer.tries == 0
+            || !(u->conf->next_upstream & ft_type)
+            || (u->request_sent && r->request_body_no_buffering)
+            || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
+        {
+#if (NGX_HTTP_CACHE)
+
+            if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
+                && (u->conf->cache_use_stale & ft_type))
+            {
+                ngx_int_t  rc;
+
+                rc = u->reinit_request(r);
+
+                if (rc == NGX_OK) {
+                    u->cache_status = NGX_HTTP_CACHE_STALE;
+                    rc = ngx_http_upstream_cache_send(r, u);
+                }
+
+                ngx_http_upstream_finalize_request(r, u, rc);
+                return;
+            }
+#endif
+
+            ngx_http_upstream_finalize_request(r, u, status);
+            return;
+        }
+    }
+
+    if (u->peer.connection) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "close http upstream connection: %d",
+                       u->peer.connection->fd);
+#if (NGX_HTTP_SSL)
+
+        if (u->peer.connection->ssl) {
+            u->peer.connection->ssl->no_wait_shutdown = 1;
+            u->peer.connection->ssl->no_send_shutdown = 1;
+
+            (void) ngx_ssl_shutdown(u->peer.connection);
+        }
+#endif
+
+        if (u->peer.connection->pool) {
+            ngx_destroy_pool(u->peer.connection->pool);
+        }
+
+        ngx_close_connection(u->peer.connection);
+        u->peer.connection = NULL;
+    }
+
+    ngx_http_upstream_connect(r, u);
+}
+
+
+static void
+ngx_http_upstream_hedge_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_msec_t                       after;
+    ngx_chain_t                     *cl;
+    ngx_http_upstream_hedge_t       *h;
+    ngx_http_upstream_hedge_conf_t  *hcf;
+
+    hcf = u->conf->hedge;
+
+    /*
+     * only idempotent requests without a body are hedged, to the peers
+     * of an upstream block, while another peer can still be tried
+     */
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        || r->headers_in.content_length_n > 0
+        || r->headers_in.chunked
+        || u->resolved
+        || u->conf->upstream == NULL
+        || u->peer.tries < 2)
+    {
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (u->ssl) {
+        return;
+    }
+#endif
+
+    for (cl = u->request_bufs; cl; cl = cl->next) {
+        if (!ngx_buf_in_memory(cl->buf)) {
+            return;
+        }
+    }
+
+    /* each request eligible adds to the budget, up to ten hedges */
+
+    hcf->tokens += hcf->budget;
+
+    if (hcf->tokens > 10 * 10000) {
+        hcf->tokens = 10 * 10000;
+    }
+
+    after = hcf->percentile ? hcf->threshold : hcf->after;
+
+    if (after == 0) {
+        return;
+    }
+
+    h = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_hedge_t));
+    if (h == NULL) {
+        return;
+    }
+
+    h->timer.handler = ngx_http_upstream_hedge_handler;
+    h->timer.data = r;
+    h->timer.log = r->connection->log;
+
+    u->hedge = h;
+
+    ngx_add_timer(&h->timer, after);
+}
+
+
+static void
+ngx_http_upstream_hedge_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                *c;
+    ngx_http_request_t              *r;
+    ngx_http_upstream_t             *u;
+    ngx_http_upstream_hedge_conf_t  *hcf;
+
+    r = ev->data;
+    u = r->upstream;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http upstream hedge");
+
+    /* no hedge once the response header has started to arrive */
+
+    if (u->peer.connection == NULL
+        || u->read_event_handler != ngx_http_upstream_process_header
+        || u->buffer.last != u->buffer.pos)
+    {
+        return;
+    }
+
+    hcf = u->conf->hedge;
+
+    if (hcf->tokens < 10000) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream hedge budget exhausted");
+        return;
+    }
+
+    if (ngx_http_upstream_hedge_connect(r, u) == NGX_OK) {
+        hcf->tokens -= 10000;
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hedge_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t                      rc;
+    ngx_buf_t                     *b;
+    ngx_time_t                    *tp;
+    ngx_chain_t                   *cl, **ll;
+    ngx_connection_t              *c;
+    ngx_peer_connection_t          peer;
+    ngx_http_upstream_hedge_t     *h;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    h = u->hedge;
+    uscf = u->conf->upstream;
+
+    /* the request to send again, from the start */
+
+    ll = &h->out;
+
+    for (cl = u->request_bufs; cl; cl = cl->next) {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        *b = *cl->buf;
+        b->pos = b->start;
+
+        *ll = ngx_alloc_chain_link(r->pool);
+        if (*ll == NULL) {
+            return NGX_ERROR;
+        }
+
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
+    }
+
+    *ll = NULL;
+
+    /*
+     * the hedged request gets its own balancer data, so both requests
+     * are accounted to their peers
+     */
+
+    peer = u->peer;
+    u->peer.data = NULL;
+
+    rc = uscf->peer.init(r, uscf);
+
+    h->peer = u->peer;
+    u->peer = peer;
+
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    h->peer.connection = NULL;
+    h->peer.sockaddr = NULL;
+    h->peer.name = NULL;
+    h->peer.cached = 0;
+    h->peer.start_time = ngx_current_msec;
+
+    if (u->conf->next_upstream_tries
+        && h->peer.tries > u->conf->next_upstream_tries)
+    {
+        h->peer.tries = u->conf->next_upstream_tries;
+    }
+
+    h->get = h->peer.get;
+    h->data = h->peer.data;
+    h->sockaddr = u->peer.sockaddr;
+    h->socklen = u->peer.socklen;
+
+    h->peer.get = ngx_http_upstream_hedge_get_peer;
+    h->peer.data = h;
+
+    ngx_memzero(&h->state, sizeof(ngx_http_upstream_state_t));
+
+    tp = ngx_timeofday();
+    h->state.response_sec = tp->sec;
+    h->state.response_msec = tp->msec;
+    h->state.header_sec = (time_t) NGX_ERROR;
+
+    rc = ngx_event_connect_peer(&h->peer);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge connect: %i", rc);
+
+    h->peer.get = h->get;
+    h->peer.data = h->data;
+
+    h->state.peer = h->peer.name;
+
+    /* the peer is freed if one was selected */
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_FAILED);
+        return NGX_DECLINED;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "upstream request hedged to %V", h->peer.name);
+
+    c = h->peer.connection;
+
+    c->data = r;
+
+    c->write->handler = ngx_http_upstream_hedge_write_handler;
+    c->read->handler = ngx_http_upstream_hedge_read_handler;
+
+    if (c->pool == NULL) {
+        c->pool = ngx_create_pool(128, r->connection->log);
+        if (c->pool == NULL) {
+            ngx_http_upstream_hedge_cancel(r, u, 0);
+            return NGX_ERROR;
+        }
+    }
+
+    c->log = r->connection->log;
+    c->pool->log = c->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, u->conf->connect_timeout);
+        return NGX_OK;
+    }
+
+    ngx_http_upstream_hedge_send(r, u);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hedge_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_hedge_t  *h = data;
+
+    ngx_int_t  rc;
+
+    rc = h->get(pc, h->data);
+
+    if (rc != NGX_OK && rc != NGX_DONE) {
+        return rc;
+    }
+
+    /*
+     * a hedge to the peer already in use is pointless; the balancer
+     * is not asked again, as it would forget the failures of the peers
+     * once there are no others left
+     */
+
+    if (ngx_cmp_sockaddr(pc->sockaddr, pc->socklen, h->sockaddr, h->socklen, 1)
+        != NGX_OK)
+    {
+        return rc;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http upstream hedge to the same peer");
+
+    pc->free(pc, h->data, NGX_PEER_NEXT);
+    pc->sockaddr = NULL;
+
+    if (pc->connection) {
+        ngx_http_upstream_close_peer_connection(pc->connection);
+        pc->connection = NULL;
+    }
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_upstream_hedge_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
+
+    c = wev->data;
+    r = c->data;
+    u = r->upstream;
+
+    ngx_http_set_log_request(r->connection->log, r);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge write handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                      "upstream hedge timed out");
+        ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_FAILED);
+
+    } else if (u->hedge->out || !u->hedge->connected) {
+        ngx_http_upstream_hedge_send(r, u);
+
+    } else {
+        (void) ngx_handle_write_event(wev, 0);
+    }
+
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static void
+ngx_http_upstream_hedge_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_connection_t           *c;
+    ngx_http_upstream_hedge_t  *h;
+
+    h = u->hedge;
+    c = h->peer.connection;
+
+    if (!h->connected) {
+        if (ngx_http_upstream_test_connect(c) != NGX_OK) {
+            ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_FAILED);
+            return;
+        }
+
+        h->connected = 1;
+    }
+
+    h->out = c->send_chain(c, h->out, 0);
+
+    if (h->out == NGX_CHAIN_ERROR) {
+        h->out = NULL;
+        ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_FAILED);
+        return;
+    }
+
+    if (h->out) {
+        if (!c->write->ready) {
+            ngx_add_timer(c->write, u->conf->send_timeout);
+
+        } else if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_FAILED);
+        }
+
+        return;
+    }
+
+    /* the request is sent, the response is awaited */
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_FAILED);
+        return;
+    }
+
+    ngx_add_timer(c->read, u->conf->read_timeout);
+
+    if (c->read->ready) {
+        ngx_http_upstream_hedge_read_handler(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_FAILED);
+    }
+}
+
+
+static void
+ngx_http_upstream_hedge_read_handler(ngx_event_t *rev)
+{
+    u_char                buf[1];
+    ssize_t               n;
+    ngx_err_t             err;
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
+
+    c = rev->data;
+    r = c->data;
+    u = r->upstream;
+
+    ngx_http_set_log_request(r->connection->log, r);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge read handler");
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                      "upstream hedge timed out");
+        ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_FAILED);
+        goto done;
+    }
+
+    if (u->hedge->out || !u->hedge->connected) {
+        goto done;
+    }
+
+    /* the response is left to be read as usual if the hedge wins */
+
+    n = recv(c->fd, (char *) buf, 1, MSG_PEEK);
+
+    err = ngx_socket_errno;
+
+    if (n == -1 && err == NGX_EAGAIN) {
+        if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+            ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_FAILED);
+        }
+
+        goto done;
+    }
+
+    if (n <= 0) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, n ? err : 0,
+                      "upstream hedge failed");
+        ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_FAILED);
+        goto done;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge won");
+
+    ngx_http_upstream_hedge_switch(r, u);
+
+    ngx_http_upstream_process_header(r, u);
+
+done:
+
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static void
+ngx_http_upstream_hedge_switch(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_time_t                 *tp;
+    ngx_msec_t                  start_time;
+    ngx_connection_t           *c;
+    ngx_http_upstream_hedge_t  *h;
+
+    h = u->hedge;
+
+    /* the request in progress is cancelled */
+
+    if (u->peer.sockaddr) {
+        u->peer.free(&u->peer, u->peer.data, NGX_PEER_NEXT);
+        u->peer.sockaddr = NULL;
+    }
+
+    if (u->peer.connection) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "close http upstream connection: %d",
+                       u->peer.connection->fd);
+
+        ngx_http_upstream_close_peer_connection(u->peer.connection);
+        u->peer.connection = NULL;
+    }
+
+    if (u->state->response_sec) {
+        tp = ngx_timeofday();
+        u->state->response_sec = tp->sec - u->state->response_sec;
+        u->state->response_msec = tp->msec - u->state->response_msec;
+    }
+
+    /* the hedged request takes its place */
+
+    start_time = u->peer.start_time;
+
+    u->peer = h->peer;
+    u->peer.start_time = start_time;
+
+    h->peer.connection = NULL;
+    h->peer.sockaddr = NULL;
+
+    u->state = ngx_array_push(r->upstream_states);
+    if (u->state == NULL) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    *u->state = h->state;
+
+    c = u->peer.connection;
+
+    c->write->handler = ngx_http_upstream_handler;
+    c->read->handler = ngx_http_upstream_handler;
+
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+    u->read_event_handler = ngx_http_upstream_process_header;
+
+    u->writer.connection = c;
+    u->request_sent = 1;
+}
+
+
+static void
+ngx_http_upstream_hedge_cancel(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t state)
+{
+    ngx_uint_t                  n;
+    ngx_time_t                 *tp;
+    ngx_http_upstream_hedge_t  *h;
+    ngx_http_upstream_state_t  *us;
+
+    h = u->hedge;
+
+    if (h->timer.timer_set) {
+        ngx_del_timer(&h->timer);
+    }
+
+    if (h->peer.sockaddr == NULL) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge cancel: %ui", state);
+
+    h->peer.free(&h->peer, h->peer.data, state);
+    h->peer.sockaddr = NULL;
+
+    if (h->peer.connection) {
+        ngx_http_upstream_close_peer_connection(h->peer.connection);
+        h->peer.connection = NULL;
+    }
+
+    /* the cancelled request is logged after the one in progress */
+
+    tp = ngx_timeofday();
+    h->state.response_sec = tp->sec - h->state.response_sec;
+    h->state.response_msec = tp->msec - h->state.response_msec;
+
+    if (state & NGX_PEER_FAILED) {
+        h->state.status = NGX_HTTP_BAD_GATEWAY;
+    }
+
+    n = u->state - (ngx_http_upstream_state_t *) r->upstream_states->elts;
+
+    us = ngx_array_push(r->upstream_states);
+    if (us == NULL) {
+        return;
+    }
+
+    /* the array may have been moved */
+
+    u->state = (ngx_http_upstream_state_t *) r->upstream_states->elts + n;
+
+    *us = *u->state;
+    *u->state = h->state;
+
+    u->state = us;
+}
+
+
+static void
+ngx_http_upstream_hedge_sample(ngx_http_upstream_hedge_conf_t *hcf,
+    ngx_msec_t ms)
+{
+    ngx_uint_t  i, sum, need;
+
+    hcf->hist[ngx_http_upstream_hedge_bucket(ms)]++;
+    hcf->total++;
+
+    if (++hcf->pending < 64) {
+        return;
+    }
+
+    hcf->pending = 0;
+
+    /* the old samples fade out */
+
+    if (hcf->total >= 2048) {
+        hcf->total = 0;
+
+        for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS; i++) {
+            hcf->hist[i] /= 2;
+            hcf->total += hcf->hist[i];
+        }
+    }
+
+    need = hcf->total * hcf->percentile / 100;
+    sum = 0;
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS - 1; i++) {
+        sum += hcf->hist[i];
+
+        if (sum > need) {
+            break;
+        }
+    }
+
+    /* the upper bound of the bucket */
+
+    if (i < 8) {
+        hcf->threshold = i + 1;
+
+    } else {
+        hcf->threshold = (ngx_msec_t) (5 + (i - 8) % 4) << (3 + (i - 8) / 4 - 2);
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_hedge_bucket(ngx_msec_t ms)
+{
+    ngx_uint_t  e;
+
+    /*
+     * exact below 8 ms, then four buckets per power of two,
+     * that is, within 25%
+     */
+
+    if (ms < 8) {
+        return ms;
+    }
+
+    if (ms >= (ngx_msec_t) 1 << 27) {
+        ms = ((ngx_msec_t) 1 << 27) - 1;
+    }
+
+    for (e = 3; ms >> (e + 1); e++) { /* void */ }
+
+    return 8 + (e - 3) * 4 + ((ms >> (e - 2)) & 3);
+}
+
+
+static void
+ngx_http_upstream_close_peer_connection(ngx_connection_t *c)
+{
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+    ngx_close_connection(c);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_queue_add(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_msec_int_t               timer;
+    ngx_http_upstream_queue_t   *q;
+    ngx_http_upstream_waiter_t  *w;
+
+    q = u->upstream->queue;
+    w = u->waiter;
+
+    if (w == NULL) {
+
+        if (q->length >= q->max) {
+            q->rejected++;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "no live upstreams, queue is full");
+            return NGX_DECLINED;
+        }
+
+        w = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_waiter_t));
+        if (w == NULL) {
+            return NGX_ERROR;
+        }
+
+        w->event.handler = ngx_http_upstream_queue_handler;
+        w->event.data = r;
+        w->event.log = r->connection->log;
+        w->waiting = q;
+        w->deadline = ngx_current_msec + q->timeout;
+
+        u->waiter = w;
+
+        q->queued++;
+
+        ngx_queue_insert_tail(&q->waiting, &w->queue);
+
+    } else {
+
+        timer = (ngx_msec_int_t) (w->deadline - ngx_current_msec);
+
+        if (timer <= 0) {
+            q->timedout++;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "no live upstreams, queue timed out");
+            return NGX_DECLINED;
+        }
+
+        /* woken up in vain, the waiter keeps its place */
+
+        ngx_queue_insert_head(&q->waiting, &w->queue);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream queue add: %ui of %ui", q->length + 1, q->max);
+
+    w->queued = 1;
+    w->start = ngx_current_msec;
+    q->length++;
+
+    ngx_add_timer(&w->event, w->deadline - ngx_current_msec);
+
+    if (!q->retry.timer_set) {
+        ngx_add_timer(&q->retry, NGX_HTTP_UPSTREAM_QUEUE_RETRY);
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_upstream_queue_wake(ngx_http_upstream_queue_t *queue)
+{
+    ngx_queue_t                 *q;
+    ngx_http_upstream_waiter_t  *w;
+
+    if (ngx_queue_empty(&queue->waiting)) {
+        return;
+    }
+
+    q = ngx_queue_head(&queue->waiting);
+    w = ngx_queue_data(q, ngx_http_upstream_waiter_t, queue);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, w->event.log, 0,
+                   "http upstream queue wake");
+
+    ngx_http_upstream_queue_remove(w);
+
+    /* the waiter tries again once the current event is handled */
+
+    ngx_post_event(&w->event, &ngx_posted_events);
+}
+
+
+static void
+ngx_http_upstream_queue_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                   tries;
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_upstream_t         *u;
+    ngx_http_upstream_waiter_t  *w;
+
+    r = ev->data;
+    u = r->upstream;
+    c = r->connection;
+    w = u->waiter;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream queue handler: %d", ev->timedout);
+
+    if (ev->timedout) {
+        ev->timedout = 0;
+
+        if (w->queued) {
+            ngx_http_upstream_queue_remove(w);
+        }
+
+        if (ev->posted) {
+            ngx_delete_posted_event(ev);
+        }
+
+        w->waiting->timedout++;
+
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "no live upstreams, queue timed out");
+
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE);
+
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    /* the state of the attempt that was queued is reused */
+
+    r->upstream_states->nelts--;
+    u->state = NULL;
+
+    if (u->upstream->resolver) {
+
+        /*
+         * the peers may have been rebuilt while the request waited,
+         * the balancer selects from the current ones then
+         */
+
+        tries = u->peer.tries;
+        u->peer.data = NULL;
+
+        if (u->upstream->peer.init(r, u->upstream) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            ngx_http_run_posted_requests(c);
+            return;
+        }
+
+        if (u->peer.tries > tries) {
+            u->peer.tries = tries;
+        }
+    }
+
+    ngx_http_upstream_connect(r, u);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_queue_retry_handler(ngx_event_t *ev)
+{
+    ngx_http_upstream_queue_t  *q;
+
+    q = ev->data;
+
+    ngx_http_upstream_queue_wake(q);
+
+    if (!ngx_queue_empty(&q->waiting) && !ngx_exiting) {
+        ngx_add_timer(ev, NGX_HTTP_UPSTREAM_QUEUE_RETRY);
+    }
+}
+
+
+static void
+ngx_http_upstream_queue_remove(ngx_http_upstream_waiter_t *w)
+{
+    ngx_msec_t  ms;
+
+    ngx_queue_remove(&w->queue);
+
+    w->queued = 0;
+    w->waiting->length--;
+
+    ms = ngx_current_msec - w->start;
+
+    w->time += ms;
+    w->waiting->wait_time += ms;
+}
+
+
+static void
+ngx_http_upstream_queue_cancel(ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_waiter_t  *w;
+
+    w = u->waiter;
+
+    if (w->queued) {
+        ngx_http_upstream_queue_remove(w);
+    }
+
+    if (w->event.timer_set) {
+        ngx_del_timer(&w->event);
+    }
+
+    if (w->event.posted) {
+        ngx_delete_posted_event(&w->event);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_collapse(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    u_char                        *p;
+    uint32_t                       hash;
+    ngx_str_t                      key, value;
+    ngx_pool_t                    *pool;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_upstream_follower_t  *f;
+    ngx_http_upstream_collapse_t  *col;
+
+    if (r != r->main
+        || r->post_action
+        || !(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        || u->conf->collapse_key == NULL)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * partial and conditional requests, and requests with a body,
+     * may get responses which are not valid for the other ones
+     */
+
+    if (r->headers_in.range
+        || r->headers_in.if_range
+        || r->headers_in.if_modified_since
+        || r->headers_in.if_unmodified_since
+        || r->headers_in.if_match
+        || r->headers_in.if_none_match
+        || r->headers_in.content_length_n > 0
+        || r->headers_in.chunked)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * the responses to requests with credentials may be personalized,
+     * such requests are collapsed only if the key varies with them
+     */
+
+    if ((r->headers_in.authorization && !u->conf->collapse_authorization)
+        || (r->headers_in.cookies.nelts && !u->conf->collapse_cookie))
+    {
+        return NGX_OK;
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    if (u->conf->cache) {
+        return NGX_OK;
+    }
+
+#endif
+
+    if (ngx_http_complex_value(r, u->conf->collapse_key, &value) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* the method is a part of the key as HEAD responses have no body */
+
+    key.len = r->method_name.len + 1 + value.len;
+
+    key.data = ngx_pnalloc(r->pool, key.len);
+    if (key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key.data, r->method_name.data, r->method_name.len);
+    *p++ = ' ';
+    ngx_memcpy(p, value.data, value.len);
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    col = (ngx_http_upstream_collapse_t *)
+              ngx_str_rbtree_lookup(&ngx_http_upstream_collapse_tree, &key,
+                                    hash);
+
+    if (col) {
+        f = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_follower_t));
+        if (f == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream collapse: \"%V\" in flight", &key);
+
+        f->event.handler = ngx_http_upstream_collapse_handler;
+        f->event.data = r;
+        f->event.log = r->connection->log;
+        f->waiting = 1;
+
+        ngx_queue_insert_tail(&col->followers, &f->queue);
+
+        col->refs++;
+
+        cln->handler = ngx_http_upstream_collapse_release;
+        cln->data = col;
+
+        u->collapse = col;
+        u->follower = f;
+
+        return NGX_DONE;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    col = ngx_pcalloc(pool, sizeof(ngx_http_upstream_collapse_t));
+    if (col == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    col->sn.str.data = ngx_pstrdup(pool, &key);
+    if (col->sn.str.data == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&col->headers, pool, 16, sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream collapse: \"%V\" leads", &key);
+
+    col->sn.str.len = key.len;
+    col->sn.node.key = hash;
+    col->pool = pool;
+    col->refs = 1;
+    col->last = &col->body;
+    col->max_size = u->conf->collapse_max_size;
+
+    ngx_queue_init(&col->followers);
+
+    ngx_rbtree_insert(&ngx_http_upstream_collapse_tree, &col->sn.node);
+    col->linked = 1;
+
+    cln->handler = ngx_http_upstream_collapse_release;
+    cln->data = col;
+
+    u->collapse = col;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_collapse_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_uint_t                     i;
+    ngx_list_part_t               *part;
+    ngx_table_elt_t               *h, *ch;
+    ngx_http_upstream_collapse_t  *col;
+
+    col = u->collapse;
+
+    if (u->follower || !col->linked) {
+        return;
+    }
+
+    /* only a 200 response without cookies is shared */
+
+    if (u->headers_in.status_n != NGX_HTTP_OK
+        || u->headers_in.cookies.nelts)
+    {
+        goto failed;
+    }
+
+    /*
+     * a private response is not shared either, unless the key varies
+     * with the credentials the response may depend on
+     */
+
+    if (!u->conf->collapse_authorization
+        && !u->conf->collapse_cookie
+        && ngx_http_upstream_collapse_private(u))
+    {
+        goto failed;
+    }
+
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        ch = ngx_array_push(&col->headers);
+        if (ch == NULL) {
+            goto failed;
+        }
+
+        ch->hash = h[i].hash;
+
+        ch->key.len = h[i].key.len;
+        ch->key.data = ngx_pstrdup(col->pool, &h[i].key);
+
+        ch->lowcase_key = ngx_pnalloc(col->pool, h[i].key.len);
+
+        if (ch->key.data == NULL || ch->lowcase_key == NULL) {
+            goto failed;
+        }
+
+        ngx_memcpy(ch->lowcase_key, h[i].lowcase_key, h[i].key.len);
+
+        ch->value.len = h[i].value.len;
+
+        if (h[i].value.data == NULL) {
+            ch->value.data = NULL;
+            continue;
+        }
+
+        ch->value.data = ngx_pnalloc(col->pool, h[i].value.len + 1);
+        if (ch->value.data == NULL) {
+            goto failed;
+        }
+
+        ngx_cpystrn(ch->value.data, h[i].value.data, h[i].value.len + 1);
+    }
+
+    col->status = u->headers_in.status_n;
+
+    col->status_line.len = u->headers_in.status_line.len;
+    col->status_line.data = ngx_pstrdup(col->pool, &u->headers_in.status_line);
+
+    if (u->peer.name) {
+        col->peer.len = u->peer.name->len;
+        col->peer.data = ngx_pstrdup(col->pool, u->peer.name);
+    }
+
+    if ((col->status_line.len && col->status_line.data == NULL)
+        || (col->peer.len && col->peer.data == NULL))
+    {
+        goto failed;
+    }
+
+    col->header = 1;
+
+    return;
+
+failed:
+
+    ngx_http_upstream_collapse_wake(col);
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_collapse_private(ngx_http_upstream_t *u)
+{
+    u_char            *start, *last;
+    ngx_uint_t         i;
+    ngx_table_elt_t  **h;
+
+    h = u->headers_in.cache_control.elts;
+
+    for (i = 0; i < u->headers_in.cache_control.nelts; i++) {
+
+        start = h[i]->value.data;
+        last = start + h[i]->value.len;
+
+        if (ngx_strlcasestrn(start, last, (u_char *) "no-store", 8 - 1) != NULL
+            || ngx_strlcasestrn(start, last, (u_char *) "private", 7 - 1)
+               != NULL)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_collapse_filter(void *data, ngx_chain_t *in)
+{
+    ngx_http_request_t *r = data;
+
+    ngx_http_upstream_collapse_capture(r->upstream, in);
+
+    return ngx_http_output_filter(r, in);
+}
+
+
+static void
+ngx_http_upstream_collapse_capture(ngx_http_upstream_t *u, ngx_chain_t *in)
+{
+    size_t                         size;
+    ngx_buf_t                     *b;
+    ngx_chain_t                   *cl, *ln;
+    ngx_http_upstream_collapse_t  *col;
+
+    col = u->collapse;
+
+    if (u->follower || !col->header || !col->linked) {
+        return;
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+
+        if (ngx_buf_special(cl->buf)) {
+            continue;
+        }
+
+        /* the response spilled into a temporary file */
+
+        if (!ngx_buf_in_memory(cl->buf)) {
+            goto overflow;
+        }
+
+        size = cl->buf->last - cl->buf->pos;
+
+        if (col->size + size > col->max_size) {
+            goto overflow;
+        }
+
+        b = ngx_create_temp_buf(col->pool, size);
+        if (b == NULL) {
+            goto overflow;
+        }
+
+        ln = ngx_alloc_chain_link(col->pool);
+        if (ln == NULL) {
+            goto overflow;
+        }
+
+        b->last = ngx_cpymem(b->pos, cl->buf->pos, size);
+
+        ln->buf = b;
+        ln->next = NULL;
+
+        *col->last = ln;
+        col->last = &ln->next;
+
+        col->size += size;
+    }
+
+    return;
 
-    if (u->headers_in.last_modified) {
+overflow:
 
-        lm = ngx_http_parse_time(u->headers_in.last_modified->value.data,
-                                 u->headers_in.last_modified->value.len);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http upstream collapse: \"%V\" is not shared",
+                   &col->sn.str);
 
-        if (lm != NGX_ERROR) {
-            ext.time = lm;
-            ext.fd = tf->file.fd;
-        }
-    }
+    col->overflow = 1;
 
-    if (u->conf->store_lengths == NULL) {
+    ngx_http_upstream_collapse_wake(col);
+}
 
-        if (ngx_http_map_uri_to_path(r, &path, &root, 0) == NULL) {
-            return;
+
+static void
+ngx_http_upstream_collapse_done(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_int_t rc)
+{
+    ngx_http_upstream_follower_t  *f;
+    ngx_http_upstream_collapse_t  *col;
+
+    col = u->collapse;
+    f = u->follower;
+
+    u->collapse = NULL;
+    u->follower = NULL;
+
+    if (f) {
+        if (f->waiting) {
+            ngx_queue_remove(&f->queue);
+            f->waiting = 0;
         }
 
-    } else {
-        if (ngx_http_script_run(r, &path, u->conf->store_lengths->elts, 0,
-                                u->conf->store_values->elts)
-            == NULL)
-        {
-            return;
+        if (f->event.posted) {
+            ngx_delete_posted_event(&f->event);
         }
+
+        return;
     }
 
-    path.len--;
+    if (!col->linked) {
+        return;
+    }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "upstream stores \"%s\" to \"%s\"",
-                   tf->file.name.data, path.data);
+    /*
+     * only a complete response is shared, a response to a GET request
+     * without body is not
+     */
 
-    (void) ngx_ext_rename_file(&tf->file.name, &path, &ext);
+    if (col->header
+        && !col->overflow
+        && (rc == NGX_OK || (r->header_only && rc == NGX_AGAIN))
+        && (r->header_only
+            ? r->method == NGX_HTTP_HEAD
+            : (u->headers_in.content_length_n == -1
+               || u->headers_in.content_length_n == (off_t) col->size)))
+    {
+        col->done = 1;
+    }
 
-    u->store = 0;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream collapse done: %d, %uz bytes",
+                   col->done, col->size);
+
+    ngx_http_upstream_collapse_wake(col);
 }
 
 
 static void
-ngx_http_upstream_dummy_handler(ngx_http_request_t *r, ngx_http_upstream_t *u)
+ngx_http_upstream_collapse_wake(ngx_http_upstream_collapse_t *col)
 {
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http upstream dummy handler");
+    ngx_queue_t                   *q;
+    ngx_http_upstream_follower_t  *f;
+
+    /* no new requests join it */
+
+    ngx_rbtree_delete(&ngx_http_upstream_collapse_tree, &col->sn.node);
+    col->linked = 0;
+
+    while (!ngx_queue_empty(&col->followers)) {
+        q = ngx_queue_head(&col->followers);
+        ngx_queue_remove(q);
+
+        f = ngx_queue_data(q, ngx_http_upstream_follower_t, queue);
+        f->waiting = 0;
+
+        ngx_post_event(&f->event, &ngx_posted_events);
+    }
 }
 
 
 static void
-ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
-    ngx_uint_t ft_type)
+ngx_http_upstream_collapse_handler(ngx_event_t *ev)
 {
-    ngx_msec_t  timeout;
-    ngx_uint_t  status, state;
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http next upstream, %xi", ft_type);
+    r = ev->data;
+    u = r->upstream;
+    c = r->connection;
 
-    if (u->peer.sockaddr) {
+    ngx_http_set_log_request(c->log, r);
 
-        if (ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_403
-            || ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_404)
-        {
-            state = NGX_PEER_NEXT;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream collapse handler: %d", u->collapse->done);
 
-        } else {
-            state = NGX_PEER_FAILED;
-        }
+    if (u->collapse->done) {
+        ngx_http_upstream_collapse_send(r, u);
 
-        u->peer.free(&u->peer, u->peer.data, state);
-        u->peer.sockaddr = NULL;
+    } else {
+
+        /* the request goes to the upstream on its own */
+
+        u->collapse = NULL;
+        u->follower = NULL;
+
+        ngx_http_upstream_start(r, u);
     }
 
-    if (ft_type == NGX_HTTP_UPSTREAM_FT_TIMEOUT) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_ETIMEDOUT,
-                      "upstream timed out");
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_collapse_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t                       rc;
+    ngx_uint_t                      i;
+    ngx_buf_t                      *b;
+    ngx_chain_t                    *cl, *out, **ll;
+    ngx_table_elt_t                *h, *ho;
+    ngx_http_upstream_header_t     *hh;
+    ngx_http_upstream_collapse_t   *col;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    col = u->collapse;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    u->state = ngx_array_push(r->upstream_states);
+    if (u->state == NULL) {
+        goto failed;
     }
 
-    if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR
-        && (!u->request_sent || !r->request_body_no_buffering))
-    {
-        status = 0;
+    ngx_memzero(u->state, sizeof(ngx_http_upstream_state_t));
 
-        /* TODO: inform balancer instead */
+    u->state->status = col->status;
+    u->state->peer = &col->peer;
+    u->state->response_length = col->size;
 
-        u->peer.tries++;
+    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
 
-    } else {
-        switch (ft_type) {
+    /* the headers of the shared response are processed as if received */
 
-        case NGX_HTTP_UPSTREAM_FT_TIMEOUT:
-            status = NGX_HTTP_GATEWAY_TIME_OUT;
-            break;
+    h = col->headers.elts;
 
-        case NGX_HTTP_UPSTREAM_FT_HTTP_500:
-            status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-            break;
+    for (i = 0; i < col->headers.nelts; i++) {
 
-        case NGX_HTTP_UPSTREAM_FT_HTTP_403:
-            status = NGX_HTTP_FORBIDDEN;
-            break;
+        ho = ngx_list_push(&u->headers_in.headers);
+        if (ho == NULL) {
+            goto failed;
+        }
 
-        case NGX_HTTP_UPSTREAM_FT_HTTP_404:
-            status = NGX_HTTP_NOT_FOUND;
-            break;
+        *ho = h[i];
 
-        /*
-         * NGX_HTTP_UPSTREAM_FT_BUSY_LOCK and NGX_HTTP_UPSTREAM_FT_MAX_WAITING
-         * never reach here
-         */
+        hh = ngx_hash_find(&umcf->headers_in_hash, h[i].hash,
+                           h[i].lowcase_key, h[i].key.len);
 
-        default:
-            status = NGX_HTTP_BAD_GATEWAY;
+        if (hh && hh->handler(r, ho, hh->offset) != NGX_OK) {
+            goto failed;
         }
     }
 
-    if (r->connection->error) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
+    u->headers_in.status_n = col->status;
+    u->headers_in.status_line = col->status_line;
+
+    if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
         return;
     }
 
-    if (status) {
-        u->state->status = status;
-        timeout = u->conf->next_upstream_timeout;
+    rc = ngx_http_send_header(r);
 
-        if (u->peer.tries == 0
-            || !(u->conf->next_upstream & ft_type)
-            || (u->request_sent && r->request_body_no_buffering)
-            || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
-        {
-#if (NGX_HTTP_CACHE)
+    if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return;
+    }
 
-            if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
-                && (u->conf->cache_use_stale & ft_type))
-            {
-                ngx_int_t  rc;
+    u->header_sent = 1;
 
-                rc = u->reinit_request(r);
+    if (r->header_only || col->body == NULL) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return;
+    }
 
-                if (rc == NGX_OK) {
-                    u->cache_status = NGX_HTTP_CACHE_STALE;
-                    rc = ngx_http_upstream_cache_send(r, u);
-                }
+    /* the buffers are shared and kept until the request pool is freed */
 
-                ngx_http_upstream_finalize_request(r, u, rc);
-                return;
-            }
-#endif
+    out = NULL;
+    ll = &out;
 
-            ngx_http_upstream_finalize_request(r, u, status);
-            return;
+    for (cl = col->body; cl; cl = cl->next) {
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            goto error;
         }
+
+        b->pos = cl->buf->pos;
+        b->last = cl->buf->last;
+        b->memory = 1;
+
+        *ll = ngx_alloc_chain_link(r->pool);
+        if (*ll == NULL) {
+            goto error;
+        }
+
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
     }
 
-    if (u->peer.connection) {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "close http upstream connection: %d",
-                       u->peer.connection->fd);
-#if (NGX_HTTP_SSL)
+    *ll = NULL;
 
-        if (u->peer.connection->ssl) {
-            u->peer.connection->ssl->no_wait_shutdown = 1;
-            u->peer.connection->ssl->no_send_shutdown = 1;
+    rc = ngx_http_output_filter(r, out);
 
-            (void) ngx_ssl_shutdown(u->peer.connection);
-        }
-#endif
+    if (rc == NGX_ERROR) {
+        goto error;
+    }
 
-        if (u->peer.connection->pool) {
-            ngx_destroy_pool(u->peer.connection->pool);
-        }
+    ngx_http_upstream_finalize_request(r, u, 0);
+    return;
 
-        ngx_close_connection(u->peer.connection);
-        u->peer.connection = NULL;
+failed:
+
+    ngx_http_upstream_finalize_request(r, u, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+
+error:
+
+    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+}
+
+
+static void
+ngx_http_upstream_collapse_release(void *data)
+{
+    ngx_http_upstream_collapse_t  *col = data;
+
+    if (--col->refs) {
+        return;
     }
 
-    ngx_http_upstream_connect(r, u);
+    if (col->linked) {
+        ngx_rbtree_delete(&ngx_http_upstream_collapse_tree, &col->sn.node);
+    }
+
+    ngx_destroy_pool(col->pool);
 }
 
 
@@ -3938,6 +6188,18 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     *u->cleanup = NULL;
     u->cleanup = NULL;
 
+    if (u->hedge) {
+        ngx_http_upstream_hedge_cancel(r, u, NGX_PEER_NEXT);
+    }
+
+    if (u->waiter) {
+        ngx_http_upstream_queue_cancel(u);
+    }
+
+    if (u->collapse) {
+        ngx_http_upstream_collapse_done(r, u, rc);
+    }
+
     if (u->resolved && u->resolved->ctx) {
         ngx_resolve_name_done(u->resolved->ctx);
         u->resolved->ctx = NULL;
@@ -5055,11 +7317,74 @@ ngx_http_upstream_response_time_variable(ngx_http_request_t *r,
                 break;
             }
 
-            continue;
-        }
+            continue;
+        }
+    }
+
+    v->len = p - v->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_queue_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char      *p;
+    ngx_msec_t   ms;
+
+    if (r->upstream == NULL || r->upstream->waiter == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ms = r->upstream->waiter->time;
+
+    v->len = ngx_sprintf(p, "%T.%03M", (time_t) ms / 1000, ms % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_queue_stat_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char      *p;
+    ngx_uint_t  *stat;
+
+    if (r->upstream == NULL
+        || r->upstream->upstream == NULL
+        || r->upstream->upstream->queue == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
 
-    v->len = p - v->data;
+    /* the counters of the queue of the upstream in this worker */
+
+    stat = (ngx_uint_t *) ((char *) r->upstream->upstream->queue + data);
+
+    v->len = ngx_sprintf(p, "%ui", *stat) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
 
     return NGX_OK;
 }
@@ -5251,6 +7576,37 @@ ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+
+static ngx_int_t
+ngx_http_upstream_cache_stat(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char        *p;
+    ngx_atomic_t  *stat;
+
+    if (r->cache == NULL || r->cache->file_cache == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the counters of the keys zone the request was looked up in */
+
+    stat = (ngx_atomic_t *) ((char *) r->cache->file_cache->sh + data);
+
+    v->len = ngx_sprintf(p, "%uA", *stat) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
 #endif
 
 
@@ -5279,7 +7635,9 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
                                          |NGX_HTTP_UPSTREAM_MAX_FAILS
                                          |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
                                          |NGX_HTTP_UPSTREAM_DOWN
-                                         |NGX_HTTP_UPSTREAM_BACKUP);
+                                         |NGX_HTTP_UPSTREAM_BACKUP
+                                         |NGX_HTTP_UPSTREAM_SLOW_START
+                                         |NGX_HTTP_UPSTREAM_MAX_CONNS);
     if (uscf == NULL) {
         return NGX_CONF_ERROR;
     }
@@ -5377,8 +7735,9 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     time_t                       fail_timeout;
     ngx_str_t                   *value, s;
     ngx_url_t                    u;
-    ngx_int_t                    weight, max_fails;
-    ngx_uint_t                   i;
+    ngx_int_t                    n, weight, max_fails;
+    ngx_msec_t                   slow_start;
+    ngx_uint_t                   i, resolve, max_conns;
     ngx_http_upstream_server_t  *us;
 
     us = ngx_array_push(uscf->servers);
@@ -5393,6 +7752,9 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     weight = 1;
     max_fails = 1;
     fail_timeout = 10;
+    slow_start = 0;
+    max_conns = 0;
+    resolve = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
 
@@ -5444,6 +7806,41 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "slow_start=", 11) == 0) {
+
+            if (!(uscf->flags & NGX_HTTP_UPSTREAM_SLOW_START)) {
+                goto not_supported;
+            }
+
+            s.len = value[i].len - 11;
+            s.data = &value[i].data[11];
+
+            slow_start = ngx_parse_time(&s, 0);
+
+            if (slow_start == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_conns=", 10) == 0) {
+
+            if (!(uscf->flags & NGX_HTTP_UPSTREAM_MAX_CONNS)) {
+                goto not_supported;
+            }
+
+            n = ngx_atoi(&value[i].data[10], value[i].len - 10);
+
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            max_conns = n;
+
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "backup") == 0) {
 
             if (!(uscf->flags & NGX_HTTP_UPSTREAM_BACKUP)) {
@@ -5466,6 +7863,11 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            resolve = 1;
+            continue;
+        }
+
         goto invalid;
     }
 
@@ -5489,6 +7891,28 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     us->weight = weight;
     us->max_fails = max_fails;
     us->fail_timeout = fail_timeout;
+    us->slow_start = slow_start;
+    us->max_conns = max_conns;
+
+    if (resolve) {
+
+        if (u.family == AF_UNIX) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"resolve\" cannot be used with \"%V\"",
+                               &u.url);
+            return NGX_CONF_ERROR;
+        }
+
+        /* addresses given literally never change */
+
+        if (ngx_inet_addr(u.host.data, u.host.len) == INADDR_NONE
+            && u.host.data[0] != '[')
+        {
+            us->host = u.host;
+            us->port = u.port;
+            us->resolve = 1;
+        }
+    }
 
     return NGX_CONF_OK;
 
@@ -5509,6 +7933,76 @@ not_supported:
 }
 
 
+static char *
+ngx_http_upstream_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    ngx_int_t                   n;
+    ngx_str_t                  *value, s;
+    ngx_msec_t                  timeout;
+    ngx_http_upstream_queue_t  *q;
+
+    if (uscf->queue) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    timeout = 60000;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "timeout=", 8) != 0) {
+            goto invalid;
+        }
+
+        s.len = value[2].len - 8;
+        s.data = value[2].data + 8;
+
+        timeout = ngx_parse_time(&s, 0);
+
+        if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+            goto invalid;
+        }
+    }
+
+    q = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_queue_t));
+    if (q == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_queue_init(&q->waiting);
+
+    q->max = n;
+    q->timeout = timeout;
+
+    q->retry.handler = ngx_http_upstream_queue_retry_handler;
+    q->retry.data = q;
+    q->retry.log = &cf->cycle->new_log;
+    q->retry.cancelable = 1;
+
+    uscf->queue = q;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[2]);
+
+    return NGX_CONF_ERROR;
+}
+
+
 ngx_http_upstream_srv_conf_t *
 ngx_http_upstream_add(ngx_conf_t *cf, ngx_url_t *u, ngx_uint_t flags)
 {
@@ -5634,6 +8128,7 @@ ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 
     ngx_int_t                           rc;
     ngx_str_t                          *value;
+    ngx_uint_t                          i, n;
     ngx_http_complex_value_t            cv;
     ngx_http_upstream_local_t         **plocal, *local;
     ngx_http_compile_complex_value_t    ccv;
@@ -5645,22 +8140,13 @@ ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     }
 
     value = cf->args->elts;
+    n = cf->args->nelts - 1;
 
-    if (ngx_strcmp(value[1].data, "off") == 0) {
+    if (n == 1 && ngx_strcmp(value[1].data, "off") == 0) {
         *plocal = NULL;
         return NGX_CONF_OK;
     }
 
-    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
-
-    ccv.cf = cf;
-    ccv.value = &value[1];
-    ccv.complex_value = &cv;
-
-    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-        return NGX_CONF_ERROR;
-    }
-
     local = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_local_t));
     if (local == NULL) {
         return NGX_CONF_ERROR;
@@ -5668,67 +8154,95 @@ ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 
     *plocal = local;
 
-    if (cv.lengths) {
-        local->value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
-        if (local->value == NULL) {
+    if (n == 1) {
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &value[1];
+        ccv.complex_value = &cv;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
             return NGX_CONF_ERROR;
         }
 
-        *local->value = cv;
+        if (cv.lengths) {
+            local->value = ngx_palloc(cf->pool,
+                                      sizeof(ngx_http_complex_value_t));
+            if (local->value == NULL) {
+                return NGX_CONF_ERROR;
+            }
 
-        return NGX_CONF_OK;
+            *local->value = cv;
+
+            return NGX_CONF_OK;
+        }
     }
 
-    local->addr = ngx_palloc(cf->pool, sizeof(ngx_addr_t));
+    /* a pool of addresses, a connection is bound to one of them */
+
+    local->addr = ngx_pcalloc(cf->pool, n * sizeof(ngx_addr_t));
     if (local->addr == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    rc = ngx_parse_addr(cf->pool, local->addr, value[1].data, value[1].len);
+    local->naddrs = n;
 
-    switch (rc) {
-    case NGX_OK:
-        local->addr->name = value[1];
-        return NGX_CONF_OK;
+    for (i = 0; i < n; i++) {
 
-    case NGX_DECLINED:
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid address \"%V\"", &value[1]);
-        /* fall through */
+        rc = ngx_parse_addr(cf->pool, &local->addr[i], value[i + 1].data,
+                            value[i + 1].len);
 
-    default:
-        return NGX_CONF_ERROR;
+        switch (rc) {
+        case NGX_OK:
+            local->addr[i].name = value[i + 1];
+            break;
+
+        case NGX_DECLINED:
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid address \"%V\"", &value[i + 1]);
+            /* fall through */
+
+        default:
+            return NGX_CONF_ERROR;
+        }
     }
+
+    return NGX_CONF_OK;
 }
 
 
-static ngx_addr_t *
-ngx_http_upstream_get_local(ngx_http_request_t *r,
+static void
+ngx_http_upstream_set_local(ngx_http_request_t *r, ngx_http_upstream_t *u,
     ngx_http_upstream_local_t *local)
 {
     ngx_int_t    rc;
     ngx_str_t    val;
     ngx_addr_t  *addr;
 
+    u->peer.local = NULL;
+    u->peer.nlocal = 0;
+
     if (local == NULL) {
-        return NULL;
+        return;
     }
 
     if (local->value == NULL) {
-        return local->addr;
+        u->peer.local = local->addr;
+        u->peer.nlocal = local->naddrs;
+        return;
     }
 
     if (ngx_http_complex_value(r, local->value, &val) != NGX_OK) {
-        return NULL;
+        return;
     }
 
     if (val.len == 0) {
-        return NULL;
+        return;
     }
 
     addr = ngx_palloc(r->pool, sizeof(ngx_addr_t));
     if (addr == NULL) {
-        return NULL;
+        return;
     }
 
     rc = ngx_parse_addr(r->pool, addr, val.data, val.len);
@@ -5736,7 +8250,9 @@ ngx_http_upstream_get_local(ngx_http_request_t *r,
     switch (rc) {
     case NGX_OK:
         addr->name = val;
-        return addr;
+        u->peer.local = addr;
+        u->peer.nlocal = 1;
+        return;
 
     case NGX_DECLINED:
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -5744,8 +8260,98 @@ ngx_http_upstream_get_local(ngx_http_request_t *r,
         /* fall through */
 
     default:
-        return NULL;
+        return;
+    }
+}
+
+
+char *
+ngx_http_upstream_hedge_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ngx_int_t                         n;
+    ngx_str_t                        *value, s;
+    ngx_http_upstream_hedge_conf_t  **phedge, *hedge;
+
+    phedge = (ngx_http_upstream_hedge_conf_t **) (p + cmd->offset);
+
+    if (*phedge != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts > 2) {
+            return "has invalid number of arguments";
+        }
+
+        *phedge = NULL;
+        return NGX_CONF_OK;
+    }
+
+    hedge = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hedge_conf_t));
+    if (hedge == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (value[1].len == 3 && value[1].data[0] == 'p') {
+        n = ngx_atoi(value[1].data + 1, 2);
+
+        if (n < 50 || n > 99) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid percentile \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        hedge->percentile = n;
+
+    } else {
+        hedge->after = ngx_parse_time(&value[1], 0);
+
+        if (hedge->after == (ngx_msec_t) NGX_ERROR || hedge->after == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid time \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* 10% of requests by default */
+
+    hedge->budget = 1000;
+
+    if (cf->args->nelts > 2) {
+        if (ngx_strncmp(value[2].data, "budget=", 7) != 0
+            || value[2].len < 9
+            || value[2].data[value[2].len - 1] != '%')
+        {
+            goto invalid;
+        }
+
+        s.len = value[2].len - 8;
+        s.data = value[2].data + 7;
+
+        n = ngx_atofp(s.data, s.len, 2);
+
+        if (n == NGX_ERROR || n == 0 || n > 10000) {
+            goto invalid;
+        }
+
+        hedge->budget = n;
     }
+
+    *phedge = hedge;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[2]);
+
+    return NGX_CONF_ERROR;
 }
 
 
@@ -5939,6 +8545,10 @@ ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf)
     ngx_http_upstream_header_t     *header;
     ngx_http_upstream_srv_conf_t  **uscfp;
 
+    ngx_rbtree_init(&ngx_http_upstream_collapse_tree,
+                    &ngx_http_upstream_collapse_sentinel,
+                    ngx_str_rbtree_insert_value);
+
     uscfp = umcf->upstreams.elts;
 
     for (i = 0; i < umcf->upstreams.nelts; i++) {
@@ -5985,3 +8595,47 @@ ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static ngx_int_t
+ngx_http_upstream_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->peer.update
+            && uscfp[i]->peer.update(uscfp[i], cycle->log) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        /* upstreams with servers to re-resolve */
+
+        if (uscfp[i]->resolver == NULL) {
+            continue;
+        }
+
+        if (ngx_http_upstream_resolve_round_robin(cycle, uscfp[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
@@ -80,11 +80,15 @@ typedef ngx_int_t (*ngx_http_upstream_init_pt)(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us);
 typedef ngx_int_t (*ngx_http_upstream_init_peer_pt)(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us);
+typedef ngx_int_t (*ngx_http_upstream_update_pt)(
+    ngx_http_upstream_srv_conf_t *us, ngx_log_t *log);
 
 
 typedef struct {
     ngx_http_upstream_init_pt        init_upstream;
     ngx_http_upstream_init_peer_pt   init;
+    /* called in a worker process when it starts and the peers changed */
+    ngx_http_upstream_update_pt      update;
     void                            *data;
 } ngx_http_upstream_peer_t;
 
@@ -96,9 +100,16 @@ typedef struct {
     ngx_uint_t                       weight;
     ngx_uint_t                       max_fails;
     time_t                           fail_timeout;
+    ngx_msec_t                       slow_start;
+    ngx_uint_t                       max_conns;
+
+    /* the name and the port to re-resolve the addresses with */
+    ngx_str_t                        host;
+    in_port_t                        port;
 
     unsigned                         down:1;
     unsigned                         backup:1;
+    unsigned                         resolve:1;
 } ngx_http_upstream_server_t;
 
 
@@ -108,6 +119,30 @@ typedef struct {
 #define NGX_HTTP_UPSTREAM_FAIL_TIMEOUT  0x0008
 #define NGX_HTTP_UPSTREAM_DOWN          0x0010
 #define NGX_HTTP_UPSTREAM_BACKUP        0x0020
+#define NGX_HTTP_UPSTREAM_SLOW_START    0x0040
+#define NGX_HTTP_UPSTREAM_MAX_CONNS     0x0080
+
+
+/* the requests waiting in a worker for a peer to become available */
+
+typedef struct {
+    ngx_queue_t                      waiting;
+    ngx_uint_t                       length;
+    ngx_uint_t                       max;
+    ngx_msec_t                       timeout;
+
+    /* the peers freed by other workers or back after fail_timeout */
+    ngx_event_t                      retry;
+
+    /* the counters, exposed as $upstream_queue_* variables */
+    ngx_uint_t                       queued;
+    ngx_uint_t                       rejected;
+    ngx_uint_t                       timedout;
+    ngx_uint_t                       wait_time;
+} ngx_http_upstream_queue_t;
+
+
+typedef struct ngx_http_upstream_waiter_s  ngx_http_upstream_waiter_t;
 
 
 struct ngx_http_upstream_srv_conf_s {
@@ -123,15 +158,49 @@ struct ngx_http_upstream_srv_conf_s {
     in_port_t                        port;
     in_port_t                        default_port;
     ngx_uint_t                       no_port;  /* unsigned no_port:1 */
+
+    /* re-resolves the servers marked with the "resolve" parameter */
+    ngx_resolver_t                  *resolver;
+    ngx_msec_t                       resolver_timeout;
+
+    ngx_http_upstream_queue_t       *queue;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_shm_zone_t                  *shm_zone;
+#endif
 };
 
 
 typedef struct {
     ngx_addr_t                      *addr;
+    ngx_uint_t                       naddrs;
     ngx_http_complex_value_t        *value;
 } ngx_http_upstream_local_t;
 
 
+#define NGX_HTTP_UPSTREAM_HEDGE_BUCKETS  104
+
+
+typedef struct {
+    ngx_msec_t                       after;
+    ngx_uint_t                       percentile;
+    ngx_uint_t                       budget;       /* in 1/100 of percent */
+
+    /* the per worker budget left, and the histogram of the header times */
+    ngx_uint_t                       tokens;
+    ngx_uint_t                       total;
+    ngx_uint_t                       pending;
+    ngx_msec_t                       threshold;
+    ngx_uint_t                       hist[NGX_HTTP_UPSTREAM_HEDGE_BUCKETS];
+} ngx_http_upstream_hedge_conf_t;
+
+
+typedef struct ngx_http_upstream_hedge_s  ngx_http_upstream_hedge_t;
+typedef struct ngx_http_upstream_collapse_s  ngx_http_upstream_collapse_t;
+typedef struct ngx_http_upstream_follower_s  ngx_http_upstream_follower_t;
+typedef struct ngx_http_upstream_splice_s  ngx_http_upstream_splice_t;
+
+
 typedef struct {
     ngx_http_upstream_srv_conf_t    *upstream;
 
@@ -154,6 +223,8 @@ typedef struct {
     size_t                           temp_file_write_size_conf;
 
     ngx_bufs_t                       bufs;
+    ngx_uint_t                       buffers_max;
+    size_t                           buffers_budget;
 
     ngx_uint_t                       ignore_headers;
     ngx_uint_t                       next_upstream;
@@ -177,6 +248,14 @@ typedef struct {
 
     ngx_http_upstream_local_t       *local;
 
+    ngx_http_upstream_hedge_conf_t  *hedge;
+
+    ngx_flag_t                       collapse;
+    size_t                           collapse_max_size;
+    ngx_http_complex_value_t        *collapse_key;
+
+    ngx_flag_t                       splice;
+
 #if (NGX_HTTP_CACHE)
     ngx_shm_zone_t                  *cache_zone;
     ngx_http_complex_value_t        *cache_value;
@@ -206,6 +285,10 @@ typedef struct {
     unsigned                         intercept_404:1;
     unsigned                         change_buffering:1;
 
+    /* the collapse key varies with the request credentials */
+    unsigned                         collapse_authorization:1;
+    unsigned                         collapse_cookie:1;
+
 #if (NGX_HTTP_SSL)
     ngx_ssl_t                       *ssl;
     ngx_flag_t                       ssl_session_reuse;
@@ -268,6 +351,9 @@ typedef struct {
 
     unsigned                         connection_close:1;
     unsigned                         chunked:1;
+
+    /* the header lines point into u->buffer */
+    unsigned                         in_buffer:1;
 } ngx_http_upstream_headers_in_t;
 
 
@@ -341,8 +427,19 @@ struct ngx_http_upstream_s {
 
     ngx_msec_t                       timeout;
 
+    ngx_http_upstream_srv_conf_t    *upstream;
+
     ngx_http_upstream_state_t       *state;
 
+    ngx_http_upstream_hedge_t       *hedge;
+
+    ngx_http_upstream_waiter_t      *waiter;
+
+    ngx_http_upstream_collapse_t    *collapse;
+    ngx_http_upstream_follower_t    *follower;
+
+    ngx_http_upstream_splice_t      *splice;
+
     ngx_str_t                        method;
     ngx_str_t                        schema;
     ngx_str_t                        uri;
@@ -396,6 +493,9 @@ char *ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 char *ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+char *ngx_http_upstream_hedge_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+void ngx_http_upstream_queue_wake(ngx_http_upstream_queue_t *queue);
 ngx_int_t ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
     ngx_str_t *default_hide_headers, ngx_hash_init_t *hash);
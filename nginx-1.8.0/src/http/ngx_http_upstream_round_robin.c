@@ -14,8 +14,48 @@
                                     + ((p)->next ? (p)->next->number : 0))
 
 
+#define NGX_HTTP_UPSTREAM_RESOLVE_RETRY  5000
+
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t   *upstream;
+    ngx_http_upstream_server_t     *server;
+    ngx_event_t                     event;
+} ngx_http_upstream_rr_resolve_t;
+
+
+static void ngx_http_upstream_rr_slow_start_new(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_get_peer(
     ngx_http_upstream_rr_peer_data_t *rrp);
+static void ngx_http_upstream_rr_resolve_handler(ngx_event_t *ev);
+static void ngx_http_upstream_rr_resolved(ngx_resolver_ctx_t *ctx);
+static ngx_addr_t *ngx_http_upstream_rr_copy_addrs(ngx_pool_t *pool,
+    ngx_resolver_ctx_t *ctx, in_port_t port);
+static ngx_int_t ngx_http_upstream_rr_update_peers(
+    ngx_http_upstream_srv_conf_t *us, ngx_http_upstream_server_t *server,
+    ngx_addr_t *addrs, ngx_uint_t naddrs, ngx_log_t *log);
+static ngx_uint_t ngx_http_upstream_rr_addrs_changed(
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_server_t *server,
+    ngx_addr_t *addrs, ngx_uint_t naddrs);
+static ngx_http_upstream_rr_peers_t *ngx_http_upstream_rr_copy_peers(
+    ngx_http_upstream_rr_peers_t *old, ngx_http_upstream_server_t *server,
+    ngx_addr_t *addrs, ngx_uint_t naddrs, ngx_slab_pool_t *shpool,
+    ngx_log_t *log);
+static u_char *ngx_http_upstream_rr_add_peers(
+    ngx_http_upstream_rr_peer_t *peer, ngx_http_upstream_server_t *server,
+    ngx_http_upstream_rr_peers_t *old, ngx_addr_t *addrs, ngx_uint_t naddrs,
+    ngx_uint_t move, u_char *p);
+static void ngx_http_upstream_rr_copy_peer(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_rr_peer_t *prev, ngx_uint_t move);
+static u_char *ngx_http_upstream_rr_copy_addr(
+    ngx_http_upstream_rr_peer_t *peer, struct sockaddr *sockaddr,
+    socklen_t socklen, ngx_str_t *name, u_char *p);
+static void ngx_http_upstream_rr_free_moved_conn(
+    ngx_http_upstream_rr_peer_data_t *rrp, ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_rr_release_peers(void *data);
+static void ngx_http_upstream_rr_free_peers(
+    ngx_http_upstream_rr_peers_t *peers);
 
 #if (NGX_HTTP_SSL)
 
@@ -33,6 +73,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 {
     ngx_url_t                      u;
     ngx_uint_t                     i, j, n, w;
+    ngx_http_core_loc_conf_t      *clcf;
     ngx_http_upstream_server_t    *server;
     ngx_http_upstream_rr_peer_t   *peer;
     ngx_http_upstream_rr_peers_t  *peers, *backup;
@@ -42,6 +83,40 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     if (us->servers) {
         server = us->servers->elts;
 
+        for (i = 0; i < us->servers->nelts; i++) {
+            if (server[i].resolve) {
+                break;
+            }
+        }
+
+        if (i < us->servers->nelts) {
+
+            /*
+             * servers are re-resolved with the resolver of http{},
+             * a dummy one is created there if none is defined
+             */
+
+            clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+            if (clcf->resolver == NULL
+                || clcf->resolver->udp_connections.nelts == 0)
+            {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "no resolver defined to resolve \"%V\" "
+                              "in upstream \"%V\" in %s:%ui",
+                              &server[i].host, &us->host,
+                              us->file_name, us->line);
+                return NGX_ERROR;
+            }
+
+            us->resolver = clcf->resolver;
+            us->resolver_timeout = clcf->resolver_timeout;
+
+            if (us->resolver_timeout == NGX_CONF_UNSET_MSEC) {
+                us->resolver_timeout = 30000;
+            }
+        }
+
         n = 0;
         w = 0;
 
@@ -90,6 +165,8 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].current_weight = 0;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
+                peer[n].max_conns = server[i].max_conns;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
                 n++;
@@ -113,6 +190,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         }
 
         if (n == 0) {
+            ngx_http_upstream_rr_slow_start_new(cf, us);
             return NGX_OK;
         }
 
@@ -146,6 +224,8 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].current_weight = 0;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
+                peer[n].max_conns = server[i].max_conns;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
                 n++;
@@ -154,6 +234,8 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 
         peers->next = backup;
 
+        ngx_http_upstream_rr_slow_start_new(cf, us);
+
         return NGX_OK;
     }
 
@@ -217,11 +299,99 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 }
 
 
+static void
+ngx_http_upstream_rr_slow_start_new(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                      i, j;
+    ngx_cycle_t                    *old_cycle;
+    ngx_http_upstream_rr_peer_t    *peer, *prev;
+    ngx_http_upstream_rr_peers_t   *peers, *old, *o;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    /*
+     * the servers added to the upstream on reload start slowly,
+     * the servers it had before keep their full weight
+     */
+
+    old_cycle = cf->cycle->old_cycle;
+
+    if (ngx_is_init_cycle(old_cycle)) {
+        return;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(old_cycle,
+                                               ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return;
+    }
+
+    old = NULL;
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->servers
+            && uscfp[i]->host.len == us->host.len
+            && ngx_strncasecmp(uscfp[i]->host.data, us->host.data,
+                               us->host.len)
+               == 0)
+        {
+            old = uscfp[i]->peer.data;
+            break;
+        }
+    }
+
+    if (old == NULL) {
+        return;
+    }
+
+    for (peers = us->peer.data; peers; peers = peers->next) {
+        for (i = 0; i < peers->number; i++) {
+            peer = &peers->peer[i];
+
+            if (peer->slow_start == 0) {
+                continue;
+            }
+
+            for (o = old; o; o = o->next) {
+                for (j = 0; j < o->number; j++) {
+                    prev = &o->peer[j];
+
+                    if (prev->server.len == peer->server.len
+                        && ngx_strncmp(prev->server.data, peer->server.data,
+                                       peer->server.len)
+                           == 0
+                        && ngx_cmp_sockaddr(prev->sockaddr, prev->socklen,
+                                            peer->sockaddr, peer->socklen, 1)
+                           == NGX_OK)
+                    {
+                        goto next;
+                    }
+                }
+            }
+
+            ngx_http_upstream_rr_peer_slow_start(peer);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                           "upstream \"%V\" slow start new peer %V",
+                           &us->host, &peer->name);
+
+        next:
+
+            continue;
+        }
+    }
+}
+
+
 ngx_int_t
 ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us)
 {
     ngx_uint_t                         n;
+    ngx_pool_cleanup_t                *cln;
+    ngx_http_upstream_rr_peers_t      *peers;
     ngx_http_upstream_rr_peer_data_t  *rrp;
 
     rrp = r->upstream->peer.data;
@@ -235,8 +405,29 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
         r->upstream->peer.data = rrp;
     }
 
-    rrp->peers = us->peer.data;
+    peers = us->peer.data;
+
+    if (us->resolver) {
+
+        /* the peers rebuilt are kept until the request is finished */
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        peers = ngx_http_upstream_rr_peers_acquire(us);
+
+        if (peers != us->peer.data) {
+            cln->handler = ngx_http_upstream_rr_release_peers;
+            cln->data = peers;
+        }
+    }
+
+    rrp->peers = peers;
+    rrp->origin = us->resolver ? us->peer.data : NULL;
     rrp->current = 0;
+    rrp->queue = us->queue;
 
     n = rrp->peers->number;
 
@@ -271,6 +462,41 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
 }
 
 
+ngx_http_upstream_rr_peers_t *
+ngx_http_upstream_rr_peers_acquire(ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_rr_peers_t  *peers, *current;
+
+    peers = us->peer.data;
+
+    if (us->resolver == NULL) {
+        return peers;
+    }
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    current = peers->current;
+
+    if (current) {
+        (void) ngx_atomic_fetch_add(&current->refs, 1);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return current ? current : peers;
+}
+
+
+void
+ngx_http_upstream_rr_peers_release(ngx_http_upstream_srv_conf_t *us,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    if (peers != us->peer.data) {
+        ngx_http_upstream_rr_release_peers(peers);
+    }
+}
+
+
 ngx_int_t
 ngx_http_upstream_create_round_robin_peer(ngx_http_request_t *r,
     ngx_http_upstream_resolved_t *ur)
@@ -360,7 +586,9 @@ ngx_http_upstream_create_round_robin_peer(ngx_http_request_t *r,
     }
 
     rrp->peers = peers;
+    rrp->origin = NULL;
     rrp->current = 0;
+    rrp->queue = NULL;
 
     if (rrp->peers->number <= 8 * sizeof(uintptr_t)) {
         rrp->tried = &rrp->data;
@@ -406,12 +634,16 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
 
     peers = rrp->peers;
 
-    /* ngx_lock_mutex(peers->mutex); */
+    ngx_http_upstream_rr_peers_lock(peers);
 
     if (peers->single) {
         peer = &peers->peer[0];
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
+            goto failed;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
             goto failed;
         }
 
@@ -434,7 +666,9 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     pc->socklen = peer->socklen;
     pc->name = &peer->name;
 
-    /* ngx_unlock_mutex(peers->mutex); */
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
 
     return NGX_OK;
 
@@ -442,7 +676,7 @@ failed:
 
     if (peers->next) {
 
-        /* ngx_unlock_mutex(peers->mutex); */
+        ngx_http_upstream_rr_peers_unlock(peers);
 
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "backup servers");
 
@@ -461,7 +695,7 @@ failed:
             return rc;
         }
 
-        /* ngx_lock_mutex(peers->mutex); */
+        ngx_http_upstream_rr_peers_lock(peers);
     }
 
     /* all peers failed, mark them as live for quick recovery */
@@ -470,7 +704,7 @@ failed:
         peers->peer[i].fails = 0;
     }
 
-    /* ngx_unlock_mutex(peers->mutex); */
+    ngx_http_upstream_rr_peers_unlock(peers);
 
     pc->name = peers->name;
 
@@ -483,7 +717,7 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
 {
     time_t                        now;
     uintptr_t                     m;
-    ngx_int_t                     total;
+    ngx_int_t                     w, total;
     ngx_uint_t                    i, n;
     ngx_http_upstream_rr_peer_t  *peer, *best;
 
@@ -503,7 +737,7 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
 
         peer = &rrp->peers->peer[i];
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             continue;
         }
 
@@ -514,8 +748,14 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        peer->current_weight += peer->effective_weight;
-        total += peer->effective_weight;
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        w = peer->effective_weight * ngx_http_upstream_rr_peer_ramp(peer);
+
+        peer->current_weight += w;
+        total += w;
 
         if (peer->effective_weight < peer->weight) {
             peer->effective_weight++;
@@ -556,6 +796,7 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     ngx_http_upstream_rr_peer_data_t  *rrp = data;
 
     time_t                       now;
+    ngx_uint_t                   started, moved;
     ngx_http_upstream_rr_peer_t  *peer;
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
@@ -563,18 +804,29 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
     /* TODO: NGX_PEER_KEEPALIVE */
 
+    peer = &rrp->peers->peer[rrp->current];
+    started = 0;
+    moved = 0;
+
+    ngx_http_upstream_rr_peers_lock(rrp->peers);
+
+    peer->conns--;
+
+    if (peer->moved) {
+        peer->moved--;
+        moved = 1;
+    }
+
     if (rrp->peers->single) {
+        ngx_http_upstream_rr_peers_unlock(rrp->peers);
+
         pc->tries = 0;
-        return;
+        goto done;
     }
 
-    peer = &rrp->peers->peer[rrp->current];
-
     if (state & NGX_PEER_FAILED) {
         now = ngx_time();
 
-        /* ngx_lock_mutex(rrp->peers->mutex); */
-
         peer->fails++;
         peer->accessed = now;
         peer->checked = now;
@@ -591,25 +843,744 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
             peer->effective_weight = 0;
         }
 
-        /* ngx_unlock_mutex(rrp->peers->mutex); */
-
     } else {
 
         /* mark peer live if check passed */
 
         if (peer->accessed < peer->checked) {
+
+            /* a peer back after fail_timeout starts slowly */
+
+            if (peer->max_fails && peer->fails >= peer->max_fails) {
+                ngx_http_upstream_rr_peer_slow_start(peer);
+                started = peer->slow_start;
+            }
+
             peer->fails = 0;
         }
     }
 
+    ngx_http_upstream_rr_peers_unlock(rrp->peers);
+
+    if (started) {
+        ngx_log_error(NGX_LOG_NOTICE, pc->log, 0,
+                      "peer %V in upstream \"%V\" is back, slow start %Mms",
+                      &peer->name, rrp->peers->name, peer->slow_start);
+    }
+
     if (pc->tries) {
         pc->tries--;
     }
 
-    /* ngx_unlock_mutex(rrp->peers->mutex); */
+done:
+
+    if (moved && rrp->origin) {
+        ngx_http_upstream_rr_free_moved_conn(rrp, peer);
+    }
+
+    /* a request waiting for a peer may try the one released */
+
+    if (rrp->queue) {
+        ngx_http_upstream_queue_wake(rrp->queue);
+    }
+}
+
+
+static void
+ngx_http_upstream_rr_free_moved_conn(ngx_http_upstream_rr_peer_data_t *rrp,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_uint_t                     i;
+    ngx_http_upstream_rr_peer_t   *p;
+    ngx_http_upstream_rr_peers_t  *current, *peers;
+
+    /*
+     * the peers were rebuilt after the connection was counted,
+     * the count was carried over to the peer with the same address
+     */
+
+    ngx_http_upstream_rr_peers_lock(rrp->origin);
+
+    current = rrp->origin->current;
+
+    for (peers = current; peers; peers = peers->next) {
+
+        ngx_http_upstream_rr_peers_lock(peers);
+
+        for (i = 0; i < peers->number; i++) {
+            p = &peers->peer[i];
+
+            if (p->server.data == peer->server.data
+                && ngx_cmp_sockaddr(p->sockaddr, p->socklen,
+                                    peer->sockaddr, peer->socklen, 1)
+                   == NGX_OK)
+            {
+                if (p->conns) {
+                    p->conns--;
+                }
+
+                if (p->carried) {
+                    p->carried--;
+                }
+
+                ngx_http_upstream_rr_peers_unlock(peers);
+                goto done;
+            }
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+    }
+
+done:
+
+    ngx_http_upstream_rr_peers_unlock(rrp->origin);
+}
+
+
+ngx_uint_t
+ngx_http_upstream_rr_peer_ramp_up(ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_uint_t      ramp;
+    ngx_msec_int_t  elapsed;
+
+    elapsed = (ngx_msec_int_t) (ngx_current_msec - peer->start_time);
+
+    if (elapsed >= (ngx_msec_int_t) peer->slow_start) {
+        peer->start_time = 0;
+        return 100;
+    }
+
+    if (elapsed < 0) {
+        elapsed = 0;
+    }
+
+    /* the weight grows linearly from 1% */
+
+    ramp = 1 + 99 * (ngx_msec_t) elapsed / peer->slow_start;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "slow start peer %V: %ui%%", &peer->name, ramp);
+
+    return ramp;
+}
+
+
+ngx_int_t
+ngx_http_upstream_resolve_round_robin(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                       i;
+    ngx_http_upstream_server_t      *server;
+    ngx_http_upstream_rr_resolve_t  *rs;
+
+    server = us->servers->elts;
+
+    for (i = 0; i < us->servers->nelts; i++) {
+
+        if (!server[i].resolve) {
+            continue;
+        }
+
+        rs = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_rr_resolve_t));
+        if (rs == NULL) {
+            return NGX_ERROR;
+        }
+
+        rs->upstream = us;
+        rs->server = &server[i];
+
+        rs->event.handler = ngx_http_upstream_rr_resolve_handler;
+        rs->event.data = rs;
+        rs->event.log = cycle->log;
+        rs->event.cancelable = 1;
+
+        /*
+         * the addresses resolved at startup are used until the resolver
+         * answers the first time
+         */
+
+        ngx_add_timer(&rs->event, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_rr_resolve_handler(ngx_event_t *ev)
+{
+    ngx_resolver_ctx_t              *ctx;
+    ngx_http_upstream_rr_resolve_t  *rs;
+
+    rs = ev->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "upstream resolve \"%V\"", &rs->server->host);
+
+    ctx = ngx_resolve_start(rs->upstream->resolver, NULL);
+    if (ctx == NULL) {
+        goto failed;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "no resolver defined to resolve %V",
+                      &rs->server->host);
+        return;
+    }
+
+    ctx->name = rs->server->host;
+    ctx->handler = ngx_http_upstream_rr_resolved;
+    ctx->data = rs;
+    ctx->timeout = rs->upstream->resolver_timeout;
+
+    if (ngx_resolve_name(ctx) == NGX_OK) {
+        return;
+    }
+
+failed:
+
+    ngx_add_timer(ev, NGX_HTTP_UPSTREAM_RESOLVE_RETRY);
+}
+
+
+static void
+ngx_http_upstream_rr_resolved(ngx_resolver_ctx_t *ctx)
+{
+    ngx_http_upstream_rr_resolve_t *rs = ctx->data;
+
+    time_t                       valid;
+    ngx_int_t                    rc;
+    ngx_msec_t                   timer;
+    ngx_pool_t                  *pool;
+    ngx_addr_t                  *addrs;
+    ngx_http_upstream_server_t  *server;
+
+    server = rs->server;
+    timer = NGX_HTTP_UPSTREAM_RESOLVE_RETRY;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_WARN, rs->event.log, 0,
+                      "%V could not be resolved (%i: %s), "
+                      "upstream \"%V\" keeps previous addresses",
+                      &server->host, ctx->state,
+                      ngx_resolver_strerror(ctx->state),
+                      &rs->upstream->host);
+        goto done;
+    }
+
+    pool = ngx_create_pool(1024, rs->event.log);
+    if (pool == NULL) {
+        goto done;
+    }
+
+    addrs = ngx_http_upstream_rr_copy_addrs(pool, ctx, server->port);
+
+    if (addrs) {
+        rc = ngx_http_upstream_rr_update_peers(rs->upstream, server, addrs,
+                                               ctx->naddrs, rs->event.log);
+
+    } else {
+        rc = NGX_ERROR;
+    }
+
+    ngx_destroy_pool(pool);
+
+    if (rc == NGX_ERROR) {
+        goto done;
+    }
+
+    if (rc == NGX_OK) {
+        ngx_log_error(NGX_LOG_NOTICE, rs->event.log, 0,
+                      "%V resolved to %ui addresses in upstream \"%V\"",
+                      &server->host, ctx->naddrs, &rs->upstream->host);
+    }
+
+    /* in a shared zone the peers may have been rebuilt by another worker */
+
+    if (rs->upstream->peer.update) {
+        (void) rs->upstream->peer.update(rs->upstream, rs->event.log);
+    }
+
+    valid = ctx->valid - ngx_time();
+    timer = (valid > 0) ? (ngx_msec_t) valid * 1000 : 1000;
+
+done:
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, rs->event.log, 0,
+                   "upstream resolve \"%V\" next in %M",
+                   &server->host, timer);
+
+    ngx_resolve_name_done(ctx);
+
+    ngx_add_timer(&rs->event, timer);
 }
 
 
+static ngx_addr_t *
+ngx_http_upstream_rr_copy_addrs(ngx_pool_t *pool, ngx_resolver_ctx_t *ctx,
+    in_port_t port)
+{
+    u_char           *p;
+    size_t            len;
+    socklen_t         socklen;
+    ngx_uint_t        i;
+    ngx_addr_t       *addrs;
+    struct sockaddr  *sockaddr;
+
+    addrs = ngx_pcalloc(pool, ctx->naddrs * sizeof(ngx_addr_t));
+    if (addrs == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < ctx->naddrs; i++) {
+
+        socklen = ctx->addrs[i].socklen;
+
+        sockaddr = ngx_palloc(pool, socklen);
+        if (sockaddr == NULL) {
+            return NULL;
+        }
+
+        ngx_memcpy(sockaddr, ctx->addrs[i].sockaddr, socklen);
+
+        switch (sockaddr->sa_family) {
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            ((struct sockaddr_in6 *) sockaddr)->sin6_port = htons(port);
+            break;
+#endif
+        default: /* AF_INET */
+            ((struct sockaddr_in *) sockaddr)->sin_port = htons(port);
+        }
+
+        p = ngx_pnalloc(pool, NGX_SOCKADDR_STRLEN);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        len = ngx_sock_ntop(sockaddr, socklen, p, NGX_SOCKADDR_STRLEN, 1);
+
+        addrs[i].sockaddr = sockaddr;
+        addrs[i].socklen = socklen;
+        addrs[i].name.len = len;
+        addrs[i].name.data = p;
+    }
+
+    return addrs;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_rr_update_peers(ngx_http_upstream_srv_conf_t *us,
+    ngx_http_upstream_server_t *server, ngx_addr_t *addrs, ngx_uint_t naddrs,
+    ngx_log_t *log)
+{
+    ngx_http_upstream_rr_peers_t  *peers, *old, *current;
+
+    peers = us->peer.data;
+
+    /*
+     * the configured peers refer to the current ones; in a shared zone
+     * the peers may have been already rebuilt by another worker process
+     */
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    old = peers->current ? peers->current : peers;
+
+    if (!ngx_http_upstream_rr_addrs_changed(old, server, addrs, naddrs)) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return NGX_DECLINED;
+    }
+
+    if (old != peers) {
+        ngx_http_upstream_rr_peers_lock(old);
+    }
+
+    current = ngx_http_upstream_rr_copy_peers(old, server, addrs, naddrs,
+                                              peers->shpool, log);
+
+    if (old != peers) {
+        ngx_http_upstream_rr_peers_unlock(old);
+    }
+
+    if (current == NULL) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return NGX_ERROR;
+    }
+
+    current->refs = 1;
+
+    old = peers->current;
+    peers->current = current;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    /* requests in progress keep the previous peers until finalized */
+
+    if (old) {
+        ngx_http_upstream_rr_release_peers(old);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_rr_addrs_changed(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_server_t *server, ngx_addr_t *addrs, ngx_uint_t naddrs)
+{
+    ngx_uint_t                     i, j, n;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *p;
+
+    /* the order of the addresses rotated by a DNS server does not matter */
+
+    n = 0;
+
+    for (p = peers; p; p = p->next) {
+
+        for (i = 0; i < p->number; i++) {
+            peer = &p->peer[i];
+
+            if (peer->server.data != server->name.data) {
+                continue;
+            }
+
+            for (j = 0; j < naddrs; j++) {
+                if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                     addrs[j].sockaddr, addrs[j].socklen, 1)
+                    == NGX_OK)
+                {
+                    break;
+                }
+            }
+
+            if (j == naddrs) {
+                return 1;
+            }
+
+            n++;
+        }
+    }
+
+    return (n != naddrs);
+}
+
+
+static ngx_http_upstream_rr_peers_t *
+ngx_http_upstream_rr_copy_peers(ngx_http_upstream_rr_peers_t *old,
+    ngx_http_upstream_server_t *server, ngx_addr_t *addrs, ngx_uint_t naddrs,
+    ngx_slab_pool_t *shpool, ngx_log_t *log)
+{
+    u_char                        *p;
+    size_t                         size, len[2];
+    ngx_uint_t                     i, j, k, a, n[2], w, move, added;
+    ngx_http_upstream_rr_peer_t   *peer, *prev;
+    ngx_http_upstream_rr_peers_t  *src[2], *dst[2];
+
+    /*
+     * the primary and backup peers with their addresses are copied into
+     * a single block, the addresses of the server given are replaced
+     */
+
+    src[0] = old;
+    src[1] = old->next;
+
+    size = 0;
+
+    for (k = 0; k < 2; k++) {
+        n[k] = 0;
+
+        for (i = 0; src[k] && i < src[k]->number; i++) {
+            peer = &src[k]->peer[i];
+
+            if (server && peer->server.data == server->name.data) {
+                continue;
+            }
+
+            n[k]++;
+            size += ngx_align(peer->socklen, NGX_ALIGNMENT)
+                    + ngx_align(peer->name.len, NGX_ALIGNMENT);
+        }
+
+        if (server && server->backup == k) {
+            n[k] += naddrs;
+
+            for (a = 0; a < naddrs; a++) {
+                size += ngx_align(addrs[a].socklen, NGX_ALIGNMENT)
+                        + ngx_align(addrs[a].name.len, NGX_ALIGNMENT);
+            }
+        }
+
+        len[k] = n[k] ? ngx_align(sizeof(ngx_http_upstream_rr_peers_t)
+                                  + sizeof(ngx_http_upstream_rr_peer_t)
+                                    * (n[k] - 1), NGX_ALIGNMENT)
+                      : 0;
+        size += len[k];
+    }
+
+    if (n[0] == 0) {
+        return NULL;
+    }
+
+    if (shpool) {
+        p = ngx_slab_alloc(shpool, size);
+
+    } else {
+        p = ngx_alloc(size, log);
+    }
+
+    if (p == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(p, len[0] + len[1]);
+
+    dst[0] = (ngx_http_upstream_rr_peers_t *) p;
+    dst[1] = n[1] ? (ngx_http_upstream_rr_peers_t *) (p + len[0]) : NULL;
+
+    p += len[0] + len[1];
+
+    for (k = 0; k < 2; k++) {
+
+        if (dst[k] == NULL) {
+            continue;
+        }
+
+        peer = dst[k]->peer;
+        move = (src[k] && src[k]->shpool == shpool);
+        added = (server == NULL || server->backup != k);
+
+        for (i = 0, j = 0; src[k] && i < src[k]->number; i++) {
+            prev = &src[k]->peer[i];
+
+            if (server && prev->server.data == server->name.data) {
+
+                /* the new addresses take the place of the previous ones */
+
+                if (!added) {
+                    p = ngx_http_upstream_rr_add_peers(&peer[j], server,
+                                                       src[k], addrs, naddrs,
+                                                       move, p);
+                    j += naddrs;
+                    added = 1;
+                }
+
+                continue;
+            }
+
+            ngx_http_upstream_rr_copy_peer(&peer[j], prev, move);
+
+            p = ngx_http_upstream_rr_copy_addr(&peer[j], prev->sockaddr,
+                                               prev->socklen, &prev->name, p);
+            j++;
+        }
+
+        if (!added) {
+            p = ngx_http_upstream_rr_add_peers(&peer[j], server, src[k],
+                                               addrs, naddrs, move, p);
+        }
+
+        w = 0;
+
+        for (i = 0; i < n[k]; i++) {
+            w += peer[i].weight;
+        }
+
+        dst[k]->single = (n[k] == 1);
+        dst[k]->number = n[k];
+        dst[k]->weighted = (w != n[k]);
+        dst[k]->total_weight = w;
+        dst[k]->name = old->name;
+        dst[k]->shpool = shpool;
+    }
+
+    if (dst[1]) {
+        dst[0]->single = 0;
+        dst[0]->next = dst[1];
+    }
+
+    return dst[0];
+}
+
+
+static u_char *
+ngx_http_upstream_rr_add_peers(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_server_t *server, ngx_http_upstream_rr_peers_t *old,
+    ngx_addr_t *addrs, ngx_uint_t naddrs, ngx_uint_t move, u_char *p)
+{
+    ngx_uint_t                    i, k;
+    ngx_http_upstream_rr_peer_t  *prev;
+
+    for (i = 0; i < naddrs; i++) {
+
+        /* an address which did not change keeps its state */
+
+        for (k = 0; old && k < old->number; k++) {
+            prev = &old->peer[k];
+
+            if (prev->server.data == server->name.data
+                && ngx_cmp_sockaddr(prev->sockaddr, prev->socklen,
+                                    addrs[i].sockaddr, addrs[i].socklen, 1)
+                   == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (old && k < old->number) {
+            ngx_http_upstream_rr_copy_peer(&peer[i], &old->peer[k], move);
+
+        } else {
+            peer[i].weight = server->weight;
+            peer[i].effective_weight = server->weight;
+            peer[i].current_weight = 0;
+            peer[i].max_fails = server->max_fails;
+            peer[i].fail_timeout = server->fail_timeout;
+            peer[i].slow_start = server->slow_start;
+            peer[i].max_conns = server->max_conns;
+            peer[i].down = server->down;
+            peer[i].server = server->name;
+
+            /* a new address starts slowly */
+
+            ngx_http_upstream_rr_peer_slow_start(&peer[i]);
+        }
+
+        p = ngx_http_upstream_rr_copy_addr(&peer[i], addrs[i].sockaddr,
+                                           addrs[i].socklen, &addrs[i].name, p);
+    }
+
+    return p;
+}
+
+
+static void
+ngx_http_upstream_rr_copy_peer(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_rr_peer_t *prev, ngx_uint_t move)
+{
+    /*
+     * the connections in progress are carried over to keep max_conns;
+     * as many releases of the previous peer as it had connections
+     * of its own are passed to the new one, the connections carried
+     * over to the previous peer are passed by its predecessors
+     */
+
+    prev->moved = (prev->conns > prev->carried)
+                  ? prev->conns - prev->carried : 0;
+
+    *peer = *prev;
+
+    peer->carried = peer->conns;
+    peer->moved = 0;
+
+#if (NGX_HTTP_SSL)
+
+    if (move) {
+        prev->ssl_session = NULL;
+        prev->ssl_session_len = 0;
+
+    } else {
+        peer->ssl_session = NULL;
+        peer->ssl_session_len = 0;
+    }
+
+#endif
+}
+
+
+static u_char *
+ngx_http_upstream_rr_copy_addr(ngx_http_upstream_rr_peer_t *peer,
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_str_t *name, u_char *p)
+{
+    peer->sockaddr = (struct sockaddr *) p;
+    peer->socklen = socklen;
+
+    ngx_memcpy(p, sockaddr, socklen);
+    p += ngx_align(socklen, NGX_ALIGNMENT);
+
+    peer->name.len = name->len;
+    peer->name.data = p;
+
+    ngx_memcpy(p, name->data, name->len);
+    p += ngx_align(name->len, NGX_ALIGNMENT);
+
+    return p;
+}
+
+
+static void
+ngx_http_upstream_rr_release_peers(void *data)
+{
+    ngx_http_upstream_rr_peers_t  *peers = data;
+
+    if (ngx_atomic_fetch_add(&peers->refs, -1) == 1) {
+        ngx_http_upstream_rr_free_peers(peers);
+    }
+}
+
+
+static void
+ngx_http_upstream_rr_free_peers(ngx_http_upstream_rr_peers_t *peers)
+{
+#if (NGX_HTTP_SSL)
+    ngx_uint_t                     i;
+    ngx_http_upstream_rr_peers_t  *p;
+
+    for (p = peers; p; p = p->next) {
+        for (i = 0; i < p->number; i++) {
+
+            if (p->peer[i].ssl_session == NULL) {
+                continue;
+            }
+
+            if (p->shpool) {
+                ngx_slab_free(p->shpool, p->peer[i].ssl_session);
+
+            } else {
+                ngx_ssl_free_session(p->peer[i].ssl_session);
+            }
+        }
+    }
+#endif
+
+    if (peers->shpool) {
+        ngx_slab_free(peers->shpool, peers);
+        return;
+    }
+
+    ngx_free(peers);
+}
+
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+ngx_int_t
+ngx_http_upstream_init_round_robin_zone(ngx_slab_pool_t *shpool,
+    ngx_http_upstream_srv_conf_t *us, ngx_log_t *log)
+{
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    peers = ngx_http_upstream_rr_copy_peers(us->peer.data, NULL, NULL, 0,
+                                            shpool, log);
+    if (peers == NULL) {
+        return NGX_ERROR;
+    }
+
+    us->peer.data = peers;
+
+    return NGX_OK;
+}
+
+#endif
+
+
 #if (NGX_HTTP_SSL)
 
 ngx_int_t
@@ -618,14 +1589,55 @@ ngx_http_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
 {
     ngx_http_upstream_rr_peer_data_t  *rrp = data;
 
-    ngx_int_t                     rc;
-    ngx_ssl_session_t            *ssl_session;
-    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_int_t                      rc;
+    ngx_ssl_session_t             *ssl_session;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    int                            len;
+    const u_char                  *p;
+    u_char                         buf[NGX_SSL_MAX_SESSION_SIZE];
+#endif
 
-    peer = &rrp->peers->peer[rrp->current];
+    peers = rrp->peers;
+    peer = &peers->peer[rrp->current];
 
-    /* TODO: threads only mutex */
-    /* ngx_lock_mutex(rrp->peers->mutex); */
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    if (peers->shpool) {
+
+        /* the session is kept serialized in the shared zone */
+
+        ngx_http_upstream_rr_peers_lock(peers);
+
+        len = peer->ssl_session_len;
+
+        if (len) {
+            ngx_memcpy(buf, peer->ssl_session, len);
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        if (len == 0) {
+            return NGX_OK;
+        }
+
+        p = buf;
+        ssl_session = d2i_SSL_SESSION(NULL, &p, len);
+
+        rc = ngx_ssl_set_session(pc->connection, ssl_session);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "set session: %p", ssl_session);
+
+        if (ssl_session) {
+            ngx_ssl_free_session(ssl_session);
+        }
+
+        return rc;
+    }
+
+#endif
 
     ssl_session = peer->ssl_session;
 
@@ -634,8 +1646,6 @@ ngx_http_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "set session: %p", ssl_session);
 
-    /* ngx_unlock_mutex(rrp->peers->mutex); */
-
     return rc;
 }
 
@@ -646,8 +1656,73 @@ ngx_http_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
 {
     ngx_http_upstream_rr_peer_data_t  *rrp = data;
 
-    ngx_ssl_session_t            *old_ssl_session, *ssl_session;
-    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_ssl_session_t             *old_ssl_session, *ssl_session;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    int                            len;
+    u_char                        *p;
+    u_char                         buf[NGX_SSL_MAX_SESSION_SIZE];
+#endif
+
+    peers = rrp->peers;
+    peer = &peers->peer[rrp->current];
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    if (peers->shpool) {
+
+        ssl_session = SSL_get0_session(pc->connection->ssl->connection);
+
+        if (ssl_session == NULL) {
+            return;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "save session: %p", ssl_session);
+
+        len = i2d_SSL_SESSION(ssl_session, NULL);
+
+        /* do not cache too big session */
+
+        if (len > NGX_SSL_MAX_SESSION_SIZE) {
+            return;
+        }
+
+        p = buf;
+        (void) i2d_SSL_SESSION(ssl_session, &p);
+
+        ngx_http_upstream_rr_peers_lock(peers);
+
+        if (len > peer->ssl_session_len) {
+            ngx_shmtx_lock(&peers->shpool->mutex);
+
+            if (peer->ssl_session) {
+                ngx_slab_free_locked(peers->shpool, peer->ssl_session);
+            }
+
+            peer->ssl_session = ngx_slab_alloc_locked(peers->shpool, len);
+
+            ngx_shmtx_unlock(&peers->shpool->mutex);
+
+            if (peer->ssl_session == NULL) {
+                peer->ssl_session_len = 0;
+
+                ngx_http_upstream_rr_peers_unlock(peers);
+                return;
+            }
+        }
+
+        peer->ssl_session_len = len;
+
+        ngx_memcpy(peer->ssl_session, buf, len);
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        return;
+    }
+
+#endif
 
     ssl_session = ngx_ssl_get_session(pc->connection);
 
@@ -658,16 +1733,11 @@ ngx_http_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "save session: %p", ssl_session);
 
-    peer = &rrp->peers->peer[rrp->current];
-
     /* TODO: threads only mutex */
-    /* ngx_lock_mutex(rrp->peers->mutex); */
 
     old_ssl_session = peer->ssl_session;
     peer->ssl_session = ssl_session;
 
-    /* ngx_unlock_mutex(rrp->peers->mutex); */
-
     if (old_ssl_session) {
 
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
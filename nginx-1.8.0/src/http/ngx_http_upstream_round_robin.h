@@ -24,6 +24,17 @@ typedef struct {
     ngx_int_t                       effective_weight;
     ngx_int_t                       weight;
 
+    ngx_uint_t                      conns;
+    ngx_uint_t                      max_conns;
+
+    /* the connections carried over from and to the peers rebuilt */
+    ngx_uint_t                      carried;
+    ngx_uint_t                      moved;
+
+    /* the decayed average of the response time, in 1/16 ms */
+    ngx_msec_t                      response_time;
+    ngx_msec_t                      response_updated;
+
     ngx_uint_t                      fails;
     time_t                          accessed;
     time_t                          checked;
@@ -31,10 +42,22 @@ typedef struct {
     ngx_uint_t                      max_fails;
     time_t                          fail_timeout;
 
+    /* the weight is ramped up after the peer returned to service */
+    ngx_msec_t                      slow_start;
+    ngx_msec_t                      start_time;
+
     ngx_uint_t                      down;          /* unsigned  down:1; */
 
+    /* the state of active health checks */
+    ngx_uint_t                      unhealthy;     /* unsigned  unhealthy:1; */
+    ngx_uint_t                      hc_fails;
+    ngx_uint_t                      hc_passes;
+    ngx_msec_t                      hc_checked;
+
 #if (NGX_HTTP_SSL)
-    ngx_ssl_session_t              *ssl_session;   /* local to a process */
+    /* ngx_ssl_session_t, or the serialized session in a shared zone */
+    void                           *ssl_session;
+    int                             ssl_session_len;
 #endif
 } ngx_http_upstream_rr_peer_t;
 
@@ -53,28 +76,85 @@ struct ngx_http_upstream_rr_peers_s {
 
     ngx_http_upstream_rr_peers_t   *next;
 
+    /* the peers state is shared by all worker processes */
+    ngx_slab_pool_t                *shpool;
+    ngx_atomic_t                    lock;
+
+    /* the peers rebuilt after the servers were re-resolved */
+    ngx_http_upstream_rr_peers_t   *current;
+    ngx_atomic_t                    refs;
+
     ngx_http_upstream_rr_peer_t     peer[1];
 };
 
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+#define ngx_http_upstream_rr_peers_lock(peers)                                \
+                                                                              \
+    if ((peers)->shpool) {                                                    \
+        ngx_spinlock(&(peers)->lock, ngx_pid, 1024);                          \
+    }
+
+#define ngx_http_upstream_rr_peers_unlock(peers)                              \
+                                                                              \
+    if ((peers)->shpool) {                                                    \
+        (void) ngx_atomic_cmp_set(&(peers)->lock, ngx_pid, 0);                \
+    }
+
+#else
+
+#define ngx_http_upstream_rr_peers_lock(peers)
+#define ngx_http_upstream_rr_peers_unlock(peers)
+
+#endif
+
+
+/* the share of its weight given to a peer in slow start, in percent */
+
+#define ngx_http_upstream_rr_peer_ramp(peer)                                  \
+    ((peer)->start_time ? ngx_http_upstream_rr_peer_ramp_up(peer) : 100)
+
+#define ngx_http_upstream_rr_peer_slow_start(peer)                            \
+                                                                              \
+    if ((peer)->slow_start) {                                                 \
+        (peer)->start_time = ngx_current_msec;                                \
+    }
+
+
 typedef struct {
     ngx_http_upstream_rr_peers_t   *peers;
+    /* the configured peers of an upstream with servers re-resolved */
+    ngx_http_upstream_rr_peers_t   *origin;
     ngx_uint_t                      current;
     uintptr_t                      *tried;
     uintptr_t                       data;
+    ngx_http_upstream_queue_t      *queue;
 } ngx_http_upstream_rr_peer_data_t;
 
 
 ngx_int_t ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us);
+ngx_int_t ngx_http_upstream_resolve_round_robin(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *us);
+#if (NGX_HTTP_UPSTREAM_ZONE)
+ngx_int_t ngx_http_upstream_init_round_robin_zone(ngx_slab_pool_t *shpool,
+    ngx_http_upstream_srv_conf_t *us, ngx_log_t *log);
+#endif
 ngx_int_t ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us);
+ngx_http_upstream_rr_peers_t *ngx_http_upstream_rr_peers_acquire(
+    ngx_http_upstream_srv_conf_t *us);
+void ngx_http_upstream_rr_peers_release(ngx_http_upstream_srv_conf_t *us,
+    ngx_http_upstream_rr_peers_t *peers);
 ngx_int_t ngx_http_upstream_create_round_robin_peer(ngx_http_request_t *r,
     ngx_http_upstream_resolved_t *ur);
 ngx_int_t ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc,
     void *data);
 void ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
+ngx_uint_t ngx_http_upstream_rr_peer_ramp_up(
+    ngx_http_upstream_rr_peer_t *peer);
 
 #if (NGX_HTTP_SSL)
 ngx_int_t
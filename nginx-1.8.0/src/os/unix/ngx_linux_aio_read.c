@@ -1,4 +1,3 @@
-
 /*
  * Copyright (C) Igor Sysoev
  * Copyright (C) Nginx, Inc.
@@ -10,13 +9,31 @@
 #include <ngx_event.h>
 
 
+/* the maximum number of iocbs passed to a single io_submit() */
+#define NGX_FILE_AIO_BATCH  64
+
+
 extern int            ngx_eventfd;
 extern aio_context_t  ngx_aio_ctx;
+extern ngx_uint_t     ngx_aio_requests;
 
 
+static ngx_event_aio_t *ngx_file_aio_create(ngx_file_t *file,
+    ngx_pool_t *pool);
+static void ngx_file_aio_post(ngx_event_aio_t *aio);
+static int64_t ngx_file_aio_sync(ngx_event_aio_t *aio);
 static void ngx_file_aio_event_handler(ngx_event_t *ev);
 
 
+/*
+ * 本轮事件循环中等待提交的iocb队列，由 ngx_file_aio_flush() 批量提交，
+ * 在途的请求数不超过 worker_aio_requests，超出的部分继续排队
+ */
+static ngx_queue_t    ngx_file_aio_queue;
+static ngx_uint_t     ngx_file_aio_queued;
+static ngx_uint_t     ngx_file_aio_active;
+
+
 static int
 io_submit(aio_context_t ctx, long n, struct iocb **paiocb)
 {
@@ -26,12 +43,24 @@ io_submit(aio_context_t ctx, long n, struct iocb **paiocb)
 
 ngx_int_t
 ngx_file_aio_init(ngx_file_t *file, ngx_pool_t *pool)
+{
+    file->aio = ngx_file_aio_create(file, pool);
+    if (file->aio == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_event_aio_t *
+ngx_file_aio_create(ngx_file_t *file, ngx_pool_t *pool)
 {
     ngx_event_aio_t  *aio;
 
     aio = ngx_pcalloc(pool, sizeof(ngx_event_aio_t));
     if (aio == NULL) {
-        return NGX_ERROR;
+        return NULL;
     }
 
     aio->file = file;
@@ -40,9 +69,7 @@ ngx_file_aio_init(ngx_file_t *file, ngx_pool_t *pool)
     aio->event.ready = 1;
     aio->event.log = file->log;
 
-    file->aio = aio;
-
-    return NGX_OK;
+    return aio;
 }
 
 
@@ -50,20 +77,28 @@ ssize_t
 ngx_file_aio_read(ngx_file_t *file, u_char *buf, size_t size, off_t offset,
     ngx_pool_t *pool)
 {
-    ngx_err_t         err;
-    struct iocb      *piocb[1];
     ngx_event_t      *ev;
     ngx_event_aio_t  *aio;
 
-    if (!ngx_file_aio) {
-        return ngx_read_file(file, buf, size, offset);
-    }
+    aio = file->aio;
 
-    if (file->aio == NULL && ngx_file_aio_init(file, pool) != NGX_OK) {
-        return NGX_ERROR;
+    /* an operation completed after aio was disabled still has to be reaped */
+
+    if (aio == NULL || !aio->event.complete) {
+
+        if (!ngx_file_aio) {
+            return ngx_read_file(file, buf, size, offset);
+        }
+
+        if (aio == NULL) {
+            if (ngx_file_aio_init(file, pool) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            aio = file->aio;
+        }
     }
 
-    aio = file->aio;
     ev = &aio->event;
 
     if (!ev->ready) {
@@ -106,31 +141,366 @@ ngx_file_aio_read(ngx_file_t *file, u_char *buf, size_t size, off_t offset,
 
     ev->handler = ngx_file_aio_event_handler;
 
-    piocb[0] = &aio->aiocb;
+    ngx_file_aio_post(aio);
 
-    if (io_submit(ngx_aio_ctx, 1, piocb) == 1) {
-        ev->active = 1;
-        ev->ready = 0;
-        ev->complete = 0;
+    return NGX_AGAIN;
+}
+
+
+/*
+ * 异步写入一个缓冲区链表，第一次调用提交写操作并返回NGX_AGAIN，
+ * 操作完成后再次调用（cl可以为NULL）返回写入的字节数
+ */
+
+ssize_t
+ngx_file_aio_write_chain(ngx_file_t *file, ngx_chain_t *cl, off_t offset,
+    ngx_pool_t *pool)
+{
+    u_char           *prev;
+    size_t            size;
+    ngx_uint_t        n;
+    ngx_chain_t      *ln;
+    ngx_event_t      *ev;
+    struct iovec     *iov;
+    ngx_event_aio_t  *aio;
+
+    /*
+     * 写操作使用单独的ngx_event_aio_t，以免与发送同一临时文件时
+     * 提交的读操作互相取走对方的完成结果
+     */
+
+    aio = file->write_aio;
+
+    if (aio == NULL || !aio->event.complete) {
+
+        if (!ngx_file_aio) {
+            return ngx_write_chain_to_file(file, cl, offset, pool);
+        }
+
+        if (aio == NULL) {
+            aio = ngx_file_aio_create(file, pool);
+            if (aio == NULL) {
+                return NGX_ERROR;
+            }
+
+            file->write_aio = aio;
+        }
+    }
+
+    ev = &aio->event;
 
+    if (!ev->ready) {
+        ngx_log_error(NGX_LOG_ALERT, file->log, 0,
+                      "second aio post for \"%V\"", &file->name);
         return NGX_AGAIN;
     }
 
-    err = ngx_errno;
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, file->log, 0,
+                   "aio write complete:%d @%O %V",
+                   ev->complete, offset, &file->name);
 
-    if (err == NGX_EAGAIN) {
-        return ngx_read_file(file, buf, size, offset);
+    if (ev->complete) {
+        ev->active = 0;
+        ev->complete = 0;
+
+        if (aio->res < 0) {
+            ngx_set_errno(-aio->res);
+
+            ngx_log_error(NGX_LOG_CRIT, file->log, ngx_errno,
+                          "aio write \"%s\" failed", file->name.data);
+
+            return NGX_ERROR;
+        }
+
+        if ((size_t) aio->res != aio->nbytes) {
+            ngx_log_error(NGX_LOG_CRIT, file->log, 0,
+                          "aio write \"%s\" has written only %L of %uz",
+                          file->name.data, aio->res, aio->nbytes);
+
+            return NGX_ERROR;
+        }
+
+        ngx_set_errno(0);
+        return aio->res;
     }
 
-    ngx_log_error(NGX_LOG_CRIT, file->log, err,
-                  "io_submit(\"%V\") failed", &file->name);
+    /* count the iovecs, the neighbouring bufs are coalesced */
 
-    if (err == NGX_ENOSYS) {
-        ngx_file_aio = 0;
-        return ngx_read_file(file, buf, size, offset);
+    n = 0;
+    prev = NULL;
+
+    for (ln = cl; ln; ln = ln->next) {
+        if (prev != ln->buf->pos) {
+            n++;
+        }
+
+        prev = ln->buf->last;
+    }
+
+    if (n == 0 || n > IOV_MAX) {
+        return ngx_write_chain_to_file(file, cl, offset, pool);
+    }
+
+    if (aio->niov < n) {
+        aio->iov = ngx_palloc(pool, n * sizeof(struct iovec));
+        if (aio->iov == NULL) {
+            return NGX_ERROR;
+        }
+
+        aio->niov = n;
+    }
+
+    iov = aio->iov - 1;
+    prev = NULL;
+    size = 0;
+
+    for (ln = cl; ln; ln = ln->next) {
+        if (prev == ln->buf->pos) {
+            iov->iov_len += ln->buf->last - ln->buf->pos;
+
+        } else {
+            iov++;
+            iov->iov_base = (void *) ln->buf->pos;
+            iov->iov_len = ln->buf->last - ln->buf->pos;
+        }
+
+        size += ln->buf->last - ln->buf->pos;
+        prev = ln->buf->last;
     }
 
-    return NGX_ERROR;
+    ngx_memzero(&aio->aiocb, sizeof(struct iocb));
+
+    aio->aiocb.aio_data = (uint64_t) (uintptr_t) ev;
+    aio->aiocb.aio_fildes = file->fd;
+    aio->aiocb.aio_offset = offset;
+    aio->aiocb.aio_flags = IOCB_FLAG_RESFD;
+    aio->aiocb.aio_resfd = ngx_eventfd;
+
+    /* use pwrite() if there is the only iovec buffer */
+
+    if (n == 1) {
+        aio->aiocb.aio_lio_opcode = IOCB_CMD_PWRITE;
+        aio->aiocb.aio_buf = (uint64_t) (uintptr_t) aio->iov[0].iov_base;
+        aio->aiocb.aio_nbytes = size;
+
+    } else {
+        aio->aiocb.aio_lio_opcode = IOCB_CMD_PWRITEV;
+        aio->aiocb.aio_buf = (uint64_t) (uintptr_t) aio->iov;
+        aio->aiocb.aio_nbytes = n;
+    }
+
+    aio->nbytes = size;
+
+    ev->handler = ngx_file_aio_event_handler;
+
+    ngx_file_aio_post(aio);
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_file_aio_post(ngx_event_aio_t *aio)
+{
+    ngx_event_t  *ev;
+
+    if (ngx_file_aio_queue.prev == NULL) {
+        ngx_queue_init(&ngx_file_aio_queue);
+    }
+
+    ev = &aio->event;
+
+    ev->active = 1;
+    ev->ready = 0;
+    ev->complete = 0;
+
+    aio->start = ngx_current_msec;
+    aio->submitted = 0;
+
+    ngx_queue_insert_tail(&ngx_file_aio_queue, &aio->queue);
+    ngx_file_aio_queued++;
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_aio_queued, 1);
+#endif
+}
+
+
+/*
+ * 在事件循环进入 epoll_wait 之前调用，把排队的iocb批量提交给内核，
+ * 返回被同步完成并投递到 ngx_posted_events 队列中的请求数
+ */
+
+ngx_uint_t
+ngx_file_aio_flush(ngx_log_t *log)
+{
+    int               rc;
+    ngx_err_t         err;
+    ngx_uint_t        i, n, nsync;
+    ngx_queue_t      *q;
+    ngx_event_t      *ev;
+    ngx_event_aio_t  *aio;
+    struct iocb      *piocb[NGX_FILE_AIO_BATCH];
+
+    nsync = 0;
+
+    while (ngx_file_aio_queued) {
+
+        n = 0;
+
+        for (q = ngx_queue_head(&ngx_file_aio_queue);
+             q != ngx_queue_sentinel(&ngx_file_aio_queue)
+             && n < NGX_FILE_AIO_BATCH
+             && ngx_file_aio_active + n < ngx_aio_requests;
+             q = ngx_queue_next(q))
+        {
+            aio = ngx_queue_data(q, ngx_event_aio_t, queue);
+            piocb[n++] = &aio->aiocb;
+        }
+
+        if (n == 0) {
+            /* all the slots are busy, wait for completions */
+            break;
+        }
+
+        rc = io_submit(ngx_aio_ctx, n, piocb);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "io_submit: %d of %ui, active:%ui",
+                       rc, n, ngx_file_aio_active);
+
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_aio_batches, 1);
+#endif
+
+        if (rc > 0) {
+
+            for (i = 0; i < (ngx_uint_t) rc; i++) {
+                ev = (ngx_event_t *) (uintptr_t) piocb[i]->aio_data;
+                aio = ev->data;
+
+                ngx_queue_remove(&aio->queue);
+
+#if (NGX_STAT_STUB)
+                (void) ngx_atomic_fetch_add(ngx_stat_aio_submit_time,
+                                            ngx_current_msec - aio->start);
+#endif
+
+                aio->start = ngx_current_msec;
+                aio->submitted = 1;
+            }
+
+            ngx_file_aio_queued -= rc;
+            ngx_file_aio_active += rc;
+
+#if (NGX_STAT_STUB)
+            (void) ngx_atomic_fetch_add(ngx_stat_aio_submitted, rc);
+            (void) ngx_atomic_fetch_add(ngx_stat_aio_queued, -rc);
+            (void) ngx_atomic_fetch_add(ngx_stat_aio_active, rc);
+#endif
+
+            continue;
+        }
+
+        err = ngx_errno;
+
+        if (err == NGX_EAGAIN && ngx_file_aio_active) {
+            /* the kernel context is full, retry after completions */
+            break;
+        }
+
+        /* io_submit() has failed on the first iocb, complete it here */
+
+        ev = (ngx_event_t *) (uintptr_t) piocb[0]->aio_data;
+        aio = ev->data;
+
+        ngx_queue_remove(&aio->queue);
+        ngx_file_aio_queued--;
+
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_aio_queued, -1);
+#endif
+
+        if (err == NGX_ENOSYS || err == NGX_EAGAIN) {
+
+            if (err == NGX_ENOSYS && ngx_file_aio) {
+                ngx_log_error(NGX_LOG_CRIT, log, err, "io_submit() failed");
+                ngx_file_aio = 0;
+            }
+
+            aio->res = ngx_file_aio_sync(aio);
+
+        } else {
+            ngx_log_error(NGX_LOG_CRIT, ev->log, err,
+                          "io_submit(\"%V\") failed", &aio->file->name);
+
+            aio->res = -err;
+        }
+
+        ev->complete = 1;
+        ev->active = 0;
+        ev->ready = 1;
+
+        ngx_post_event(ev, &ngx_posted_events);
+
+        nsync++;
+    }
+
+    return nsync;
+}
+
+
+/* perform the operation synchronously if the kernel has not accepted it */
+
+static int64_t
+ngx_file_aio_sync(ngx_event_aio_t *aio)
+{
+    u_char        *buf;
+    off_t          offset;
+    ssize_t        n;
+    int64_t        total;
+    ngx_uint_t     i, niov;
+    struct iocb   *iocb;
+    struct iovec  *iov, one;
+
+    iocb = &aio->aiocb;
+    buf = (u_char *) (uintptr_t) iocb->aio_buf;
+    offset = iocb->aio_offset;
+
+    if (iocb->aio_lio_opcode == IOCB_CMD_PREAD) {
+        n = pread(iocb->aio_fildes, buf, iocb->aio_nbytes, offset);
+        return (n == -1) ? -ngx_errno : n;
+    }
+
+    if (iocb->aio_lio_opcode == IOCB_CMD_PWRITE) {
+        one.iov_base = buf;
+        one.iov_len = iocb->aio_nbytes;
+        iov = &one;
+        niov = 1;
+
+    } else {
+        iov = (struct iovec *) buf;
+        niov = iocb->aio_nbytes;
+    }
+
+    total = 0;
+
+    for (i = 0; i < niov; i++) {
+        n = pwrite(iocb->aio_fildes, iov[i].iov_base, iov[i].iov_len, offset);
+
+        if (n == -1) {
+            return -ngx_errno;
+        }
+
+        total += n;
+        offset += n;
+
+        if ((size_t) n != iov[i].iov_len) {
+            break;
+        }
+    }
+
+    return total;
 }
 
 
@@ -144,5 +514,17 @@ ngx_file_aio_event_handler(ngx_event_t *ev)
     ngx_log_debug2(NGX_LOG_DEBUG_CORE, ev->log, 0,
                    "aio event handler fd:%d %V", aio->fd, &aio->file->name);
 
+    if (aio->submitted) {
+        aio->submitted = 0;
+        ngx_file_aio_active--;
+
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_aio_active, -1);
+        (void) ngx_atomic_fetch_add(ngx_stat_aio_completed, 1);
+        (void) ngx_atomic_fetch_add(ngx_stat_aio_complete_time,
+                                    ngx_current_msec - aio->start);
+#endif
+    }
+
     aio->handler(ev);
 }
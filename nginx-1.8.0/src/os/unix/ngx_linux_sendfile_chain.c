@@ -23,6 +23,29 @@ static ssize_t ngx_linux_sendfile(ngx_connection_t *c, ngx_buf_t *file,
 static ngx_int_t ngx_linux_sendfile_thread(ngx_connection_t *c, ngx_buf_t *file,
     size_t size, size_t *sent);
 static void ngx_linux_sendfile_thread_handler(void *data, ngx_log_t *log);
+static size_t ngx_linux_sendfile_resident(ngx_connection_t *c,
+    ngx_buf_t *file, size_t size);
+static size_t ngx_linux_sendfile_mincore(ngx_connection_t *c, ngx_file_t *f,
+    off_t offset, size_t size);
+#if (NGX_HAVE_PREADV2_NOWAIT)
+static size_t ngx_linux_sendfile_nowait(ngx_connection_t *c, ngx_file_t *f,
+    off_t offset, size_t size);
+#endif
+
+
+/*
+ * the largest chunk sent inline after a single probe, the same window
+ * is read ahead when a chunk has to be offloaded to a thread
+ */
+
+#define NGX_SENDFILE_PROBE_SIZE  (1024 * 1024)
+
+/* pages probed one by one with RWF_NOWAIT */
+#define NGX_SENDFILE_PROBE_PAGES  16
+
+/* pages may be evicted, so a probe result is trusted for a short time */
+#define NGX_SENDFILE_RESIDENT_TIME  200
+
 #endif
 
 
@@ -57,6 +80,7 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
     ngx_iovec_t    header;
     struct iovec   headers[NGX_IOVS_PREALLOCATE];
 #if (NGX_THREADS)
+    size_t         resident;
     ngx_int_t      rc;
     ngx_uint_t     thread_handled, thread_complete;
 #endif
@@ -180,7 +204,32 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 #endif
 
 #if (NGX_THREADS)
-            if (file->file->thread_handler) {
+            resident = 0;
+
+            //上次交给线程池的sendfile已经完成时，需要先取回其结果
+            if (file->file->thread_handler
+                && (c->sendfile_task == NULL
+                    || !c->sendfile_task->event.complete))
+            {
+                //数据已经在页缓存中时直接发送，避免线程切换的开销
+                resident = ngx_linux_sendfile_resident(c, file, file_size);
+
+                if (resident) {
+                    send -= file_size - resident;
+                    file_size = resident;
+
+#if (NGX_STAT_STUB)
+                    (void) ngx_atomic_fetch_add(ngx_stat_sendfile_inline, 1);
+#endif
+
+                } else {
+#if (NGX_STAT_STUB)
+                    (void) ngx_atomic_fetch_add(ngx_stat_sendfile_offloaded, 1);
+#endif
+                }
+            }
+
+            if (file->file->thread_handler && resident == 0) {
                 rc = ngx_linux_sendfile_thread(c, file, file_size, &sent);
 
                 switch (rc) {
@@ -308,6 +357,9 @@ typedef struct {
 
     size_t         sent;
     ngx_err_t      err;
+
+    off_t          readahead;   //发送完成后需要预读的数据的起始位置
+    size_t         readahead_size;
 } ngx_linux_sendfile_ctx_t;
 
 
@@ -358,6 +410,22 @@ ngx_linux_sendfile_thread(ngx_connection_t *c, ngx_buf_t *file, size_t size,
     ctx->socket = c->fd;
     ctx->size = size;
 
+    /* read ahead the window that follows the chunk being offloaded */
+
+    ctx->readahead = ngx_max(file->file_pos + (off_t) size,
+                             file->file->readahead);
+    ctx->readahead_size = 0;
+
+    if (ctx->readahead < file->file_pos + (off_t) size
+                         + NGX_SENDFILE_PROBE_SIZE)
+    {
+        ctx->readahead_size = (size_t) (file->file_pos + size
+                                        + NGX_SENDFILE_PROBE_SIZE
+                                        - ctx->readahead);
+
+        file->file->readahead = ctx->readahead + ctx->readahead_size;
+    }
+
     if (wev->active) {
         flags = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ? NGX_CLEAR_EVENT
                                                         : NGX_LEVEL_EVENT;
@@ -414,6 +482,207 @@ again:
     if (ctx->err == NGX_EINTR) {
         goto again;
     }
+
+#if (NGX_HAVE_POSIX_FADVISE)
+
+    if (ctx->readahead_size
+        && posix_fadvise(file->file->fd, ctx->readahead,
+                         (off_t) ctx->readahead_size, POSIX_FADV_WILLNEED)
+           == 0)
+    {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "sendfile readahead: %uz @%O",
+                       ctx->readahead_size, ctx->readahead);
+    }
+
+#endif
 }
 
+
+/*
+ * returns the size of the chunk that may be sent without blocking on disk.
+ * mincore() is used for files owned by the worker user, e.g. cache and temp
+ * files; for other files since Linux 5.0 it reports all pages as resident,
+ * so each page of a shorter window is read with RWF_NOWAIT instead.
+ * The result is remembered in the file for a short time to not probe
+ * again while the file is sent sequentially.
+ */
+
+static size_t
+ngx_linux_sendfile_resident(ngx_connection_t *c, ngx_buf_t *file, size_t size)
+{
+    ngx_file_t       *f;
+    ngx_msec_int_t    age;
+    ngx_file_info_t   fi;
+
+    f = file->file;
+
+    if (size > NGX_SENDFILE_PROBE_SIZE) {
+        size = NGX_SENDFILE_PROBE_SIZE;
+    }
+
+    age = (ngx_msec_int_t) (ngx_current_msec - f->resident_time);
+
+    if (file->file_pos >= f->resident_start
+        && file->file_pos < f->resident_end
+        && age < NGX_SENDFILE_RESIDENT_TIME)
+    {
+        return ngx_min(size, (size_t) (f->resident_end - file->file_pos));
+    }
+
+    if (f->noprobe) {
+        return 0;
+    }
+
+    if (!f->probed) {
+        f->probed = 1;
+
+        if (ngx_fd_info(f->fd, &fi) != NGX_FILE_ERROR
+            && fi.st_uid == geteuid())
+        {
+            f->mincore = 1;
+        }
+    }
+
+    if (f->mincore) {
+        size = ngx_linux_sendfile_mincore(c, f, file->file_pos, size);
+
+    } else {
+#if (NGX_HAVE_PREADV2_NOWAIT)
+        size = ngx_linux_sendfile_nowait(c, f, file->file_pos, size);
+#else
+        f->noprobe = 1;
+        size = 0;
+#endif
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendfile resident: %uz @%O", size, file->file_pos);
+
+    f->resident_start = file->file_pos;
+    f->resident_end = file->file_pos + size;
+    f->resident_time = ngx_current_msec;
+
+    return size;
+}
+
+
+static size_t
+ngx_linux_sendfile_mincore(ngx_connection_t *c, ngx_file_t *f, off_t offset,
+    size_t size)
+{
+    off_t       start;
+    size_t      len, resident;
+    u_char     *addr;
+    ngx_uint_t  i, n;
+    u_char      vec[NGX_SENDFILE_PROBE_SIZE / 4096 + 2];
+
+    start = offset & ~((off_t) ngx_pagesize - 1);
+    len = (size_t) (offset - start) + size;
+    n = (len + ngx_pagesize - 1) / ngx_pagesize;
+
+    if (n > sizeof(vec)) {
+        n = sizeof(vec);
+        len = n * ngx_pagesize;
+    }
+
+    addr = mmap(NULL, len, PROT_READ, MAP_SHARED, f->fd, start);
+
+    if (addr == MAP_FAILED) {
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, ngx_errno,
+                       "mmap() @%O for mincore() failed", start);
+        f->mincore = 0;
+        return 0;
+    }
+
+    if (mincore(addr, len, vec) == -1) {
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, ngx_errno,
+                       "mincore() @%O failed", start);
+        f->mincore = 0;
+        n = 0;
+    }
+
+    if (munmap(addr, len) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno,
+                      "munmap(%uz) failed", len);
+    }
+
+    //只发送从当前位置开始连续驻留在页缓存中的部分
+    for (i = 0; i < n; i++) {
+        if (!(vec[i] & 1)) {
+            break;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendfile mincore: %ui of %ui pages", i, n);
+
+    if (i == 0) {
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "sendfile not resident @%O", offset);
+        return 0;
+    }
+
+    resident = (size_t) (start + i * ngx_pagesize - offset);
+
+    return ngx_min(resident, size);
+}
+
+
+#if (NGX_HAVE_PREADV2_NOWAIT)
+
+static size_t
+ngx_linux_sendfile_nowait(ngx_connection_t *c, ngx_file_t *f, off_t offset,
+    size_t size)
+{
+    off_t          pos, end, last;
+    u_char         ch;
+    ssize_t        n;
+    ngx_err_t      err;
+    ngx_uint_t     i;
+    struct iovec   iov;
+
+    iov.iov_base = &ch;
+    iov.iov_len = 1;
+
+    pos = offset;
+    end = offset;
+    last = offset + (off_t) size;
+
+    //逐页读取一个字节，直到遇到不在页缓存中的页
+    for (i = 0; i < NGX_SENDFILE_PROBE_PAGES && pos < last; i++) {
+
+        n = preadv2(f->fd, &iov, 1, pos, RWF_NOWAIT);
+
+        if (n != 1) {
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err != NGX_EAGAIN) {
+                    //文件系统不支持RWF_NOWAIT，以后不再探测该文件
+                    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, err,
+                                   "preadv2(RWF_NOWAIT) @%O failed", pos);
+                    f->noprobe = 1;
+                }
+            }
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "sendfile not resident @%O", pos);
+            break;
+        }
+
+        pos = (pos & ~((off_t) ngx_pagesize - 1)) + ngx_pagesize;
+        end = pos;
+    }
+
+    return (size_t) (ngx_min(end, last) - offset);
+}
+
+#endif
+
 #endif /* NGX_THREADS */